@@ -0,0 +1,468 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRegExp>
+#include <QTemporaryDir>
+#include <QVector>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <openbr/openbr.h>
+#include <openbr/openbr_plugin.h>
+
+/*!
+ * \ingroup cli
+ * \page cli_benchmark Benchmark
+ * \brief Measures the throughput of OpenBR hot paths on deterministic synthetic data.
+ *
+ * Every benchmark is run once to warm up and then \c -repeat times, reporting items and bytes per second
+ * along with percentile latencies of a single repetition.
+ * The 90th and 99th percentiles are only reported with at least 100 repetitions, below that they would just be the slowest ones.
+ * Results are printed as a table, and written as JSON or CSV (by extension) to the \c -output file for regression tracking.
+ * Other \c -key \c value pairs set global properties, e.g. \c -parallelism \c 1.
+ * \code
+ * $ br_benchmark -filter "Distance/.*" -repeat 20 -output baseline.json
+ * \endcode
+ */
+
+using namespace br;
+
+// Items and bytes processed by one repetition of a benchmark
+struct Work
+{
+    qint64 items, bytes;
+    Work(qint64 items = 0, qint64 bytes = 0) : items(items), bytes(bytes) {}
+};
+
+class Benchmark
+{
+public:
+    virtual ~Benchmark() {}
+    virtual QString name() const = 0;
+    virtual void setup() {}
+    virtual Work run() = 0;
+};
+
+// Repetitions needed to report the 90th and 99th percentile latencies
+static const int MinTailSamples = 100;
+
+struct Result
+{
+    QString name;
+    int repeat;
+    double seconds, itemsPerSecond, bytesPerSecond, p50, p90, p99; // Latencies in milliseconds
+    bool tails; // p90 and p99 are set
+
+    // Empty without enough repetitions
+    QString tail(double latency) const { return tails ? QString::number(latency) : QString(); }
+};
+
+static qint64 bytes(const Template &t)
+{
+    qint64 size = 0;
+    foreach (const cv::Mat &m, t)
+        size += qint64(m.total()) * m.elemSize();
+    return size;
+}
+
+static qint64 bytes(const TemplateList &templates)
+{
+    qint64 size = 0;
+    foreach (const Template &t, templates)
+        size += bytes(t);
+    return size;
+}
+
+// Uniformly random matrices labeled round robin from classes, the same for a given seed
+static TemplateList synthesize(quint64 seed, int count, int rows, int cols, int type, int classes)
+{
+    cv::RNG rng(seed);
+    TemplateList templates;
+    for (int i=0; i<count; i++) {
+        cv::Mat m(rows, cols, type);
+        if (CV_MAT_DEPTH(type) == CV_32F) rng.fill(m, cv::RNG::UNIFORM, 0, 1);
+        else                              rng.fill(m, cv::RNG::UNIFORM, 0, 256);
+
+        File file(QString("synthetic/%1_%2.png").arg(seed).arg(i, 5, 10, QChar('0')));
+        file.set("Label", i % classes);
+        const QByteArray id = QCryptographicHash::hash(file.name.toUtf8(), QCryptographicHash::Md5).toHex();
+        file.set("ImageID", QString(id));
+        file.set("AlgorithmID", 2);
+        templates.append(Template(file, m));
+    }
+    return templates;
+}
+
+// Scores each query against the targets with Distance::compare(targets, query)
+class DistanceBenchmark : public Benchmark
+{
+protected:
+    QString title, description;
+    TemplateList targets, queries, training;
+    QSharedPointer<Distance> distance;
+
+public:
+    DistanceBenchmark(const QString &title, const QString &description, const TemplateList &targets, const TemplateList &queries, const TemplateList &training = TemplateList())
+        : title(title), description(description), targets(targets), queries(queries), training(training) {}
+
+    QString name() const { return "Distance/" + title; }
+
+    void setup()
+    {
+        distance = QSharedPointer<Distance>(Distance::make(description, NULL));
+        if (!training.isEmpty())
+            distance->train(training);
+    }
+
+    Work run()
+    {
+        foreach (const Template &query, queries)
+            distance->compare(targets, query);
+        return Work(qint64(targets.size()) * queries.size(), bytes(targets) * queries.size() + bytes(queries));
+    }
+};
+
+// Fills a self-similarity matrix with the threaded Distance::compare(target, query, output)
+class MatrixBenchmark : public Benchmark
+{
+    QString title, description;
+    TemplateList templates;
+    QSharedPointer<Distance> distance;
+
+public:
+    MatrixBenchmark(const QString &title, const QString &description, const TemplateList &templates)
+        : title(title), description(description), templates(templates) {}
+
+    QString name() const { return "Matrix/" + title; }
+
+    void setup()
+    {
+        distance = QSharedPointer<Distance>(Distance::make(description, NULL));
+    }
+
+    Work run()
+    {
+        QScopedPointer<MatrixOutput> output(MatrixOutput::make(templates.files(), templates.files()));
+        distance->compare(templates, templates, output.data());
+        return Work(qint64(templates.size()) * templates.size(), bytes(templates) * 2);
+    }
+};
+
+// Product quantization codes are trained and encoded in setup, only comparisons are timed
+class ProductQuantizationBenchmark : public DistanceBenchmark
+{
+    TemplateList quantizationTraining;
+    QSharedPointer<Transform> quantization; // Owns the lookup tables the codes refer to
+
+public:
+    ProductQuantizationBenchmark(const TemplateList &training, const TemplateList &targets, const TemplateList &queries)
+        : DistanceBenchmark("ProductQuantization", "ProductQuantization", targets, queries), quantizationTraining(training) {}
+
+    void setup()
+    {
+        quantization = QSharedPointer<Transform>(Transform::make("ProductQuantization(4)", NULL));
+        quantization->train(quantizationTraining);
+        TemplateList encodedTargets, encodedQueries;
+        quantization->project(targets, encodedTargets);
+        quantization->project(queries, encodedQueries);
+        targets = encodedTargets;
+        queries = encodedQueries;
+        DistanceBenchmark::setup();
+    }
+};
+
+// Writes templates to a fresh gallery, or reads them back
+class GalleryBenchmark : public Benchmark
+{
+    QString format, path;
+    bool write;
+    TemplateList templates;
+
+public:
+    GalleryBenchmark(const QString &format, const QString &directory, bool write, const TemplateList &templates)
+        : format(format), path(directory + "/gallery." + format), write(write), templates(templates) {}
+
+    QString name() const { return QString("Gallery/%1/%2").arg(format, write ? "Write" : "Read"); }
+
+    void setup()
+    {
+        if (!write)
+            writeGallery();
+    }
+
+    Work run()
+    {
+        if (write) {
+            writeGallery();
+            return Work(templates.size(), QFileInfo(path).size());
+        }
+
+        QScopedPointer<Gallery> gallery(Gallery::make(path));
+        const TemplateList read = gallery->read();
+        return Work(read.size(), QFileInfo(path).size());
+    }
+
+private:
+    void writeGallery()
+    {
+        QFile::remove(path);
+        QScopedPointer<Gallery> gallery(Gallery::make(path));
+        gallery->writeBlock(templates);
+    }
+};
+
+// Evaluates a score matrix against its mask, or in place against the galleries' labels
+class EvalBenchmark : public Benchmark
+{
+    QString directory;
+    bool inplace;
+    TemplateList targets, queries;
+
+public:
+    EvalBenchmark(const QString &directory, bool inplace, const TemplateList &targets, const TemplateList &queries)
+        : directory(directory), inplace(inplace), targets(targets), queries(queries) {}
+
+    QString name() const { return inplace ? "Eval/InplaceEval" : "Eval/Evaluate"; }
+
+    void setup()
+    {
+        const QString target = directory + "/target.csv";
+        const QString query = directory + "/query.csv";
+        if (QFileInfo(directory + "/scores.mtx").exists())
+            return;
+
+        {
+            QScopedPointer<Gallery> targetGallery(Gallery::make(target));
+            QScopedPointer<Gallery> queryGallery(Gallery::make(query));
+            targetGallery->writeBlock(targets);
+            queryGallery->writeBlock(queries);
+        }
+        br_make_mask(qPrintable(target), qPrintable(query), qPrintable(directory + "/scores.mask"));
+
+        // Genuine pairs score higher on average so the curves are not degenerate
+        cv::RNG rng(2);
+        QScopedPointer<Output> output(Output::make(directory + "/scores.mtx", targets.files(), queries.files()));
+        output->set_blockRows(INT_MAX);
+        output->set_blockCols(INT_MAX);
+        output->setBlock(0, 0);
+        for (int i=0; i<queries.size(); i++)
+            for (int j=0; j<targets.size(); j++)
+                output->setRelative(float(rng.gaussian(1)) + (queries[i].file.get<int>("Label") == targets[j].file.get<int>("Label") ? 2 : 0), i, j);
+    }
+
+    Work run()
+    {
+        const QString simmat = directory + "/scores.mtx";
+        if (inplace) br_inplace_eval(qPrintable(simmat), qPrintable(directory + "/target.csv"), qPrintable(directory + "/query.csv"));
+        else         br_eval(qPrintable(simmat), qPrintable(directory + "/scores.mask"));
+        return Work(qint64(targets.size()) * queries.size(), qint64(targets.size()) * queries.size() * (sizeof(float) + sizeof(uchar)));
+    }
+};
+
+// Projects templates through a transform, training it in setup when needed
+class TransformBenchmark : public Benchmark
+{
+    QString title, description;
+    TemplateList templates, training;
+    QSharedPointer<Transform> transform;
+
+public:
+    TransformBenchmark(const QString &title, const QString &description, const TemplateList &templates, const TemplateList &training = TemplateList())
+        : title(title), description(description), templates(templates), training(training) {}
+
+    QString name() const { return title; }
+
+    void setup()
+    {
+        transform = QSharedPointer<Transform>(Transform::make(description, NULL));
+        if (transform->trainable)
+            transform->train(training);
+    }
+
+    Work run()
+    {
+        TemplateList projected;
+        transform->projectUpdate(templates, projected);
+        return Work(templates.size(), bytes(templates));
+    }
+};
+
+static double percentile(const QVector<double> &sorted, double p)
+{
+    if (sorted.isEmpty()) return 0;
+    const int rank = std::min(sorted.size()-1, std::max(0, int(ceil(p * sorted.size())) - 1));
+    return sorted[rank];
+}
+
+static Result measure(Benchmark *benchmark, int repeat)
+{
+    benchmark->setup();
+    benchmark->run();
+
+    Work total;
+    QVector<double> latencies;
+    QElapsedTimer timer;
+    qint64 nsecs = 0;
+    for (int i=0; i<repeat; i++) {
+        timer.start();
+        const Work work = benchmark->run();
+        const qint64 elapsed = timer.nsecsElapsed();
+        nsecs += elapsed;
+        latencies.append(elapsed / 1e6);
+        total.items += work.items;
+        total.bytes += work.bytes;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    Result result;
+    result.name = benchmark->name();
+    result.repeat = repeat;
+    result.seconds = std::max(nsecs, qint64(1)) / 1e9;
+    result.itemsPerSecond = total.items / result.seconds;
+    result.bytesPerSecond = total.bytes / result.seconds;
+    result.p50 = percentile(latencies, 0.50);
+    result.tails = repeat >= MinTailSamples;
+    result.p90 = result.tails ? percentile(latencies, 0.90) : 0;
+    result.p99 = result.tails ? percentile(latencies, 0.99) : 0;
+    return result;
+}
+
+static void writeResults(const QString &file, const QList<Result> &results)
+{
+    QByteArray data;
+    if (QFileInfo(file).suffix() == "json") {
+        QJsonArray benchmarks;
+        foreach (const Result &result, results) {
+            QJsonObject object;
+            object.insert("name", result.name);
+            object.insert("repeat", result.repeat);
+            object.insert("seconds", result.seconds);
+            object.insert("itemsPerSecond", result.itemsPerSecond);
+            object.insert("bytesPerSecond", result.bytesPerSecond);
+            object.insert("p50Ms", result.p50);
+            if (result.tails) {
+                object.insert("p90Ms", result.p90);
+                object.insert("p99Ms", result.p99);
+            }
+            benchmarks.append(object);
+        }
+        QJsonObject report;
+        report.insert("version", QString(br_version()));
+        report.insert("parallelism", Globals->parallelism);
+        report.insert("benchmarks", benchmarks);
+        data = QJsonDocument(report).toJson();
+    } else {
+        data = "Name,Repeat,Seconds,ItemsPerSecond,BytesPerSecond,P50Ms,P90Ms,P99Ms\n";
+        foreach (const Result &result, results)
+            data += QString("%1,%2,%3,%4,%5,%6,%7,%8\n").arg(result.name, QString::number(result.repeat), QString::number(result.seconds),
+                                                              QString::number(result.itemsPerSecond), QString::number(result.bytesPerSecond),
+                                                              QString::number(result.p50), result.tail(result.p90), result.tail(result.p99)).toUtf8();
+    }
+
+    QFile output(file);
+    if (!output.open(QFile::WriteOnly) || (output.write(data) != data.size()))
+        qFatal("Failed to write %s.", qPrintable(file));
+}
+
+int main(int argc, char *argv[])
+{
+    br::Context::initialize(argc, argv, "", false);
+
+    QRegExp filter(".*");
+    int repeat = 10;
+    QString outputFile;
+    for (int i=1; i<argc; i++) {
+        if ((argv[i][0] != '-') || (i+1 >= argc)) qFatal("Expected -key value pairs, got: %s", argv[i]);
+        const QString key = argv[i] + 1;
+        const QString value = argv[++i];
+        if      (key == "filter") filter = QRegExp(value);
+        else if (key == "repeat") repeat = std::max(1, value.toInt());
+        else if (key == "output") outputFile = value;
+        else                      Globals->setProperty(key, value);
+    }
+    Globals->quiet = true;
+
+    QTemporaryDir directory;
+    if (!directory.isValid())
+        qFatal("Failed to create a temporary directory.");
+
+    const TemplateList byteTargets = synthesize(1, 1000, 1, 1024, CV_8UC1, 100);
+    const TemplateList byteQueries = synthesize(2, 100, 1, 1024, CV_8UC1, 100);
+    const TemplateList floatTargets = synthesize(3, 1000, 1, 256, CV_32FC1, 100);
+    const TemplateList floatQueries = synthesize(4, 100, 1, 256, CV_32FC1, 100);
+    const TemplateList quantizationTraining = synthesize(5, 512, 1, 32, CV_32FC1, 64);
+    const TemplateList images = synthesize(6, 200, 128, 128, CV_8UC1, 20);
+    const TemplateList pedestrians = synthesize(7, 200, 128, 64, CV_8UC1, 20);
+    const TemplateList vectors = synthesize(8, 500, 32, 32, CV_32FC1, 50);
+
+    QList<Benchmark*> benchmarks;
+    benchmarks.append(new DistanceBenchmark("ByteL1", "ByteL1", byteTargets, byteQueries));
+    benchmarks.append(new DistanceBenchmark("HalfByteL1", "HalfByteL1", byteTargets, byteQueries));
+    benchmarks.append(new DistanceBenchmark("Dist/L1", "Dist(L1)", floatTargets, floatQueries));
+    benchmarks.append(new DistanceBenchmark("Dist/L2", "Dist(L2)", floatTargets, floatQueries));
+    benchmarks.append(new DistanceBenchmark("Dist/Cosine", "Dist(Cosine)", floatTargets, floatQueries));
+    benchmarks.append(new DistanceBenchmark("Dist/ChiSquared", "Dist(ChiSquared)", floatTargets, floatQueries));
+    benchmarks.append(new DistanceBenchmark("BayesianQuantization", "BayesianQuantization", byteTargets, byteQueries, byteTargets));
+    benchmarks.append(new ProductQuantizationBenchmark(quantizationTraining, synthesize(9, 1000, 1, 32, CV_32FC1, 100), synthesize(10, 100, 1, 32, CV_32FC1, 100)));
+    benchmarks.append(new MatrixBenchmark("ByteL1", "ByteL1", byteTargets));
+    foreach (const QString &format, QStringList() << "gal" << "ut" << "csv") {
+        benchmarks.append(new GalleryBenchmark(format, directory.path(), true, byteTargets));
+        benchmarks.append(new GalleryBenchmark(format, directory.path(), false, byteTargets));
+    }
+    benchmarks.append(new EvalBenchmark(directory.path(), false, floatTargets, floatQueries));
+    benchmarks.append(new EvalBenchmark(directory.path(), true, floatTargets, floatQueries));
+    benchmarks.append(new TransformBenchmark("Stream/Identity", "Stream(Identity+Identity+Identity+Identity)", images));
+    benchmarks.append(new TransformBenchmark("Pipe/Identity", "Identity+Identity+Identity+Identity", images));
+    benchmarks.append(new TransformBenchmark("Transform/LBP", "LBP(1,2)", images));
+    benchmarks.append(new TransformBenchmark("Transform/LBPRegions", "LBP(1,2)+RectRegions(8,8,6,6)+Hist(59)", images));
+    benchmarks.append(new TransformBenchmark("Transform/LBPHist", "LBPHist(1,2,false,8,8,6,6)", images));
+    benchmarks.append(new TransformBenchmark("Transform/LTP", "LTP", images));
+    benchmarks.append(new TransformBenchmark("Transform/HoG", "HoGDescriptor", pedestrians));
+    benchmarks.append(new TransformBenchmark("Transform/Gabor", "CvtFloat+Gabor(lambda=8,theta=0,psi=0,sigma=4,gamma=1,component=Magnitude)", images));
+    benchmarks.append(new TransformBenchmark("Transform/PCA", "PCA(0.95)", vectors, vectors));
+
+    if (repeat < MinTailSamples)
+        printf("P90 and P99 need -repeat %d or more and are not reported.\n", MinTailSamples);
+
+    QList<Result> results;
+    printf("%-32s %14s %14s %10s %10s %10s\n", "Benchmark", "Items/s", "MB/s", "P50 ms", "P90 ms", "P99 ms");
+    foreach (Benchmark *benchmark, benchmarks) {
+        if (!filter.exactMatch(benchmark->name()))
+            continue;
+        const Result result = measure(benchmark, repeat);
+        printf("%-32s %14.1f %14.2f %10.3f %10s %10s\n", qPrintable(result.name), result.itemsPerSecond,
+               result.bytesPerSecond / (1024*1024), result.p50,
+               result.tails ? qPrintable(QString::number(result.p90, 'f', 3)) : "-",
+               result.tails ? qPrintable(QString::number(result.p99, 'f', 3)) : "-");
+        fflush(stdout);
+        results.append(result);
+    }
+    qDeleteAll(benchmarks);
+
+    if (!outputFile.isEmpty())
+        writeResults(outputFile, results);
+
+    br::Context::finalize();
+    return 0;
+}
@@ -0,0 +1,244 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QList>
+#include <QMutex>
+#include <QThreadStorage>
+#include <QVector>
+#include <stddef.h>
+#include <algorithm>
+#include <openbr/openbr_plugin.h>
+#include "arena.h"
+
+using namespace br;
+
+namespace
+{
+
+const int MinClass = 6;  // 64 bytes
+const int MaxClass = 26; // 64 MB, larger buffers always return to the heap
+const qint64 CacheBudget = qint64(64) << 20; // Free bytes kept per thread
+
+// Precedes every buffer, cv::Mat reference counts it through refcount
+struct Header
+{
+    Arena::Thread *owner;
+    size_t capacity;
+    int sizeClass; // -1 if the buffer is not recycled
+    int refcount;
+};
+
+const size_t HeaderSize = (sizeof(Header) + 15) & ~size_t(15);
+
+Header *header(int *refcount)
+{
+    return reinterpret_cast<Header*>(reinterpret_cast<char*>(refcount) - offsetof(Header, refcount));
+}
+
+uchar *payload(Header *h)
+{
+    return reinterpret_cast<uchar*>(h) + HeaderSize;
+}
+
+bool enabled()
+{
+    return Globals && Globals->arena;
+}
+
+} // namespace
+
+struct Arena::Thread
+{
+    QMutex mutex; // Taken by every thread that releases a buffer allocated here
+    QVector<Header*> free[MaxClass+1];
+    qint64 live, peak, cached, hits, misses;
+    qint64 steadySum, steadySamples; // Live bytes when the outermost scope closes
+    int depth; // Open scopes, only used by the owning thread
+
+    Thread() : live(0), peak(0), cached(0), hits(0), misses(0), steadySum(0), steadySamples(0), depth(0) {}
+
+    static Thread *current();
+
+    Header *acquire(size_t size)
+    {
+        int sizeClass = MinClass;
+        while ((sizeClass <= MaxClass) && ((size_t(1) << sizeClass) < size))
+            sizeClass++;
+        const bool recycled = sizeClass <= MaxClass;
+        const size_t capacity = recycled ? (size_t(1) << sizeClass) : size;
+
+        Header *h = NULL;
+        {
+            QMutexLocker locker(&mutex);
+            if (recycled && !free[sizeClass].isEmpty()) {
+                h = free[sizeClass].last();
+                free[sizeClass].removeLast();
+                cached -= capacity;
+                hits++;
+            } else {
+                misses++;
+            }
+            live += capacity;
+            peak = std::max(peak, live);
+        }
+
+        if (!h) {
+            h = static_cast<Header*>(cv::fastMalloc(HeaderSize + capacity));
+            h->owner = this;
+            h->capacity = capacity;
+            h->sizeClass = recycled ? sizeClass : -1;
+        }
+        return h;
+    }
+
+    void release(Header *h)
+    {
+        QMutexLocker locker(&mutex);
+        live -= h->capacity;
+        if ((h->sizeClass >= 0) && (cached + qint64(h->capacity) <= CacheBudget)) {
+            free[h->sizeClass].append(h);
+            cached += h->capacity;
+            return;
+        }
+        locker.unlock();
+        cv::fastFree(h);
+    }
+
+    void trim()
+    {
+        QMutexLocker locker(&mutex);
+        for (int i=0; i<=MaxClass; i++) {
+            foreach (Header *h, free[i])
+                cv::fastFree(h);
+            free[i].clear();
+        }
+        cached = 0;
+    }
+};
+
+// Never deleted, buffers may be released into an arena after its thread exits or during static destruction
+static QMutex *const threadsLock = new QMutex();
+static QList<Arena::Thread*> *const threads = new QList<Arena::Thread*>();
+
+// Not a pointer, QThreadStorage would delete it when the thread exits
+struct CurrentThread
+{
+    Arena::Thread *thread;
+    CurrentThread() : thread(NULL) {}
+};
+
+static QThreadStorage<CurrentThread> currentThread;
+
+Arena::Thread *Arena::Thread::current()
+{
+    if (!currentThread.hasLocalData()) {
+        CurrentThread current;
+        current.thread = new Thread();
+        currentThread.setLocalData(current);
+        QMutexLocker locker(threadsLock);
+        threads->append(current.thread);
+    }
+    return currentThread.localData().thread;
+}
+
+// Stateless, buffers find their arena through their header
+class ArenaAllocator : public cv::MatAllocator
+{
+public:
+    void allocate(int dims, const int *sizes, int type, int *&refcount, uchar *&datastart, uchar *&data, size_t *step)
+    {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i=dims-1; i>=0; i--) {
+            step[i] = total;
+            total *= sizes[i];
+        }
+
+        Header *h = Arena::Thread::current()->acquire(total);
+        h->refcount = 1;
+        refcount = &h->refcount;
+        datastart = data = payload(h);
+    }
+
+    void deallocate(int *refcount, uchar *datastart, uchar *data)
+    {
+        (void) datastart;
+        (void) data;
+        if (!refcount) return;
+        Header *h = header(refcount);
+        h->owner->release(h);
+    }
+};
+
+// Never deleted, matrices may be released during static destruction
+static cv::MatAllocator *const arenaAllocator = new ArenaAllocator();
+
+/* Arena::Scope - public methods */
+Arena::Scope::Scope()
+    : thread(enabled() ? Thread::current() : NULL)
+{
+    if (thread)
+        thread->depth++;
+}
+
+Arena::Scope::~Scope()
+{
+    if (!thread || (--thread->depth > 0))
+        return;
+
+    QMutexLocker locker(&thread->mutex);
+    thread->steadySum += thread->live;
+    thread->steadySamples++;
+}
+
+/* Arena - public methods */
+cv::MatAllocator *Arena::allocator()
+{
+    return enabled() ? arenaAllocator : NULL;
+}
+
+void Arena::recycle(cv::Mat &buffer)
+{
+    // The allocator of a buffer that still holds data must not change
+    if (!buffer.data)
+        buffer.allocator = allocator();
+}
+
+QString Arena::statistics()
+{
+    qint64 peak = 0, steady = 0, cached = 0, hits = 0, misses = 0;
+    QMutexLocker locker(threadsLock);
+    foreach (Thread *thread, *threads) {
+        QMutexLocker threadLocker(&thread->mutex);
+        peak += thread->peak;
+        if (thread->steadySamples > 0)
+            steady += thread->steadySum / thread->steadySamples;
+        cached += thread->cached;
+        hits += thread->hits;
+        misses += thread->misses;
+    }
+
+    const double MB = 1024 * 1024;
+    return QString("Arena: %1 threads, %2 MB peak, %3 MB steady state, %4 MB free, %5% of %6 allocations recycled")
+            .arg(threads->size()).arg(peak / MB, 0, 'f', 1).arg(steady / MB, 0, 'f', 1).arg(cached / MB, 0, 'f', 1)
+            .arg((hits + misses) > 0 ? 100.0 * hits / (hits + misses) : 0, 0, 'f', 1).arg(hits + misses);
+}
+
+void Arena::trim()
+{
+    QMutexLocker locker(threadsLock);
+    foreach (Thread *thread, *threads)
+        thread->trim();
+}
@@ -0,0 +1,56 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_ARENA_H
+#define BR_ARENA_H
+
+#include <QString>
+#include <opencv2/core/core.hpp>
+
+namespace br
+{
+
+// Opt-in matrix storage recycled through per-thread, power of two size class free lists,
+// enabled by setting Globals->arena.
+// Only stream frame buffers use it, they are released and reallocated whenever something
+// downstream keeps a frame's pixels. Buffers are allocated from the calling thread's arena
+// and released on any thread back to the free lists of the thread that allocated them.
+// Stream stages open a Scope around each frame they process to sample steady state use.
+class Arena
+{
+public:
+    struct Thread;
+
+    class Scope
+    {
+    public:
+        Scope();
+        ~Scope(); // Leaving the outermost scope samples the thread's steady state use
+
+    private:
+        Thread *thread;
+        Q_DISABLE_COPY(Scope)
+    };
+
+    static cv::MatAllocator *allocator(); // NULL when disabled, meaning the OpenCV heap
+    static void recycle(cv::Mat &buffer); // Future allocations of an empty buffer come from allocator()
+    static QString statistics(); // Peak and steady state use across threads
+    static void trim(); // Return every free buffer to the heap
+};
+
+} // namespace br
+
+#endif // BR_ARENA_H
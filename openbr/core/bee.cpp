@@ -19,6 +19,13 @@
 #include <QtXml>
 #endif // BR_EMBEDDED
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif // __F16C__
+
 #include "bee.h"
 #include "opencvutils.h"
 #include "qtutils.h"
@@ -29,6 +36,206 @@ using namespace br;
 namespace BEE
 {
 
+static const float NoComparison = -std::numeric_limits<float>::max();
+
+// IEEE half conversion rounding to nearest even
+static inline quint16 toHalf(float value)
+{
+    quint32 x;
+    memcpy(&x, &value, sizeof(x));
+    const quint32 sign = (x >> 16) & 0x8000;
+    const int exponent = int((x >> 23) & 0xff) - 127 + 15;
+    quint32 mantissa = x & 0x7fffff;
+
+    if (((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0); // Infinity or NaN
+    if (exponent >= 31) return sign | 0x7c00; // Overflow
+    if (exponent < -10) return sign; // Underflow
+
+    int shift = 13;
+    quint32 half = (quint32(exponent) << 10);
+    if (exponent <= 0) { // Subnormal
+        mantissa |= 0x800000;
+        shift = 14 - exponent;
+        half = 0;
+    }
+    const quint32 remainder = mantissa & ((1u << shift) - 1);
+    const quint32 halfway = 1u << (shift - 1);
+    half += mantissa >> shift;
+    if ((remainder > halfway) || ((remainder == halfway) && (half & 1))) half++; // May carry into the exponent
+    return sign | half;
+}
+
+static inline float fromHalf(quint16 half)
+{
+    if (half == 0xfc00) return NoComparison; // -FLT_MAX overflows to negative infinity
+    const quint32 sign = quint32(half & 0x8000) << 16;
+    const quint32 exponent = (half >> 10) & 0x1f;
+    const quint32 mantissa = half & 0x3ff;
+    if (exponent == 0) {
+        const float value = std::ldexp(float(mantissa), -24);
+        return sign ? -value : value;
+    }
+    const quint32 x = sign | ((exponent == 31) ? (0xff << 23) : ((exponent + 112) << 23)) | (mantissa << 13);
+    float value;
+    memcpy(&value, &x, sizeof(value));
+    return value;
+}
+
+static void toHalf(const float *src, quint16 *dst, size_t size)
+{
+    size_t i = 0;
+#ifdef __F16C__
+    for (; i+8<=size; i+=8)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i), _mm256_cvtps_ph(_mm256_loadu_ps(src+i), 0));
+#endif // __F16C__
+    for (; i<size; i++)
+        dst[i] = toHalf(src[i]);
+}
+
+static void fromHalf(const quint16 *src, float *dst, size_t size)
+{
+    size_t i = 0;
+#ifdef __F16C__
+    const __m256 lowest = _mm256_set1_ps(NoComparison);
+    for (; i+8<=size; i+=8)
+        _mm256_storeu_ps(dst+i, _mm256_max_ps(lowest, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i)))));
+#endif // __F16C__
+    for (; i<size; i++)
+        dst[i] = fromHalf(src[i]);
+}
+
+template <typename T>
+static void quantize(const float *src, T *dst, size_t size, const QVector<float> &codebook)
+{
+    const float *begin = codebook.data() + 1, *end = codebook.data() + codebook.size();
+    for (size_t i=0; i<size; i++) {
+        if (src[i] == NoComparison) {
+            dst[i] = 0;
+            continue;
+        }
+        const float *upper = std::lower_bound(begin, end, src[i]);
+        if      (upper == end)   upper--;
+        else if (upper != begin) upper -= (src[i] - upper[-1] < upper[0] - src[i]) ? 1 : 0;
+        dst[i] = T(upper - codebook.data());
+    }
+}
+
+SimmatEncoding SimmatEncoding::make(const QString &name, const Mat &sample, float min, float max)
+{
+    SimmatEncoding encoding;
+    if      (name == "float")      encoding.type = 'F';
+    else if (name == "half")       encoding.type = 'H';
+    else if (name == "uint8")      encoding.type = 'C';
+    else if (name == "uint16")     encoding.type = 'S';
+    else if (name == "quantile8")  encoding.type = 'c';
+    else if (name == "quantile16") encoding.type = 's';
+    else qFatal("Unknown matrix encoding %s.", qPrintable(name));
+
+    if ((encoding.type == 'F') || (encoding.type == 'H')) return encoding;
+    const bool linear = (encoding.type == 'C') || (encoding.type == 'S');
+    const int levels = (encoding.depth() == CV_8U) ? 256 : 65536;
+
+    // Sorted comparison scores of the sample, subsampled to bound the cost of learning
+    QVector<float> values;
+    if (!linear || !(min < max)) {
+        const Mat scores = sample.isContinuous() ? sample : sample.clone();
+        const float *data = scores.ptr<float>();
+        const size_t step = std::max(size_t(1), scores.total() / (1 << 20));
+        for (size_t i=0; i<scores.total(); i+=step)
+            if (data[i] != NoComparison) values.append(data[i]);
+        std::sort(values.begin(), values.end());
+    }
+
+    // Code zero is reserved for NoComparison
+    if (linear) {
+        if (!(min < max)) {
+            min = values.isEmpty() ? 0 : values.first();
+            max = values.isEmpty() ? 1 : values.last();
+            if (!(min < max)) max = min + 1;
+        }
+        encoding.scale = (max - min) / (levels - 2);
+        encoding.offset = min - encoding.scale;
+    } else {
+        encoding.codebook.resize(levels);
+        encoding.codebook[0] = NoComparison;
+        for (int i=1; i<levels; i++)
+            encoding.codebook[i] = values.isEmpty() ? 0 : values[std::min(values.size()-1, int((i - 0.5) / (levels - 1) * values.size()))];
+    }
+    return encoding;
+}
+
+QString SimmatEncoding::blockwise(const QString &name, float min, float max)
+{
+    const bool learned = (name == "quantile8") || (name == "quantile16") || (((name == "uint8") || (name == "uint16")) && !(min < max));
+    if (!learned) return name;
+    qWarning("Matrix encoding %s needs minScore < maxScore when written in blocks, using float.", qPrintable(name));
+    return "float";
+}
+
+int SimmatEncoding::depth() const
+{
+    switch (type) {
+      case 'F': return CV_32F;
+      case 'C':
+      case 'c': return CV_8U;
+      default:  return CV_16U;
+    }
+}
+
+int SimmatEncoding::encode(const Mat &scores, Mat &codes) const
+{
+    if (type == 'F') {
+        codes = scores;
+        return 0;
+    }
+
+    const Mat input = scores.isContinuous() ? scores : scores.clone();
+    if ((type == 'C') || (type == 'S')) {
+        // Rounds and saturates to the code range
+        const Mat valid = input != NoComparison;
+        const int levels = (depth() == CV_8U) ? 256 : 65536;
+        const int clipped = countNonZero((input < offset + scale/2) & valid) + countNonZero(input >= offset + scale*(levels - 0.5f));
+        input.convertTo(codes, depth(), 1/scale, -offset/scale);
+        codes = cv::max(codes, 1);
+        codes.setTo(0, ~valid);
+        return clipped;
+    }
+
+    codes.create(input.rows, input.cols, depth());
+    if      (type == 'H') toHalf(input.ptr<float>(), codes.ptr<quint16>(), input.total());
+    else if (type == 'c') quantize(input.ptr<float>(), codes.ptr<quint8>(), input.total(), codebook);
+    else                  quantize(input.ptr<float>(), codes.ptr<quint16>(), input.total(), codebook);
+    return 0;
+}
+
+void SimmatEncoding::decode(const Mat &codes, Mat &scores) const
+{
+    switch (type) {
+      case 'F':
+        scores = codes;
+        break;
+      case 'H':
+        scores.create(codes.rows, codes.cols, CV_32FC1);
+        fromHalf(codes.ptr<quint16>(), scores.ptr<float>(), codes.total());
+        break;
+      case 'C':
+      case 'S':
+        codes.convertTo(scores, CV_32F, scale, offset);
+        scores.setTo(NoComparison, codes == 0);
+        break;
+      case 'c':
+        LUT(codes, Mat(1, codebook.size(), CV_32FC1, (void*) codebook.data()), scores);
+        break;
+      default: {
+        scores.create(codes.rows, codes.cols, CV_32FC1);
+        const quint16 *src = codes.ptr<quint16>();
+        float *dst = scores.ptr<float>();
+        for (size_t i=0; i<codes.total(); i++)
+            dst[i] = codebook[src[i]];
+      }
+    }
+}
+
 FileList readSigset(const File &sigset, bool ignoreMetadata)
 {
     FileList fileList;
@@ -128,15 +335,16 @@ void writeSigset(const QString &sigset, const FileList &files, bool ignoreMetada
     QtUtils::writeFile(sigset, lines);
 }
 
-Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
+// Leaves the file positioned at the start of the matrix data
+static void readHeader(QFile &file, const QString &fileName, bool *isDistance, int *rows, int *cols, bool *isMask, SimmatEncoding *encoding, QString *targetSigset, QString *querySigset)
 {
-    QFile file(matrix);
+    file.setFileName(fileName);
     bool success = file.open(QFile::ReadOnly);
-    if (!success) qFatal("Unable to open %s for reading.", qPrintable(matrix.name));
+    if (!success) qFatal("Unable to open %s for reading.", qPrintable(fileName));
 
     // Check format
     QByteArray format = file.readLine();
-    bool isDistance = (format[0] == 'D');
+    *isDistance = (format[0] == 'D');
     if (format[1] != '2') qFatal("Invalid matrix header.");
 
     // Read sigsets
@@ -147,21 +355,46 @@ Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
 
     // Get matrix size
     const QStringList words = QString(file.readLine()).split(" ");
-    const int rows = words[1].toInt();
-    const int cols = words[2].toInt();
-    const bool isMask = words[0][1] == 'B';
-    const int typeSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
+    *rows = words[1].toInt();
+    *cols = words[2].toInt();
+    *isMask = words[0][1] == 'B';
+
+    // Encoding parameters follow the endianness marker
+    *encoding = SimmatEncoding();
+    if (*isMask) return;
+    encoding->type = words[0][1].toLatin1();
+    if (QByteArray("FHCScs").indexOf(encoding->type) == -1)
+        qFatal("Unknown matrix encoding in %s.", qPrintable(fileName));
+    if ((encoding->type == 'C') || (encoding->type == 'S')) {
+        if (words.size() < 6) qFatal("Invalid matrix header.");
+        encoding->offset = words[4].trimmed().toFloat();
+        encoding->scale = words[5].trimmed().toFloat();
+    } else if ((encoding->type == 'c') || (encoding->type == 's')) {
+        encoding->codebook.resize(encoding->depth() == CV_8U ? 256 : 65536);
+        const qint64 bytes = encoding->codebook.size() * sizeof(float);
+        if (file.read((char*) encoding->codebook.data(), bytes) != bytes)
+            qFatal("Invalid matrix header.");
+    }
+}
+
+Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
+{
+    QFile file;
+    bool isDistance, isMask;
+    int rows, cols;
+    SimmatEncoding encoding;
+    readHeader(file, matrix.name, &isDistance, &rows, &cols, &isMask, &encoding, targetSigset, querySigset);
 
     // Get matrix data
-    Mat m;
+    Mat codes;
     if (isMask)
-        m.create(rows, cols, OpenCVType<BEE::MaskValue,1>::make());
+        codes.create(rows, cols, OpenCVType<BEE::MaskValue,1>::make());
     else
-        m.create(rows, cols, OpenCVType<BEE::SimmatValue,1>::make());
+        codes.create(rows, cols, encoding.depth());
 
-    const qint64 bytesPerRow = m.cols * typeSize;
-    for (int i=0; i<m.rows; i++) {
-        Mat aRow = m.row(i);
+    const qint64 bytesPerRow = qint64(codes.cols) * codes.elemSize();
+    for (int i=0; i<codes.rows; i++) {
+        Mat aRow = codes.row(i);
         qint64 bytesRead = file.read((char *)aRow.data, bytesPerRow);
         if (bytesRead != bytesPerRow)
             qFatal("Didn't read complete row!");
@@ -170,48 +403,154 @@ Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
         qFatal("Expected matrix end of file.");
     file.close();
 
+    Mat m;
+    if (isMask) m = codes;
+    else        encoding.decode(codes, m);
+
     Mat result = m;
     if (isDistance ^ matrix.get<bool>("negate", false))
         m.convertTo(result, -1, -1);
     return result;
 }
 
-void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSigset, const QString &querySigset)
+void writeHeader(QFile &file, bool isMask, int rows, int cols, const QString &targetSigset, const QString &querySigset, const SimmatEncoding &encoding)
 {
-    bool isMask = false;
-    if (m.type() == OpenCVType<BEE::MaskValue,1>::make())
-        isMask = true;
-    else if (m.type() != OpenCVType<BEE::SimmatValue,1>::make())
-        qFatal("Invalid matrix type, .mtx files can only contain single channel float or uchar matrices.");
-
-    const int elemSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
-    const QString matrixType = isMask ? "B" : "F";
-
     char buff[4];
-    QFile file(fileName);
     QtUtils::touchDir(file);
     if (!file.open(QFile::WriteOnly))
-        qFatal("Unable to open %s for writing.", qPrintable(fileName));
+        qFatal("Unable to open %s for writing.", qPrintable(file.fileName()));
     file.write("S2\n");
     file.write(qPrintable(targetSigset));
     file.write("\n");
     file.write(qPrintable(querySigset));
     file.write("\n");
     file.write("M");
-    file.write(qPrintable(matrixType));
+    file.write(QByteArray(1, isMask ? 'B' : encoding.type));
     file.write(" ");
-    file.write(qPrintable(QString::number(m.rows)));
+    file.write(qPrintable(QString::number(rows)));
     file.write(" ");
-    file.write(qPrintable(QString::number(m.cols)));
+    file.write(qPrintable(QString::number(cols)));
     file.write(" ");
     const int endian = 0x12345678;
     memcpy(&buff, &endian, 4);
     file.write(buff, 4);
+    if (!isMask && ((encoding.type == 'C') || (encoding.type == 'S')))
+        file.write(qPrintable(" " + QString::number(encoding.offset, 'g', 9) + " " + QString::number(encoding.scale, 'g', 9)));
     file.write("\n");
-    file.write((const char*)m.data, m.rows*m.cols*elemSize);
+    if (!isMask && ((encoding.type == 'c') || (encoding.type == 's')))
+        file.write((const char*) encoding.codebook.data(), encoding.codebook.size() * sizeof(float));
+}
+
+void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSigset, const QString &querySigset, const QString &encoding)
+{
+    bool isMask = false;
+    if (m.type() == OpenCVType<BEE::MaskValue,1>::make())
+        isMask = true;
+    else if (m.type() != OpenCVType<BEE::SimmatValue,1>::make())
+        qFatal("Invalid matrix type, .mtx files can only contain single channel float or uchar matrices.");
+
+    const SimmatEncoding matrixEncoding = isMask ? SimmatEncoding() : SimmatEncoding::make(encoding, m);
+    Mat codes;
+    if (isMask) codes = m.isContinuous() ? m : m.clone();
+    else        matrixEncoding.encode(m, codes);
+
+    QFile file(fileName);
+    writeHeader(file, isMask, m.rows, m.cols, targetSigset, querySigset, matrixEncoding);
+    file.write((const char*)codes.data, codes.total()*codes.elemSize());
     file.close();
 }
 
+MatrixReader::MatrixReader(const File &matrix)
+{
+    bool isDistance;
+    readHeader(file, matrix.name, &isDistance, &rows, &cols, &isMask, &encoding, &targetSigset, &querySigset);
+    dataPos = file.pos();
+    negate = isDistance ^ matrix.get<bool>("negate", false);
+
+    const qint64 typeSize = isMask ? sizeof(BEE::MaskValue) : CV_ELEM_SIZE1(encoding.depth());
+    if (file.size() != dataPos + qint64(rows) * cols * typeSize)
+        qFatal("Expected matrix end of file.");
+}
+
+Mat MatrixReader::readRows(int row, int count)
+{
+    Mat codes;
+    if (isMask)
+        codes.create(count, cols, OpenCVType<BEE::MaskValue,1>::make());
+    else
+        codes.create(count, cols, encoding.depth());
+
+    const qint64 bytesPerRow = qint64(cols) * codes.elemSize();
+    {
+        QMutexLocker locker(&mutex);
+        file.seek(dataPos + row * bytesPerRow);
+        if (file.read((char*)codes.data, count * bytesPerRow) != count * bytesPerRow)
+            qFatal("Didn't read complete row!");
+    }
+
+    Mat m;
+    if (isMask) m = codes;
+    else        encoding.decode(codes, m);
+
+    if (negate)
+        m.convertTo(m, -1, -1);
+    return m;
+}
+
+float MatrixReader::readValue(int row, int column)
+{
+    if (isMask) qFatal("Can't read scores from a mask.");
+    Mat code(1, 1, encoding.depth());
+    {
+        QMutexLocker locker(&mutex);
+        file.seek(dataPos + (qint64(row) * cols + column) * code.elemSize());
+        if (file.read((char*)code.data, code.elemSize()) != qint64(code.elemSize()))
+            qFatal("Didn't read complete value!");
+    }
+
+    Mat m;
+    encoding.decode(code, m);
+    return negate ? -m.at<float>(0, 0) : m.at<float>(0, 0);
+}
+
+MatrixWriter::MatrixWriter(const QString &fileName, int rows, int cols, bool isMask, const QString &targetSigset, const QString &querySigset,
+                           const QString &encoding, float min, float max)
+    : file(fileName), rows(rows), cols(cols), written(0), isMask(isMask), targetSigset(targetSigset), querySigset(querySigset),
+      encodingName(isMask ? QString("float") : SimmatEncoding::blockwise(encoding, min, max)), min(min), max(max), clipped(0)
+{}
+
+void MatrixWriter::initialize(const Mat &sample)
+{
+    if (!isMask) encoding = SimmatEncoding::make(encodingName, sample, min, max);
+    BEE::writeHeader(file, isMask, rows, cols, targetSigset, querySigset, encoding);
+}
+
+MatrixWriter::~MatrixWriter()
+{
+    if (!file.isOpen())
+        initialize(Mat());
+    if (written != rows)
+        qFatal("Wrote %d of %d matrix rows to %s.", written, rows, qPrintable(file.fileName()));
+    if (clipped > 0)
+        qWarning("Clipped %lld scores outside [%g, %g] in %s.", clipped, min, max, qPrintable(file.fileName()));
+    file.close();
+}
+
+void MatrixWriter::writeRows(const Mat &m)
+{
+    if ((m.cols != cols) || (m.type() != (isMask ? OpenCVType<BEE::MaskValue,1>::make() : OpenCVType<BEE::SimmatValue,1>::make())))
+        qFatal("Invalid matrix block for %s.", qPrintable(file.fileName()));
+    if (!file.isOpen())
+        initialize(m);
+
+    Mat block;
+    if (isMask) block = m;
+    else        clipped += encoding.encode(m, block);
+    if (!block.isContinuous()) block = block.clone();
+    file.write((const char*)block.data, block.total()*block.elemSize());
+    written += m.rows;
+}
+
 void readMatrixHeader(const QString &matrix, QString *targetSigset, QString *querySigset)
 {
     qDebug("Reading %s header.", qPrintable(matrix));
@@ -221,7 +560,38 @@ void readMatrixHeader(const QString &matrix, QString *targetSigset, QString *que
 void writeMatrixHeader(const QString &matrix, const QString &targetSigset, const QString &querySigset)
 {
     qDebug("Writing %s header to %s %s.", qPrintable(matrix), qPrintable(targetSigset), qPrintable(querySigset));
-    writeMatrix(readMatrix(matrix), matrix, targetSigset, querySigset);
+
+    QFile file;
+    bool isDistance, isMask;
+    int rows, cols;
+    SimmatEncoding encoding;
+    readHeader(file, matrix, &isDistance, &rows, &cols, &isMask, &encoding, NULL, NULL);
+    if (isDistance) {
+        // Rewritten as similarities
+        file.close();
+        writeMatrix(readMatrix(matrix), matrix, targetSigset, querySigset);
+        return;
+    }
+
+    // Keep the encoded data as is
+    const QByteArray data = file.readAll();
+    file.close();
+    writeHeader(file, isMask, rows, cols, targetSigset, querySigset, encoding);
+    file.write(data);
+    file.close();
+}
+
+// Write the mask one row at a time rather than materializing it
+static void writeMask(const LabelMask &mask, const QString &fileName, const QString &targetSigset, const QString &querySigset)
+{
+    QFile file(fileName);
+    writeHeader(file, true, mask.rows(), mask.cols(), targetSigset, querySigset);
+    QVector<MaskValue> row(mask.cols());
+    for (int i=0; i<mask.rows(); i++) {
+        mask.fillRow(i, row.data());
+        file.write((const char*)row.data(), row.size()*sizeof(MaskValue));
+    }
+    file.close();
 }
 
 void makeMask(const QString &targetInput, const QString &queryInput, const QString &mask)
@@ -231,11 +601,11 @@ void makeMask(const QString &targetInput, const QString &queryInput, const QStri
     const FileList queries = (queryInput == ".") ? targets : TemplateList::fromGallery(queryInput).files();
     const int partitions = targets.first().get<int>("crossValidate");
     if (partitions == 0) {
-        writeMatrix(makeMask(targets, queries), mask, targetInput, queryInput);
+        writeMask(LabelMask(targets, queries), mask, targetInput, queryInput);
     } else {
         if (!mask.contains("%1")) qFatal("Mask file name missing partition number place marker (%%1)");
         for (int i=0; i<partitions; i++) {
-            writeMatrix(makeMask(targets, queries, i), mask.arg(i), targetInput, queryInput);
+            writeMask(LabelMask(targets, queries, i), mask.arg(i), targetInput, queryInput);
         }
     }
 }
@@ -292,40 +662,94 @@ Mat makePairwiseMask(const FileList &targets, const FileList &queries, int parti
 
 Mat makeMask(const FileList &targets, const FileList &queries, int partition)
 {
-    // TODO: Direct use of "Label" isn't general, also would prefer to use indexProperty, rather than
-    // doing string comparisons (but that isn't implemented yet for FileList) -cao
-    const QStringList targetLabels = File::get<QString>(targets, "Label", "-1");
-    const QStringList queryLabels = File::get<QString>(queries, "Label", "-1");
+    return LabelMask(targets, queries, partition).toMat();
+}
+
+LabelMask::LabelMask(const FileList &targets, const FileList &queries, int partition)
+{
+    // TODO: Direct use of "Label" isn't general -cao
+    QHash<QString, int> names, labels;
+    labels.insert("-1", -1);
+
+    const QStringList targetLabelStrings = File::get<QString>(targets, "Label", "-1");
     const QList<int> targetPartitions = targets.crossValidationPartitions();
+    targetNames.reserve(targets.size());
+    targetLabels.reserve(targets.size());
+    targetState.reserve(targets.size());
+    for (int j=0; j<targets.size(); j++) {
+        if (!names.contains(targets[j].name)) names.insert(targets[j].name, names.size());
+        if (!labels.contains(targetLabelStrings[j])) labels.insert(targetLabelStrings[j], labels.size()-1);
+        const int name = names.value(targets[j].name);
+        const int label = labels.value(targetLabelStrings[j]);
+        targetNames.append(name);
+        targetLabels.append(label);
+        namesakes[name].append(j);
+
+        const int partitionB = targetPartitions[j];
+        if      (label == -1)              targetState.append(DontCare);
+        else if (partitionB == -1)         targetState.append(NonMatch);
+        else if (partitionB != partition)  targetState.append(DontCare);
+        else                             { targetState.append(Match); postings[label].append(j); }
+    }
+
+    const QStringList queryLabelStrings = File::get<QString>(queries, "Label", "-1");
     const QList<int> queryPartitions = queries.crossValidationPartitions();
     const QList<bool> targetsOnly = File::get<bool>(queries, "targetOnly", false);
-
-    Mat mask(queries.size(), targets.size(), CV_8UC1);
+    queryNames.reserve(queries.size());
+    queryLabels.reserve(queries.size());
+    queryActive.reserve(queries.size());
     for (int i=0; i<queries.size(); i++) {
-        const QString &fileA = queries[i];
-        const QString labelA = queryLabels[i];
-        const int partitionA = queryPartitions[i];
-        const bool targetOnly = targetsOnly[i];
+        // Queries absent from the target set get a unique name and a label no target shares
+        queryNames.append(names.value(queries[i].name, -1-i));
+        const int label = labels.value(queryLabelStrings[i], -2);
+        queryLabels.append(label);
+        queryActive.append(!targetsOnly[i] && (label != -1) && (queryPartitions[i] == partition));
+    }
+}
 
-        for (int j=0; j<targets.size(); j++) {
-            const QString &fileB = targets[j];
-            const QString labelB = targetLabels[j];
-            const int partitionB = targetPartitions[j];
+QVector<int> LabelMask::genuineTargets(int query) const
+{
+    QVector<int> genuines;
+    if (!queryActive[query]) return genuines;
+    foreach (int target, postings.value(queryLabels[query]))
+        if (targetNames[target] != queryNames[query])
+            genuines.append(target);
+    return genuines;
+}
 
-            MaskValue val;
-            if      (fileA == fileB)           val = DontCare;
-            else if (targetOnly)               val = DontCare;
-            else if (labelA == "-1")           val = DontCare;
-            else if (labelB == "-1")           val = DontCare;
-            else if (partitionA != partition)  val = DontCare;
-            else if (partitionB == -1)         val = NonMatch;
-            else if (partitionB != partition)  val = DontCare;
-            else if (labelA == labelB)         val = Match;
-            else                               val = NonMatch;
-            mask.at<MaskValue>(i,j) = val;
-        }
+qint64 LabelMask::genuineCount() const
+{
+    qint64 count = 0;
+    for (int i=0; i<rows(); i++)
+        count += genuineTargets(i).size();
+    return count;
+}
+
+void LabelMask::fillRow(int query, MaskValue *row) const
+{
+    if (!queryActive[query]) {
+        memset(row, DontCare, cols()*sizeof(MaskValue));
+        return;
     }
 
+    // Start from the label-independent state of each target, then mark the posting list
+    const int name = queryNames[query];
+    const int label = queryLabels[query];
+    for (int j=0; j<cols(); j++) {
+        const uchar state = targetState[j];
+        row[j] = (state == Match) ? NonMatch : state;
+    }
+    foreach (int target, postings.value(label))
+        row[target] = Match;
+    foreach (int target, namesakes.value(name))
+        row[target] = DontCare;
+}
+
+Mat LabelMask::toMat() const
+{
+    Mat mask(rows(), cols(), OpenCVType<MaskValue,1>::make());
+    for (int i=0; i<rows(); i++)
+        fillRow(i, mask.ptr<MaskValue>(i));
     return mask;
 }
 
@@ -17,8 +17,12 @@
 #ifndef BEE_BEE_H
 #define BEE_BEE_H
 
+#include <QFile>
+#include <QHash>
+#include <QMutex>
 #include <QString>
 #include <QStringList>
+#include <QVector>
 #include <opencv2/core/core.hpp>
 #include <openbr/openbr_plugin.h>
 
@@ -37,11 +41,83 @@ namespace BEE
     br::FileList readSigset(const br::File &sigset, bool ignoreMetadata = false);
     void writeSigset(const QString &sigset, const br::FileList &files, bool ignoreMetadata = false);
 
+    /*!
+     * \brief Storage encoding of similarity matrix scores.
+     *
+     * Scores are stored as \c float, IEEE \c half, or \c uint8 / \c uint16 codes which are either linear
+     * over a score range or learned quantiles. The parameters are kept in the matrix header and readers
+     * always decode to SimmatValue. The -FLT_MAX "no comparison" score is preserved exactly.
+     */
+    struct SimmatEncoding
+    {
+        char type; // 'F'loat, 'H'alf, linear uint8 'C' or uint16 'S', quantile uint8 'c' or uint16 's'
+        float offset, scale; // Linear codes
+        QVector<float> codebook; // Quantile codes
+
+        SimmatEncoding() : type('F'), offset(0), scale(1) {}
+
+        // One of float, half, uint8, uint16, quantile8 or quantile16.
+        // The linear range (unless min < max) or quantiles are learned from the sample.
+        static SimmatEncoding make(const QString &name, const cv::Mat &sample, float min = 0, float max = 0);
+
+        // Writers that only see one block at a time cannot learn a representative range or codebook,
+        // so encodings that would need to fall back to float.
+        static QString blockwise(const QString &name, float min, float max);
+
+        int depth() const;
+        int encode(const cv::Mat &scores, cv::Mat &codes) const; // Returns the number of scores clipped to the linear range
+        void decode(const cv::Mat &codes, cv::Mat &scores) const;
+    };
+
     // Matrix
     cv::Mat readMatrix(const br::File &mat, QString *targetSigset = NULL, QString *querySigset = NULL);
-    void writeMatrix(const cv::Mat &m, const QString &fileName, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
+    void writeMatrix(const cv::Mat &m, const QString &fileName, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query", const QString &encoding = "float");
     void readMatrixHeader(const QString &matrix, QString *targetSigset, QString *querySigset);
     void writeMatrixHeader(const QString &matrix, const QString &targetSigset, const QString &querySigset);
+    void writeHeader(QFile &file, bool isMask, int rows, int cols, const QString &targetSigset, const QString &querySigset, const SimmatEncoding &encoding = SimmatEncoding()); // Opens the file
+
+    /*!
+     * \brief Reads blocks of rows from a matrix without loading it entirely.
+     */
+    class MatrixReader
+    {
+        QFile file;
+        QMutex mutex;
+        qint64 dataPos;
+        bool negate;
+
+    public:
+        int rows, cols;
+        bool isMask;
+        QString targetSigset, querySigset;
+        SimmatEncoding encoding;
+
+        MatrixReader(const br::File &matrix);
+        cv::Mat readRows(int row, int count); // Thread safe
+        float readValue(int row, int column); // Thread safe
+    };
+
+    /*!
+     * \brief Writes a matrix sequentially in blocks of rows.
+     */
+    class MatrixWriter
+    {
+        QFile file;
+        int rows, cols, written;
+        bool isMask;
+        QString targetSigset, querySigset, encodingName;
+        float min, max;
+        qint64 clipped;
+        SimmatEncoding encoding;
+
+        void initialize(const cv::Mat &sample);
+
+    public:
+        MatrixWriter(const QString &fileName, int rows, int cols, bool isMask = false, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query",
+                     const QString &encoding = "float", float min = 0, float max = 0);
+        ~MatrixWriter();
+        void writeRows(const cv::Mat &m);
+    };
 
     // Mask
     void makeMask(const QString &targetInput, const QString &queryInput, const QString &mask);
@@ -49,6 +125,42 @@ namespace BEE
     void makePairwiseMask(const QString &targetInput, const QString &queryInput, const QString &mask);
     cv::Mat makePairwiseMask(const br::FileList &targets, const br::FileList &queries, int partition = 0);
     void combineMasks(const QStringList &inputMasks, const QString &outputMask, const QString &method);
+
+    /*!
+     * \brief Implicit equivalent of makeMask().
+     *
+     * File names, labels and partitions are interned to integers once, so any cell
+     * can be classified in constant time and the genuine cells of a query can be
+     * enumerated from per-label posting lists without materializing the mask.
+     */
+    class LabelMask
+    {
+        QVector<int> queryNames, queryLabels, targetNames, targetLabels;
+        QVector<bool> queryActive; // false if every cell in the row is DontCare
+        QVector<uchar> targetState; // DontCare, NonMatch (NonMatch only) or Match (comparable)
+        QHash<int, QVector<int> > postings; // label -> comparable targets
+        QHash<int, QVector<int> > namesakes; // file name -> targets
+
+    public:
+        LabelMask(const br::FileList &targets, const br::FileList &queries, int partition = 0);
+
+        int rows() const { return queryLabels.size(); }
+        int cols() const { return targetLabels.size(); }
+
+        inline MaskValue operator()(int query, int target) const
+        {
+            if (!queryActive[query] || (queryNames[query] == targetNames[target])) return DontCare;
+            const uchar state = targetState[target];
+            if (state != Match) return state;
+            return (queryLabels[query] == targetLabels[target]) ? Match : NonMatch;
+        }
+
+        bool isActive(int query) const { return queryActive[query]; }
+        QVector<int> genuineTargets(int query) const;
+        qint64 genuineCount() const;
+        void fillRow(int query, MaskValue *row) const;
+        cv::Mat toMat() const;
+    };
 }
 
 #endif // BEE_BEE_H
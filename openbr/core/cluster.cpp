@@ -16,10 +16,14 @@
 
 #include <QDebug>
 #include <QFile>
+#include <QFutureSynchronizer>
 #include <QHash>
+#include <QMutex>
 #include <QPair>
 #include <QSet>
+#include <QtConcurrentRun>
 #include <limits>
+#include <vector>
 #include <openbr/openbr_plugin.h>
 #include <assert.h>
 
@@ -83,79 +87,243 @@ float normalizedROD(const Neighborhood &neighborhood, int a, int b)
     return 1.f * (distanceA + distanceB) / std::min(indexA+1, indexB+1);
 }
 
-Neighborhood getNeighborhood(const QStringList &simmats)
+// Keeps the k most similar neighbors of every row, scores can arrive in any order from any thread
+class NeighborhoodBuilder
 {
-    Neighborhood neighborhood;
+    static const int Stripes = 64;
+
+    int k;
+    QVector< std::vector<Neighbor> > heaps; // Worst kept neighbor first
+    QMutex locks[Stripes];
+    float mins[Stripes], maxs[Stripes];
+
+    // Expects the lock of the row's stripe to be held
+    void push(int row, int column, float val)
+    {
+        const int stripe = row % Stripes;
+        if (val != -std::numeric_limits<float>::max()
+            && val != -std::numeric_limits<float>::infinity()
+            && val != std::numeric_limits<float>::infinity()) {
+            maxs[stripe] = std::max(maxs[stripe], val);
+            mins[stripe] = std::min(mins[stripe], val);
+        }
+
+        std::vector<Neighbor> &heap = heaps[row];
+        const Neighbor neighbor(column, val);
+        if (int(heap.size()) < k) {
+            heap.push_back(neighbor);
+            std::push_heap(heap.begin(), heap.end(), compareNeighbors);
+        } else if (compareNeighbors(neighbor, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), compareNeighbors);
+            heap.back() = neighbor;
+            std::push_heap(heap.begin(), heap.end(), compareNeighbors);
+        }
+    }
+
+public:
+    NeighborhoodBuilder(int rows, int k)
+        : k(k), heaps(rows)
+    {
+        for (int i=0; i<Stripes; i++) {
+            mins[i] = std::numeric_limits<float>::max();
+            maxs[i] = -std::numeric_limits<float>::max();
+        }
+    }
+
+    int rows() const { return heaps.size(); }
+
+    // Insert a block of scores for rows [rowOffset, rowOffset+m.rows)
+    void insert(const cv::Mat &m, int rowOffset, int columnOffset, bool diagonal)
+    {
+        for (int i=0; i<m.rows; i++) {
+            const int row = rowOffset+i;
+            QMutexLocker locker(&locks[row % Stripes]);
+            const float *scores = m.ptr<float>(i);
+            for (int j=0; j<m.cols; j++)
+                if (!diagonal || (row != columnOffset+j)) // Skips self-similarity scores
+                    push(row, columnOffset+j, scores[j]);
+        }
+    }
+
+    void insert(int row, int column, float val)
+    {
+        QMutexLocker locker(&locks[row % Stripes]);
+        push(row, column, val);
+    }
+
+    Neighborhood neighborhood()
+    {
+        const float globalMin = *std::min_element(mins, mins+Stripes);
+        const float globalMax = *std::max_element(maxs, maxs+Stripes);
+
+        Neighborhood neighborhood(heaps.size());
+        for (int i=0; i<heaps.size(); i++) {
+            std::vector<Neighbor> &heap = heaps[i];
+            std::sort_heap(heap.begin(), heap.end(), compareNeighbors);
+
+            // Normalize scores
+            Neighbors &neighbors = neighborhood[i];
+            neighbors.reserve(heap.size());
+            foreach (Neighbor neighbor, heap) {
+                if (neighbor.second == -std::numeric_limits<float>::infinity())
+                    neighbor.second = 0;
+                else if (neighbor.second == std::numeric_limits<float>::infinity())
+                    neighbor.second = 1;
+                else
+                    neighbor.second = (neighbor.second - globalMin) / (globalMax - globalMin);
+                neighbors.append(neighbor);
+            }
+            std::vector<Neighbor>().swap(heap);
+        }
+        return neighborhood;
+    }
+};
+
+// Keeps the top neighbors of comparisons computed on the fly
+class NeighborhoodOutput : public br::Output
+{
+    NeighborhoodBuilder *builder;
+
+    void set(float value, int i, int j)
+    {
+        if (selfSimilar && (i == j)) return;
+        builder->insert(i, j, value);
+    }
+
+public:
+    NeighborhoodOutput(NeighborhoodBuilder *builder) : builder(builder)
+    {
+        set_blockRows(512);
+        set_blockCols(512);
+    }
+};
+
+// One row of similarity matrices, read a block of rows at a time
+struct SimmatRow
+{
+    QList<br::File> simmats;
+    QList<BEE::MatrixReader*> readers; // NULL for formats without incremental access
+    QList<cv::Mat> matrices;
+    int rows, rowOffset, diagonal;
+    NeighborhoodBuilder *builder;
+
+    static void insertRows(SimmatRow *row, int begin, int end)
+    {
+        int columnOffset = 0;
+        for (int j=0; j<row->simmats.size(); j++) {
+            const cv::Mat m = row->readers[j] ? row->readers[j]->readRows(begin, end-begin)
+                                              : row->matrices[j].rowRange(begin, end);
+            row->builder->insert(m, row->rowOffset+begin, columnOffset, j == row->diagonal);
+            columnOffset += m.cols;
+        }
+    }
+};
 
-    float globalMax = -std::numeric_limits<float>::max();
-    float globalMin = std::numeric_limits<float>::max();
+Neighborhood getNeighborhood(const QStringList &simmats)
+{
+    const int k = br::File(simmats.first()).get<int>("neighbors", 20);
     int numGalleries = (int)sqrt((float)simmats.size());
     if (numGalleries*numGalleries != simmats.size())
         qFatal("Incorrect number of similarity matrices.");
 
-    // Process each simmat
+    // Open each simmat, streaming those that support it
+    QList<SimmatRow*> simmatRows;
+    int totalRows = 0;
     for (int i=0; i<numGalleries; i++) {
-        QVector<Neighbors> allNeighbors;
-
-        int currentRows = -1;
-        int columnOffset = 0;
+        SimmatRow *row = new SimmatRow();
+        row->rows = -1;
+        row->rowOffset = totalRows;
+        row->diagonal = i;
         for (int j=0; j<numGalleries; j++) {
-            QScopedPointer<br::Format> format(br::Factory<br::Format>::make(simmats[i*numGalleries+j]));
-            br::Template t = format->read();
-            cv::Mat m = t.m();
-            if (j==0) {
-                currentRows = m.rows;
-                allNeighbors.resize(currentRows);
-            }
-            if (currentRows != m.rows) qFatal("Row count mismatch.");
-
-            // Get data row by row
-            for (int k=0; k<m.rows; k++) {
-                Neighbors &neighbors = allNeighbors[k];
-                neighbors.reserve(neighbors.size() + m.cols);
-                for (int l=0; l<m.cols; l++) {
-                    float val = m.at<float>(k,l);
-                    if ((i==j) && (k==l)) continue; // Skips self-similarity scores
-
-                    if (val != -std::numeric_limits<float>::max()
-                        && val != -std::numeric_limits<float>::infinity()
-                        && val != std::numeric_limits<float>::infinity()) {
-                        globalMax = std::max(globalMax, val);
-                        globalMin = std::min(globalMin, val);
-                    }
-                    neighbors.append(Neighbor(l+columnOffset, val));
-                }
+            const br::File simmat = simmats[i*numGalleries+j];
+            row->simmats.append(simmat);
+            int rows;
+            if (simmat.suffix() == "mtx") {
+                row->readers.append(new BEE::MatrixReader(simmat));
+                row->matrices.append(cv::Mat());
+                rows = row->readers.last()->rows;
+            } else {
+                QScopedPointer<br::Format> format(br::Factory<br::Format>::make(simmat));
+                row->readers.append(NULL);
+                row->matrices.append(format->read().m());
+                rows = row->matrices.last().rows;
             }
-
-            columnOffset += m.cols;
+            if (row->rows == -1) row->rows = rows;
+            if (row->rows != rows) qFatal("Row count mismatch.");
         }
+        totalRows += row->rows;
+        simmatRows.append(row);
+    }
 
-        // Keep the top matches
-        for (int j=0; j<allNeighbors.size(); j++) {
-            Neighbors &val = allNeighbors[j];
-            const int cutoff = 20; // Somewhat arbitrary number of neighbors to keep
-            int keep = std::min(cutoff, val.size());
-            std::partial_sort(val.begin(), val.begin()+keep, val.end(), compareNeighbors);
-            neighborhood.append((Neighbors)val.mid(0, keep));
+    int totalColumns = 0;
+    for (int j=0; j<numGalleries; j++)
+        totalColumns += simmatRows.first()->readers[j] ? simmatRows.first()->readers[j]->cols : simmatRows.first()->matrices[j].cols;
+
+    // Roughly 16 MB of scores per block
+    NeighborhoodBuilder builder(totalRows, k);
+    const int blockRows = std::max(1, (1 << 22) / std::max(1, totalColumns));
+    QFutureSynchronizer<void> futures;
+    foreach (SimmatRow *row, simmatRows) {
+        row->builder = &builder;
+        for (int begin=0; begin<row->rows; begin+=blockRows) {
+            const int end = std::min(row->rows, begin+blockRows);
+            if (br::Globals->parallelism) futures.addFuture(QtConcurrent::run(SimmatRow::insertRows, row, begin, end));
+            else                          SimmatRow::insertRows(row, begin, end);
         }
     }
+    futures.waitForFinished();
 
-    // Normalize scores
-    for (int i=0; i<neighborhood.size(); i++) {
-        Neighbors &neighbors = neighborhood[i];
-        for (int j=0; j<neighbors.size(); j++) {
-            Neighbor &neighbor = neighbors[j];
-            if (neighbor.second == -std::numeric_limits<float>::infinity())
-                neighbor.second = 0;
-            else if (neighbor.second == std::numeric_limits<float>::infinity())
-                neighbor.second = 1;
-            else
-                neighbor.second = (neighbor.second - globalMin) / (globalMax - globalMin);
+    foreach (SimmatRow *row, simmatRows)
+        qDeleteAll(row->readers);
+    qDeleteAll(simmatRows);
+
+    return builder.neighborhood();
+}
+
+Neighborhood getNeighborhood(const br::File &gallery)
+{
+    const br::TemplateList templates = br::TemplateList::fromGallery(gallery);
+    const QSharedPointer<br::Distance> distance = br::Distance::fromAlgorithm(gallery.get<QString>("algorithm", br::Globals->algorithm));
+
+    NeighborhoodBuilder builder(templates.size(), gallery.get<int>("neighbors", 20));
+    NeighborhoodOutput output(&builder);
+    output.initialize(templates.files(), templates.files());
+    distance->compare(templates, templates, &output);
+    return builder.neighborhood();
+}
+
+// Parallel evaluation of the rank-order distances between each cluster and its neighbors
+struct RankOrderDistances
+{
+    const Neighborhood *neighborhood;
+    float threshold;
+    QVector< QVector<bool> > similar; // similar[i][j] if cluster i should merge with its j-th neighbor
+
+    static void compute(RankOrderDistances *distances, int begin, int end)
+    {
+        const Neighborhood &neighborhood = *distances->neighborhood;
+        for (int clusterID=begin; clusterID<end; clusterID++) {
+            const Neighbors &neighbors = neighborhood[clusterID];
+            QVector<bool> &similar = distances->similar[clusterID];
+            similar.resize(neighbors.size());
+            for (int j=0; j<neighbors.size(); j++)
+                similar[j] = normalizedROD(neighborhood, clusterID, neighbors[j].first) < distances->threshold;
         }
     }
 
-    return neighborhood;
-}
+    RankOrderDistances(const Neighborhood *neighborhood, float threshold)
+        : neighborhood(neighborhood), threshold(threshold), similar(neighborhood->size())
+    {
+        const int size = neighborhood->size();
+        const int step = std::max(1, size / (4 * std::max(1, abs(br::Globals->parallelism))));
+        QFutureSynchronizer<void> futures;
+        for (int begin=0; begin<size; begin+=step) {
+            if (br::Globals->parallelism) futures.addFuture(QtConcurrent::run(compute, this, begin, std::min(size, begin+step)));
+            else                          compute(this, begin, std::min(size, begin+step));
+        }
+        futures.waitForFinished();
+    }
+};
 
 // Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
 br::Clusters br::ClusterGallery(const QStringList &simmats, float aggressiveness, const QString &csv)
@@ -163,7 +331,11 @@ br::Clusters br::ClusterGallery(const QStringList &simmats, float aggressiveness
     qDebug("Clustering %d simmat(s), aggressiveness %f", simmats.size(), aggressiveness);
 
     // Read in gallery parts, keeping top neighbors of each template
-    Neighborhood neighborhood = getNeighborhood(simmats);
+    Neighborhood neighborhood;
+    if ((simmats.size() == 1) && (QStringList() << "gal" << "mem" << "template").contains(br::File(simmats.first()).suffix()))
+        neighborhood = getNeighborhood(br::File(simmats.first()));
+    else
+        neighborhood = getNeighborhood(simmats);
     const int cutoff = neighborhood.first().size();
     const float threshold = 3*cutoff/4 * aggressiveness/5;
 
@@ -178,21 +350,24 @@ br::Clusters br::ClusterGallery(const QStringList &simmats, float aggressiveness
         QVector<int> nextClusterIDs(neighborhood.size());
         for (int i=0; i<neighborhood.size(); i++) nextClusterIDs[i] = i;
 
+        // Rank-order distances don't depend on merge order, so they are computed up front in parallel
+        const RankOrderDistances distances(&neighborhood, threshold);
+
         // For each cluster
         for (int clusterID=0; clusterID<neighborhood.size(); clusterID++) {
             const Neighbors &neighbors = neighborhood[clusterID];
             int nextClusterID = nextClusterIDs[clusterID];
 
             // Check its neighbors
-            foreach (const Neighbor &neighbor, neighbors) {
-                int neighborID = neighbor.first;
+            for (int j=0; j<neighbors.size(); j++) {
+                int neighborID = neighbors[j].first;
                 int nextNeighborID = nextClusterIDs[neighborID];
 
                 // Don't bother if they have already merged
                 if (nextNeighborID == nextClusterID) continue;
 
                 // Flag for merge if similar enough
-                if (normalizedROD(neighborhood, clusterID, neighborID) < threshold) {
+                if (distances.similar[clusterID][j]) {
                     if (nextClusterID < nextNeighborID) nextClusterIDs[neighborID] = nextClusterID;
                     else                                nextClusterIDs[clusterID] = nextNeighborID;
                 }
@@ -212,8 +387,12 @@ br::Clusters br::ClusterGallery(const QStringList &simmats, float aggressiveness
         // Construct new clusters
         QHash<int, int> clusterIDLUT;
         QList<int> allClusterIDs = QSet<int>::fromList(nextClusterIDs.toList()).values();
+        QHash<int, int> clusterIDIndex; // Cluster ID -> index in allClusterIDs
+        clusterIDIndex.reserve(allClusterIDs.size());
+        for (int i=0; i<allClusterIDs.size(); i++)
+            clusterIDIndex.insert(allClusterIDs[i], i);
         for (int i=0; i<neighborhood.size(); i++)
-            clusterIDLUT[i] = allClusterIDs.indexOf(nextClusterIDs[i]);
+            clusterIDLUT[i] = clusterIDIndex.value(nextClusterIDs[i]);
 
         Clusters newClusters(allClusterIDs.size());
         Neighborhood newNeighborhood(allClusterIDs.size());
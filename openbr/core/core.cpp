@@ -14,10 +14,19 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QCoreApplication>
+#include <QFutureSynchronizer>
+#include <QMetaProperty>
+#include <QMutex>
+#include <QProcess>
+#include <QtConcurrentRun>
 #include <openbr/openbr_plugin.h>
+#include <limits>
+#include <queue>
 
 #include "bee.h"
 #include "common.h"
+#include "opencvutils.h"
 #include "qtutils.h"
 #include "../plugins/openbr_internal.h"
 
@@ -28,6 +37,471 @@ void noDelete(Transform *target)
     (void) target;
 }
 
+// Uncompressed model container whose large matrices are bound in place from a read-only mapping:
+// magic, stream size, matrix data offset, serialized stream, padding, page aligned matrix data
+struct MappedModel
+{
+    static QByteArray magic() { return QByteArray("BRMAPPED", 8); }
+    static const qint64 headerSize = 24;
+    static const qint64 pageSize = 4096;
+
+    static void write(const QString &fileName, const QByteArray &data, const OpenCVUtils::MappedMatrices &matrices)
+    {
+        QtUtils::touchDir(QFileInfo(fileName));
+        QFile file(fileName);
+        if (!file.open(QFile::WriteOnly)) qFatal("Failed to open %s for writing.", qPrintable(fileName));
+
+        const qint64 matrixOffset = (headerSize + data.size() + pageSize - 1) / pageSize * pageSize;
+        QDataStream header(&file);
+        header.writeRawData(magic().data(), magic().size());
+        header << qint64(data.size()) << matrixOffset;
+        file.write(data);
+
+        for (int i=0; i<matrices.matrices.size(); i++) {
+            const QPair<qint64, cv::Mat> &matrix = matrices.matrices[i];
+            file.seek(matrixOffset + matrix.first);
+            const qint64 len = matrix.second.rows * matrix.second.cols * matrix.second.elemSize();
+            if (file.write((const char*) matrix.second.data, len) != len) qFatal("Failed to write %s.", qPrintable(fileName));
+        }
+        if (file.size() < matrixOffset + matrices.size) file.resize(matrixOffset + matrices.size);
+    }
+
+    // Returns false if the file is not a mapped model
+    static bool read(const QString &fileName, QByteArray &data, const uchar **matrixData)
+    {
+        QFile *file = new QFile(fileName);
+        if (!file->open(QFile::ReadOnly) || (file->read(magic().size()) != magic())) {
+            delete file;
+            return false;
+        }
+
+        qint64 streamSize, matrixOffset;
+        QDataStream header(file);
+        header >> streamSize >> matrixOffset;
+
+        // Private mapping so in-place matrices that are later modified copy on write
+#if QT_VERSION >= QT_VERSION_CHECK(5, 4, 0)
+        uchar *base = file->map(0, file->size(), QFileDevice::MapPrivateOption);
+        if (!base) qFatal("Failed to map %s.", qPrintable(fileName));
+#else
+        // Older Qt can only map files read only, so the model is read into writable memory instead
+        file->seek(0);
+        QByteArray *contents = new QByteArray(file->readAll());
+        if (contents->size() != file->size()) qFatal("Failed to read %s.", qPrintable(fileName));
+        uchar *base = (uchar*) contents->data();
+#endif
+
+        // Matrices may reference the mapping for the lifetime of the process
+        static QList<QFile*> mappedFiles;
+        static QMutex mappedFilesLock;
+        QMutexLocker locker(&mappedFilesLock);
+        mappedFiles.append(file);
+
+        data = QByteArray::fromRawData((const char*) base + headerSize, streamSize);
+        *matrixData = base + matrixOffset;
+        return true;
+    }
+};
+
+// Tiles of a sharded comparison, row shards partition the query gallery and column shards the target gallery
+struct ShardGrid
+{
+    QList<int> rowBounds, colBounds;
+    bool lowerOnly;
+
+    ShardGrid(const File &targetGallery, const File &queryGallery, const File &output)
+    {
+        // Self-comparisons use a square grid so diagonal tiles remain self-similar
+        const bool self = targetGallery == queryGallery;
+        rowBounds = bounds(FileList::fromGallery(queryGallery, true).size(), qMax(1, output.get<int>("shards", 1)));
+        colBounds = self ? rowBounds : bounds(FileList::fromGallery(targetGallery, true).size(), qMax(1, output.get<int>("colShards", 1)));
+
+        // Self-similar tail outputs only report pairs below the diagonal
+        lowerOnly = self && (output.suffix() == "tail");
+
+        if (!(QStringList() << "mtx" << "rr" << "tail").contains(output.suffix()))
+            qFatal("Sharded comparisons require a mtx, rr or tail output, not %s.", qPrintable(output.name));
+    }
+
+    static QList<int> bounds(int size, int count)
+    {
+        QList<int> bounds;
+        for (int i=0; i<=count; i++)
+            bounds.append(int(qint64(size) * i / count));
+        return bounds;
+    }
+
+    int rows() const { return rowBounds.size() - 1; }
+    int cols() const { return colBounds.size() - 1; }
+    int size() const { return rows() * cols(); }
+    bool needed(int shard) const
+    {
+        const int r = shard / cols(), c = shard % cols();
+        if ((rowBounds[r+1] == rowBounds[r]) || (colBounds[c+1] == colBounds[c])) return false;
+        return !lowerOnly || (r >= c);
+    }
+
+    static QString file(const File &output, int shard)
+    {
+        return output.path() + "/" + QFileInfo(output.name).completeBaseName() + ".shard" + QString::number(shard) + "." + output.suffix();
+    }
+
+    // Lines of a partial output, keeping empty lines which are meaningful for rank retrieval
+    static QStringList lines(const QString &file)
+    {
+        QByteArray data;
+        QtUtils::readFile(file, data);
+        QStringList lines = QString(data).split('\n');
+        if (!lines.isEmpty() && lines.last().isEmpty())
+            lines.removeLast();
+        return lines;
+    }
+
+    // Tile assembly
+    void mergeMatrices(const File &output, const File &targetGallery, const File &queryGallery) const
+    {
+        BEE::MatrixWriter writer(output.name, rowBounds.last(), colBounds.last(), false, targetGallery.flat(), queryGallery.flat(),
+                                 output.get<QString>("encoding", "float"), output.get<float>("minScore", 0), output.get<float>("maxScore", 0));
+        const int blockRows = qMax(1, (1 << 22) / qMax(1, colBounds.last()));
+        for (int r=0; r<rows(); r++) {
+            QList< QSharedPointer<BEE::MatrixReader> > readers;
+            for (int c=0; c<cols(); c++)
+                readers.append(needed(r*cols()+c) ? QSharedPointer<BEE::MatrixReader>(new BEE::MatrixReader(file(output, r*cols()+c)))
+                                                  : QSharedPointer<BEE::MatrixReader>());
+
+            const int count = rowBounds[r+1] - rowBounds[r];
+            for (int i=0; i<count; i+=blockRows) {
+                const int n = qMin(blockRows, count-i);
+                cv::Mat block(n, colBounds.last(), CV_32FC1);
+                for (int c=0; c<cols(); c++)
+                    if (readers[c]) readers[c]->readRows(i, n).copyTo(block.colRange(colBounds[c], colBounds[c+1]));
+                writer.writeRows(block);
+            }
+        }
+    }
+
+    // Heap merge of each query's top matches across column shards
+    void mergeRanks(const File &output) const
+    {
+        if (output.getBool("byLine")) qFatal("Sharded rank retrieval does not support byLine output.");
+        const bool simple = output.getBool("simple");
+        const int limit = output.get<int>("limit", 20);
+
+        typedef QPair<float, QPair<int,int> > Candidate; // Score, column shard and position
+        QStringList lines;
+        for (int r=0; r<rows(); r++) {
+            QList<QStringList> shardLines;
+            for (int c=0; c<cols(); c++)
+                shardLines.append(needed(r*cols()+c) ? ShardGrid::lines(file(output, r*cols()+c)) : QStringList());
+
+            for (int i=0; i<rowBounds[r+1]-rowBounds[r]; i++) {
+                QStringList merged;
+                QList<QStringList> matches;
+                QList< QList<float> > scores;
+                std::priority_queue<Candidate> heap;
+                for (int c=0; c<cols(); c++) {
+                    const QString line = shardLines[c].value(i);
+                    QStringList words = line.isEmpty() ? QStringList() : (simple ? line.split(',') : QtUtils::parse(line, ','));
+                    if (simple && !words.isEmpty()) {
+                        const QString query = words.takeFirst();
+                        if (merged.isEmpty()) merged.append(query);
+                    }
+
+                    QList<float> wordScores;
+                    foreach (const QString &word, words)
+                        wordScores.append(simple ? word.section(' ', -1).toFloat() : File(word).get<float>("Score"));
+                    matches.append(words);
+                    scores.append(wordScores);
+                    if (!words.isEmpty())
+                        heap.push(Candidate(wordScores.first(), QPair<int,int>(-c, 0)));
+                }
+
+                int count = 0;
+                while (!heap.empty() && (count++ < limit)) {
+                    const Candidate candidate = heap.top();
+                    heap.pop();
+                    const int c = -candidate.second.first, j = candidate.second.second;
+                    merged.append(matches[c][j]);
+                    if (j+1 < matches[c].size())
+                        heap.push(Candidate(scores[c][j+1], QPair<int,int>(-c, j+1)));
+                }
+                lines.append(merged.join(","));
+            }
+        }
+        QtUtils::writeFile(output, lines);
+    }
+
+    // Concatenation of the highest scoring matches
+    void mergeTails(const File &output) const
+    {
+        const float threshold = output.get<float>("threshold", -std::numeric_limits<float>::max());
+        const int atLeast = output.get<int>("atLeast", 1);
+        const int atMost = output.get<int>("atMost", std::numeric_limits<int>::max());
+
+        typedef QPair<float,QString> Comparison;
+        QList<Comparison> comparisons;
+        for (int shard=0; shard<size(); shard++) {
+            if (!needed(shard)) continue;
+            const QStringList shardLines = lines(file(output, shard));
+            for (int i=1; i<shardLines.size(); i++)
+                comparisons.append(Comparison(-shardLines[i].section(',', 0, 0).toFloat(), shardLines[i]));
+        }
+        qStableSort(comparisons);
+
+        while (comparisons.size() > atMost)
+            comparisons.removeLast();
+        while ((comparisons.size() > atLeast) && (-comparisons.last().first < threshold))
+            comparisons.removeLast();
+        if (comparisons.isEmpty()) return;
+
+        QStringList lines; lines.reserve(comparisons.size()+1);
+        lines.append("Value,Target,Query");
+        foreach (const Comparison &comparison, comparisons)
+            lines.append(comparison.second);
+        QtUtils::writeFile(output, lines);
+    }
+};
+
+static int runShard(const QStringList &arguments)
+{
+    return QProcess::execute(QCoreApplication::applicationFilePath(), arguments);
+}
+
+// Command line arguments reproducing every global setting that differs from its default
+static QStringList globalArguments(int shard, int parallelism)
+{
+    // Runtime state, settings local to this process, or not representable on the command line
+    static const QStringList skipped = QStringList() << "objectName" << "sdkPath" << "log" << "useGui" << "mostRecentMessage"
+                                                     << "currentStep" << "currentProgress" << "totalSteps" << "buffer";
+
+    Context defaults;
+    QStringList arguments;
+    for (int i=0; i<Globals->metaObject()->propertyCount(); i++) {
+        QMetaProperty property = Globals->metaObject()->property(i);
+        const QString name = property.name();
+        if (skipped.contains(name) || (name == "parallelism"))
+            continue;
+        if (name == "filters") {
+            if (!Globals->filters.isEmpty())
+                qWarning("Global filters are not forwarded to shard processes.");
+            continue;
+        }
+
+        property.reset(&defaults);
+        const QVariant value = property.read(Globals);
+        if (value == property.read(&defaults))
+            continue;
+
+        if (!value.canConvert<QString>()) {
+            qWarning("Global %s is not forwarded to shard processes.", qPrintable(name));
+            continue;
+        }
+
+        QString string = value.toString();
+        if (name == "profile") {
+            // Each shard writes its own report
+            const QFileInfo fileInfo(string);
+            string = fileInfo.path() + "/" + fileInfo.completeBaseName() + ".shard" + QString::number(shard) + (fileInfo.suffix().isEmpty() ? QString() : "." + fileInfo.suffix());
+        }
+        arguments << "-" + name << string;
+    }
+    return arguments << "-parallelism" << QString::number(parallelism);
+}
+
+// Collects self-similar index pairs scoring at least the threshold, from the lower triangle
+// like the tail output, so asymmetric distances score compare(templates[j], templates[i]) with j < i
+class DuplicateOutput : public Output
+{
+    float threshold;
+    QMutex lock;
+
+    void set(float value, int i, int j)
+    {
+        if (upperTriangle && (i < j)) std::swap(i, j);
+        if ((i <= j) || (value < threshold)) return;
+        QMutexLocker locker(&lock);
+        pairs.append(QPair<int,int>(j, i));
+    }
+
+public:
+    QList< QPair<int,int> > pairs;
+
+    DuplicateOutput(float threshold) : threshold(threshold) {}
+
+    bool upperTriangular() const
+    {
+        return true;
+    }
+};
+
+// Disjoint sets of duplicate templates, the root of each set is its last member
+struct DuplicateSets
+{
+    QVector<int> parent;
+
+    DuplicateSets(int size) : parent(size)
+    {
+        for (int i=0; i<size; i++)
+            parent[i] = i;
+    }
+
+    int find(int i)
+    {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    }
+
+    void unite(int i, int j)
+    {
+        i = find(i);
+        j = find(j);
+        if (i < j) parent[i] = j;
+        else       parent[j] = i;
+    }
+};
+
+/*!
+ * Sign random projection hashing of templates, used to propose candidate duplicate pairs
+ * so that only templates sharing a bucket in at least one table are compared exactly.
+ */
+struct DuplicateHashes
+{
+    const TemplateList *templates;
+    cv::Mat mean, hyperplanes; // One row per table and bit
+    int bits, tables;
+    QVector<quint64> signatures; // Indexed by template * tables + table
+
+    DuplicateHashes(const TemplateList *templates, int bits, int tables)
+        : templates(templates), bits(bits), tables(tables), signatures(templates->size() * tables)
+    {
+        if ((bits < 1) || (bits > 64)) qFatal("Expected between 1 and 64 hash bits.");
+        int dimensions = -1, count = 0;
+        for (int i=0; i<templates->size(); i++) {
+            if (templates->at(i).isEmpty()) continue;
+            const cv::Mat &m = templates->at(i).m();
+            if (dimensions == -1) {
+                dimensions = m.total() * m.channels();
+                mean = cv::Mat::zeros(1, dimensions, CV_64FC1);
+            } else if (int(m.total() * m.channels()) != dimensions) {
+                qFatal("Hashing requires fixed length templates.");
+            }
+            cv::Mat row;
+            m.reshape(1, 1).convertTo(row, CV_64F);
+            mean += row;
+            count++;
+        }
+        if (dimensions == -1) return;
+        mean.convertTo(mean, CV_32F, 1.0/count);
+
+        // A fixed seed keeps repeated runs reproducible
+        cv::RNG rng(0x5eed);
+        hyperplanes.create(bits * tables, dimensions, CV_32FC1);
+        rng.fill(hyperplanes, cv::RNG::NORMAL, 0, 1);
+    }
+
+    static void hash(DuplicateHashes *hashes, int begin, int end)
+    {
+        for (int i=begin; i<end; i++) {
+            const Template &t = hashes->templates->at(i);
+            if (t.isEmpty()) continue;
+            cv::Mat row, projection;
+            t.m().reshape(1, 1).convertTo(row, CV_32F);
+            cv::gemm(hashes->hyperplanes, row - hashes->mean, 1, cv::Mat(), 0, projection, cv::GEMM_2_T);
+            for (int k=0; k<hashes->tables; k++) {
+                quint64 signature = 0;
+                for (int b=0; b<hashes->bits; b++)
+                    if (projection.at<float>(k*hashes->bits + b) > 0)
+                        signature |= quint64(1) << b;
+                hashes->signatures[i*hashes->tables + k] = signature;
+            }
+        }
+    }
+
+    // Pairs sharing a bucket in any table, false if there would be more than maxCandidates
+    // or a quarter of all pairs, in which case comparing exhaustively is cheaper
+    bool candidates(qint64 maxCandidates, QList< QPair<int,int> > &result)
+    {
+        result.clear();
+        if (hyperplanes.empty()) return true;
+
+        const int size = templates->size();
+        const int step = std::max(1, size / (4 * std::max(1, abs(Globals->parallelism))));
+        QFutureSynchronizer<void> futures;
+        for (int begin=0; begin<size; begin+=step) {
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(hash, this, begin, std::min(size, begin+step)));
+            else                      hash(this, begin, std::min(size, begin+step));
+        }
+        futures.waitForFinished();
+
+        // Near-identical templates all share a bucket, so count pairs before listing them
+        QVector< QHash<quint64, QVector<int> > > buckets(tables);
+        qint64 templateCount = 0, candidateCount = 0;
+        for (int i=0; i<size; i++)
+            if (!templates->at(i).isEmpty()) {
+                templateCount++;
+                for (int k=0; k<tables; k++)
+                    buckets[k][signatures[i*tables + k]].append(i);
+            }
+        for (int k=0; k<tables; k++)
+            foreach (const QVector<int> &bucket, buckets[k])
+                candidateCount += qint64(bucket.size()) * (bucket.size() - 1) / 2;
+        if (candidateCount > std::min(maxCandidates, templateCount * (templateCount - 1) / 8)) {
+            qDebug("%lld candidate pairs, comparing exhaustively instead.", candidateCount);
+            return false;
+        }
+
+        QSet<quint64> pairs;
+        for (int k=0; k<tables; k++)
+            foreach (const QVector<int> &bucket, buckets[k])
+                for (int i=0; i<bucket.size(); i++)
+                    for (int j=i+1; j<bucket.size(); j++)
+                        pairs.insert((quint64(bucket[i]) << 32) | quint64(bucket[j]));
+
+        result.reserve(pairs.size());
+        foreach (quint64 pair, pairs)
+            result.append(QPair<int,int>(int(pair >> 32), int(pair & 0xffffffff)));
+        return true;
+    }
+};
+
+// Exact verification of candidate pairs
+struct DuplicateVerification
+{
+    const Distance *distance;
+    const TemplateList *templates;
+    const QList< QPair<int,int> > *candidates;
+    float threshold;
+    QVector<bool> duplicate;
+
+    static void verify(DuplicateVerification *verification, int begin, int end)
+    {
+        for (int k=begin; k<end; k++) {
+            const QPair<int,int> &pair = verification->candidates->at(k);
+            verification->duplicate[k] = verification->distance->compare(verification->templates->at(pair.first), verification->templates->at(pair.second)) >= verification->threshold;
+        }
+    }
+
+    QList< QPair<int,int> > run()
+    {
+        duplicate = QVector<bool>(candidates->size(), false);
+        const int step = std::max(1, candidates->size() / (4 * std::max(1, abs(Globals->parallelism))));
+        QFutureSynchronizer<void> futures;
+        for (int begin=0; begin<candidates->size(); begin+=step) {
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(verify, this, begin, std::min(candidates->size(), begin+step)));
+            else                      verify(this, begin, std::min(candidates->size(), begin+step));
+        }
+        futures.waitForFinished();
+
+        QList< QPair<int,int> > pairs;
+        for (int k=0; k<candidates->size(); k++)
+            if (duplicate[k]) pairs.append(candidates->at(k));
+        return pairs;
+    }
+};
+
 struct AlgorithmCore
 {
     enum CompareMode
@@ -108,6 +582,12 @@ struct AlgorithmCore
         QByteArray data;
         QDataStream out(&data, QFile::WriteOnly);
 
+        // Large matrices are stored out of line in mapped models
+        const File modelFile(model);
+        const bool mapped = modelFile.get<bool>("mapped", false);
+        OpenCVUtils::MappedMatrices matrices;
+        if (mapped) OpenCVUtils::setMappedMatrices(out.device(), &matrices);
+
         // Serialize algorithm to stream
         transform->serialize(out);
 
@@ -125,18 +605,27 @@ struct AlgorithmCore
         if (mode == TransformCompare)
             comparison->serialize(out);
 
-        // Compress and save to file
-        QtUtils::writeFile(model, data, -1);
+        if (mapped) {
+            // Save uncompressed with page aligned matrices
+            OpenCVUtils::setMappedMatrices(out.device(), NULL);
+            MappedModel::write(modelFile.name, data, matrices);
+        } else {
+            // Compress and save to file
+            QtUtils::writeFile(modelFile.name, data, -1);
+        }
     }
 
     void load(const QString &model)
     {
-        // Load from file and decompress
+        // Map from file, or load from file and decompress
         QByteArray data;
-        QtUtils::readFile(model, data, true);
+        OpenCVUtils::MappedMatrices matrices;
+        const bool mapped = MappedModel::read(model, data, &matrices.data);
+        if (!mapped) QtUtils::readFile(model, data, true);
 
         // Create stream
         QDataStream in(&data, QFile::ReadOnly);
+        if (mapped) OpenCVUtils::setMappedMatrices(in.device(), &matrices);
 
         // Load algorithm
         transform = QSharedPointer<Transform>(Transform::deserialize(in));
@@ -154,6 +643,8 @@ struct AlgorithmCore
         }
         if (mode == TransformCompare)
             comparison = QSharedPointer<Transform>(Transform::deserialize(in));
+
+        if (mapped) OpenCVUtils::setMappedMatrices(in.device(), NULL);
     }
 
     File getMemoryGallery(const File &file) const
@@ -176,9 +667,11 @@ struct AlgorithmCore
         bool multiProcess = Globals->file.getBool("multiProcess", false);
         bool fileExclusion = false;
 
-        // In append mode, we will exclude any templates with filenames already present in the output gallery
+        // In append mode, we will exclude any templates with filenames already present in the output gallery,
+        // indexed galleries are checked against their index rather than read in full
         if (gallery.contains("append") && gallery.exists() ) {
-            FileList::fromGallery(gallery,true);
+            if (!QFile::exists(GalleryIndex::fileName(gallery)))
+                FileList::fromGallery(gallery,true);
             fileExclusion = true;
         }
 
@@ -309,43 +802,177 @@ struct AlgorithmCore
         retrieveOrEnroll(inputGallery, i, inputFiles);
 
         TemplateList t = i->read();
+        if (t.size() != inputFiles.size()) qFatal("Gallery size mismatch.");
+
+        // Find pairs of duplicates among the candidates proposed by hashing, or exhaustively
+        QList< QPair<int,int> > pairs, candidates;
+        const int hashBits = outputGallery.get<int>("hashBits", 0);
+        bool hashed = false;
+        if (hashBits != 0) {
+            DuplicateHashes hashes(&t, hashBits, outputGallery.get<int>("hashTables", 8));
+            hashed = hashes.candidates(outputGallery.get<qint64>("hashMaxCandidates", qint64(1) << 24), candidates);
+        }
 
-        Output *o = Output::make(QString("buffer.tail[selfSimilar,threshold=%1,atLeast=0]").arg(QString::number(threshold)),inputFiles,inputFiles);
-
-        // Compare to global tail output
-        distance->compare(t,t,o);
-
-        delete o;
+        if (!hashed) {
+            DuplicateOutput o(threshold);
+            o.set_blockRows(512);
+            o.set_blockCols(512);
+            o.initialize(inputFiles, inputFiles);
+            // Only symmetric distances take the upper triangle shortcut
+            distance->compare(t, t, &o);
+            pairs = o.pairs;
+        } else {
+            qDebug("Verifying %d candidate pairs.", candidates.size());
+            DuplicateVerification verification;
+            verification.distance = distance.data();
+            verification.templates = &t;
+            verification.candidates = &candidates;
+            verification.threshold = threshold;
+            pairs = verification.run();
+        }
 
-        QString buffer(Globals->buffer);
+        // Merge pairs into groups, keeping the last template of each
+        DuplicateSets sets(t.size());
+        typedef QPair<int,int> Pair;
+        foreach (const Pair &pair, pairs)
+            sets.unite(pair.first, pair.second);
+
+        QMap<int, QList<int> > groups; // Kept template -> removed duplicates
+        FileList survivors;
+        for (int j=0; j<t.size(); j++) {
+            const int root = sets.find(j);
+            if (root == j) survivors.append(inputFiles[j]);
+            else           groups[root].append(j);
+        }
 
-        QStringList tail = buffer.split("\n");
+        qDebug("\n%d duplicates removed.", inputFiles.size() - survivors.size());
+
+        const QString report = outputGallery.get<QString>("report", "");
+        if (!report.isEmpty()) {
+            QStringList lines;
+            lines.append("Group,File,Kept");
+            int group = 0;
+            foreach (int root, groups.keys()) {
+                foreach (int j, groups[root])
+                    lines.append(QString("%1,%2,0").arg(QString::number(group), inputFiles[j].name));
+                lines.append(QString("%1,%2,1").arg(QString::number(group), inputFiles[root].name));
+                group++;
+            }
+            QtUtils::writeFile(report, lines);
+        }
 
-        // Remove header
-        tail.removeFirst();
+        QScopedPointer<Gallery> og(Gallery::make(outputGallery));
 
-        QStringList toRemove;
-        foreach (const QString &s, tail)
-            toRemove.append(s.split(',').at(1));
+        og->writeBlock(survivors);
+    }
 
-        QSet<QString> duplicates = QSet<QString>::fromList(toRemove);
+    // Galleries shard processes can read without enrolling, enrolled once up front
+    File shardGallery(const File &gallery)
+    {
+        if ((QStringList() << "gal" << "template").contains(gallery.suffix()))
+            return gallery;
 
-        QStringList fileNames = inputFiles.names();
+        const File enrolled(gallery.baseName() + gallery.hash() + ".gal");
+        if (gallery.suffix() == "mem") {
+            QScopedPointer<Gallery> output(Gallery::make(enrolled));
+            output->writeBlock(TemplateList::fromGallery(gallery));
+        } else {
+            enroll(gallery, enrolled);
+        }
+        return enrolled;
+    }
 
-        QList<int> indices;
-        foreach (const QString &d, duplicates)
-            indices.append(fileNames.indexOf(d));
+    // Runs the missing shards as local processes, then merges their partial outputs
+    void compareSharded(const File &targetGallery, const File &queryGallery, const File &output)
+    {
+        if (output.exists() && output.get<bool>("cache", false)) return;
 
-        std::sort(indices.begin(),indices.end(),std::greater<float>());
+        const bool selfCompare = targetGallery == queryGallery;
+        const File target = shardGallery(targetGallery);
+        const File query = selfCompare ? target : shardGallery(queryGallery);
+        const ShardGrid grid(target, query, output);
+
+        QList<int> shards;
+        for (int shard=0; shard<grid.size(); shard++)
+            if (grid.needed(shard) && !QFileInfo(ShardGrid::file(output, shard)).exists())
+                shards.append(shard);
+
+        if (!shards.isEmpty() && (QFileInfo(QCoreApplication::applicationFilePath()).baseName() != "br"))
+            qFatal("Sharded comparisons run shards through the br executable, not %s.", qPrintable(QCoreApplication::applicationFilePath()));
+
+        const int processes = qMax(1, output.get<int>("processes", qMin(shards.size(), Globals->parallelism)));
+        const int threads = qMax(1, Globals->parallelism / processes);
+        qDebug("Computing %d of %d shards in %d processes", shards.size(), grid.size(), processes);
+
+        QStringList failed;
+        for (int i=0; i<shards.size(); i+=processes) {
+            QList< QFuture<int> > futures;
+            for (int j=i; j<qMin(i+processes, shards.size()); j++) {
+                File shardOutput = output;
+                shardOutput.set("shard", shards[j]);
+                QStringList arguments = globalArguments(shards[j], threads);
+                arguments << "-compare" << target.flat() << query.flat() << shardOutput.flat();
+                futures.append(QtConcurrent::run(runShard, arguments));
+            }
+            for (int j=0; j<futures.size(); j++)
+                if (futures[j].result() != 0)
+                    failed.append(QString::number(shards[i+j]));
+        }
+        if (!failed.isEmpty())
+            qFatal("Shards %s of %s failed.", qPrintable(failed.join(",")), qPrintable(output.flat()));
 
-        qDebug("\n%d duplicates removed.", indices.size());
+        if      (output.suffix() == "mtx") grid.mergeMatrices(output, targetGallery, queryGallery);
+        else if (output.suffix() == "rr")  grid.mergeRanks(output);
+        else                               grid.mergeTails(output);
 
-        for (int i=0; i<indices.size(); i++)
-            inputFiles.removeAt(indices[i]);
+        for (int shard=0; shard<grid.size(); shard++)
+            QFile::remove(ShardGrid::file(output, shard));
+    }
 
-        QScopedPointer<Gallery> og(Gallery::make(outputGallery));
+    // Compares the row and column ranges of one shard to its partial output
+    void compareShard(const File &targetGallery, const File &queryGallery, const File &output)
+    {
+        const ShardGrid grid(targetGallery, queryGallery, output);
+        const int shard = output.get<int>("shard");
+        if ((shard < 0) || (shard >= grid.size())) qFatal("Invalid shard %d of %d.", shard, grid.size());
+        if (!grid.needed(shard)) return;
+
+        const int r = shard / grid.cols(), c = shard % grid.cols();
+        const File target = sliceGallery(targetGallery, grid.colBounds[c], grid.colBounds[c+1]);
+        const File query = ((targetGallery == queryGallery) && (r == c)) ? target
+                                                                          : sliceGallery(queryGallery, grid.rowBounds[r], grid.rowBounds[r+1]);
+
+        // Write to a temporary file so incomplete shards are recomputed
+        const QString shardFile = ShardGrid::file(output, shard);
+        File partial = output;
+        foreach (const QString &key, QStringList() << "shards" << "colShards" << "shard" << "processes" << "cache")
+            partial.remove(key);
+        partial.name = output.path() + "/" + QFileInfo(output.name).completeBaseName() + ".shard" + QString::number(shard) + ".partial." + output.suffix();
+        QFile::remove(partial.name);
+        compare(target, query, partial);
+
+        if (!QFileInfo(partial.name).exists()) QtUtils::writeFile(partial.name, QStringList());
+        QFile::remove(shardFile);
+        if (!QFile::rename(partial.name, shardFile)) qFatal("Failed to rename %s.", qPrintable(partial.name));
+    }
 
-        og->writeBlock(inputFiles);
+    static File sliceGallery(const File &gallery, int begin, int end)
+    {
+        const File slice(gallery.baseName() + gallery.hash() + "_" + QString::number(begin) + "_" + QString::number(end) + ".mem");
+        QScopedPointer<Gallery> input(Gallery::make(gallery));
+        QScopedPointer<Gallery> output(Gallery::make(slice));
+        int index = 0;
+        bool done = false;
+        while (!done && (index < end)) {
+            TemplateList templates, selected;
+            templates = input->readBlock(&done);
+            foreach (const Template &t, templates) {
+                if ((index >= begin) && (index < end)) selected.append(t);
+                index++;
+            }
+            output->writeBlock(selected);
+        }
+        return slice;
     }
 
     void compare(File targetGallery, File queryGallery, File output)
@@ -358,6 +985,14 @@ struct AlgorithmCore
         if (distance && distance->compare(targetGallery, queryGallery, output))
             return;
 
+        // Sharded comparisons run each tile of the output in its own process
+        if (output.contains("shards")) {
+            if (queryGallery == ".") queryGallery = targetGallery;
+            if (output.contains("shard")) compareShard(targetGallery, queryGallery, output);
+            else                          compareSharded(targetGallery, queryGallery, output);
+            return;
+        }
+
         // Are we comparing the same gallery against itself?
         bool selfCompare = targetGallery == queryGallery;
 
@@ -456,6 +1091,18 @@ struct AlgorithmCore
         // Incoming templates are compared against the templates in the gallery, and the output is the resulting score
         // vector.
         TemplateList tlist = TemplateList::fromGallery(colEnrolledGallery);
+
+        // Self-comparisons against a symmetric distance evaluate each pair only once, the scores are
+        // mirrored for outputs needing the full matrix.
+        if (selfCompare && !multiProcess && !distance.isNull() && distance->symmetric() && (tlist.size() == targetMetadata.size())) {
+            const int symmetricBlockSize = 512;
+            QString outputString = output.flat().isEmpty() ? "Empty" : output.flat();
+            QScopedPointer<Output> o(Output::make(outputString + QString("[targetGallery=%1,queryGallery=%2,blockRows=%3,blockCols=%3]").arg(targetGallery.flat(), queryGallery.flat(), QString::number(symmetricBlockSize)),
+                                                  targetMetadata, targetMetadata));
+            distance->compareSymmetric(tlist, o.data(), true);
+            return;
+        }
+
         comparison->train(tlist);
         comparison->setPropertyRecursive("galleryName","");
 
@@ -72,4 +72,48 @@ inline float packed_l1(const uchar *a, const uchar *b, int size)
     return distance;
 }
 
+#ifdef __POPCNT__
+
+#include <nmmintrin.h>
+
+inline int hamming(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    int i = 0;
+#if defined(__x86_64__) || defined(_M_X64) // _mm_popcnt_u64 is only available in 64-bit mode
+    for (; i+8<=size; i+=8) {
+        quint64 x, y;
+        memcpy(&x, a+i, 8);
+        memcpy(&y, b+i, 8);
+        distance += int(_mm_popcnt_u64(x ^ y));
+    }
+#endif
+    for (; i+4<=size; i+=4) {
+        quint32 x, y;
+        memcpy(&x, a+i, 4);
+        memcpy(&y, b+i, 4);
+        distance += _mm_popcnt_u32(x ^ y);
+    }
+    for (; i<size; i++)
+        distance += _mm_popcnt_u32(a[i] ^ b[i]);
+    return distance;
+}
+
+#else
+
+inline int hamming(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    for (int i=0; i<size; i++) {
+        uchar x = a[i] ^ b[i];
+        while (x) {
+            x &= x - 1;
+            distance++;
+        }
+    }
+    return distance;
+}
+
+#endif
+
 #endif // DISTANCE_SSE_H
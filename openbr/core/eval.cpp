@@ -66,28 +66,39 @@ static float getTAR(const QList<OperatingPoint> &operatingPoints, float FAR)
     return m * FAR + b;
 }
 
-// Decide whether to construct a normal mask matrix, or a pairwise mask by comparing the dimensions of
+static inline BEE::MaskValue maskValue(const Mat &mask, int i, int j)
+{
+    return mask.at<BEE::MaskValue>(i,j);
+}
+
+static inline BEE::MaskValue maskValue(const BEE::LabelMask &mask, int i, int j)
+{
+    return mask(i,j);
+}
+
+template <typename MaskType>
+static float evaluate(const Mat &simmat, const MaskType &mask, const QString &csv);
+
+// Decide whether to use a label mask, or a pairwise mask by comparing the dimensions of
 // scores with the size of the target and query lists
-static cv::Mat constructMatchingMask(const cv::Mat &scores, const FileList &target, const FileList &query, int partition=0)
+float Evaluate(const cv::Mat &scores, const FileList &target, const FileList &query, const QString &csv, int partition)
 {
-    // If the dimensions of the score matrix match the sizes of the target and query lists, construct a normal mask matrix
-    if (target.size() == scores.cols && query.size() == scores.rows)
-        return BEE::makeMask(target, query, partition);
+    // If the dimensions of the score matrix match the sizes of the target and query lists, use an implicit mask
+    if (target.size() == scores.cols && query.size() == scores.rows) {
+        if (scores.type() != CV_32FC1)
+            qFatal("Invalid simmat format");
+        return evaluate(scores, BEE::LabelMask(target, query, partition), csv);
+    }
     // If this looks like a pairwise comparison (1 column score matrix, equal length target and query sets), construct a
     // mask for that
     else if (scores.cols == 1 && target.size() == query.size()) {
-        return BEE::makePairwiseMask(target, query, partition);
+        return Evaluate(scores, BEE::makePairwiseMask(target, query, partition), csv);
     }
     // otherwise, we fail
     else
         qFatal("Unable to construct mask for %d by %d score matrix from %d element query set, and %d element target set ", scores.rows, scores.cols, query.length(), target.length());
 
-    return cv::Mat();
-}
-
-float Evaluate(const cv::Mat &scores, const FileList &target, const FileList &query, const QString &csv, int partition)
-{
-    return Evaluate(scores, constructMatchingMask(scores, target, query, partition), csv);
+    return -1;
 }
 
 float Evaluate(const QString &simmat, const QString &mask, const QString &csv)
@@ -107,24 +118,21 @@ float Evaluate(const QString &simmat, const QString &mask, const QString &csv)
         scores = format->read();
     }
 
-    // Read mask matrix
-    Mat truth;
     if (mask.isEmpty()) {
         // Use the galleries specified in the similarity matrix
         if (target.isEmpty()) qFatal("Unspecified target gallery.");
         if (query.isEmpty()) qFatal("Unspecified query gallery.");
 
-        truth = constructMatchingMask(scores, TemplateList::fromGallery(target).files(),
-                                              TemplateList::fromGallery(query).files());
-    } else {
-        File maskFile(mask);
-        maskFile.set("rows", scores.rows);
-        maskFile.set("columns", scores.cols);
-        QScopedPointer<Format> format(Factory<Format>::make(maskFile));
-        truth = format->read();
+        return Evaluate(scores, TemplateList::fromGallery(target).files(),
+                                TemplateList::fromGallery(query).files(), csv);
     }
 
-    return Evaluate(scores, truth, csv);
+    // Read mask matrix
+    File maskFile(mask);
+    maskFile.set("rows", scores.rows);
+    maskFile.set("columns", scores.cols);
+    QScopedPointer<Format> format(Factory<Format>::make(maskFile));
+    return Evaluate(scores, format->read(), csv);
 }
 
 float Evaluate(const Mat &simmat, const Mat &mask, const QString &csv)
@@ -139,6 +147,12 @@ float Evaluate(const Mat &simmat, const Mat &mask, const QString &csv)
     if (mask.type() != CV_8UC1)
         qFatal("Invalid mask format");
 
+    return evaluate(simmat, mask, csv);
+}
+
+template <typename MaskType>
+static float evaluate(const Mat &simmat, const MaskType &mask, const QString &csv)
+{
     float result = -1;
 
     // Make comparisons
@@ -146,7 +160,7 @@ float Evaluate(const Mat &simmat, const Mat &mask, const QString &csv)
     int genuineCount = 0, impostorCount = 0, numNaNs = 0;
     for (int i=0; i<simmat.rows; i++) {
         for (int j=0; j<simmat.cols; j++) {
-            const BEE::MaskValue mask_val = mask.at<BEE::MaskValue>(i,j);
+            const BEE::MaskValue mask_val = maskValue(mask, i, j);
             const BEE::SimmatValue simmat_val = simmat.at<BEE::SimmatValue>(i,j);
             if (mask_val == BEE::DontCare) continue;
             if (simmat_val != simmat_val) { numNaNs++; continue; }
@@ -297,33 +311,11 @@ float InplaceEval(const QString &simmat, const QString &target, const QString &q
             qPrintable(" with " + target + " and " + query),
             csv.isEmpty() ? "" : qPrintable(" to " + csv));
 
-    // To start with, we will find the size of the header, and check if the file size is consistent with the information
-    // given in the header.
-    QFile file(simmat);
-    bool success = file.open(QFile::ReadOnly);
-    if (!success) qFatal("Unable to open %s for reading.", qPrintable(simmat));
-
-    // Check format
-    QByteArray format = file.readLine();
-    if (format[1] != '2') qFatal("Invalid matrix header.");
-
-    // Read sigset names, we dont' care if they are valid, just want to advance the file pointer.
-    file.readLine();
-    file.readLine();
-
-    // Get matrix size
-    QStringList words = QString(file.readLine()).split(" ");
-    qint64 rows = words[1].toLongLong();
-    qint64 cols = words[2].toLongLong();
-
-    bool isMask = words[0][1] == 'B';
-    qint64 typeSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
-
-    // Get matrix data
-    qint64 rowSize = cols * typeSize;
-
-    // after reading the header, we are at the start of the matrix data
-    qint64 data_pos = file.pos();
+    // The reader checks the file size is consistent with the header, and decodes any score encoding.
+    BEE::MatrixReader reader(simmat);
+    if (reader.isMask) qFatal("Expected a similarity matrix, not a mask.");
+    qint64 rows = reader.rows;
+    qint64 cols = reader.cols;
 
     // Map each unique label to a list of positions in the gallery
     QMap<QString, QList<qint64> > galleryIndices;
@@ -368,9 +360,7 @@ float InplaceEval(const QString &simmat, const QString &target, const QString &q
 
             QList<qint64> colMask = galleryIndices[probeLabels[i]];
             foreach (qint64 colID, colMask) {
-                float score;
-                file.seek(data_pos + i * rowSize + colID * typeSize);
-                file.read((char *) &score, sizeof(float));
+                const float score = reader.readValue(row_count-1, colID);
                 if (genScoresToCounts.contains(score))
                     genScoresToCounts[score].genCount++;
                 else
@@ -385,7 +375,6 @@ float InplaceEval(const QString &simmat, const QString &target, const QString &q
 
     imposterTotal = rows * cols - genTotal;
 
-    file.seek(data_pos);
     cv::Mat aRow(1, cols, CV_32FC1);
     qint64 highImpostors = 0;
 
@@ -396,7 +385,7 @@ float InplaceEval(const QString &simmat, const QString &target, const QString &q
     row_count  = 0;
 
     //sequence, mapfunciton, reducefunction
-    Mat blockMat(bSize, cols, CV_32FC1);
+    Mat blockMat;
 
     qint64 bCount = 0;
     do {
@@ -405,7 +394,7 @@ float InplaceEval(const QString &simmat, const QString &target, const QString &q
         QStringList probeLabels = File::get<QString>(temp, "Label");
         temp.clear();
 
-        file.read((char *) blockMat.data, rowSize * probeLabels.length());
+        blockMat = reader.readRows(row_count, probeLabels.length());
         for (int i=0; i < probeLabels.size();i++) {
             row_count++;
             aRow = blockMat.row(i);
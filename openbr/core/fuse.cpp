@@ -14,8 +14,10 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
 #include <QList>
 #include <QStringList>
+#include <QtConcurrentRun>
 #include "openbr/core/opencvutils.h"
 #include <limits>
 #include <vector>
@@ -23,112 +25,104 @@
 #include <openbr/openbr_plugin.h>
 
 #include "openbr/core/bee.h"
-#include "openbr/core/common.h"
 #include "openbr/core/fuse.h"
 
 using namespace cv;
+using namespace br;
 
-static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
+namespace {
+
+// Running score statistics, mergeable across row blocks
+struct Statistics
 {
-    if (matrix.rows != mask.rows && matrix.cols != mask.cols)
-        qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", matrix.rows, matrix.cols, mask.rows, mask.cols);
-
-    if (method == "None") return;
-
-    QList<float> vals; vals.reserve(matrix.rows*matrix.cols);
-    for (int i=0; i<matrix.rows; i++) {
-        for (int j=0; j<matrix.cols; j++) {
-            float val = matrix.at<float>(i,j);
-            if ((mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) ||
-                (val == -std::numeric_limits<float>::max()) ||
-                (val ==  std::numeric_limits<float>::max()))
-                continue;
-            vals.append(val);
-        }
+    qint64 count;
+    double mean, m2;
+    float min, max;
+
+    Statistics()
+        : count(0), mean(0), m2(0), min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()) {}
+
+    inline void add(float val)
+    {
+        count++;
+        const double delta = val - mean;
+        mean += delta / count;
+        m2 += delta * (val - mean);
+        if (val < min) min = val;
+        if (val > max) max = val;
     }
 
-    float min, max;
-    double mean, stddev;
-    Common::MinMax(vals, &min, &max);
-    Common::MeanStdDev(vals, &mean, &stddev);
-
-    if (method == "MinMax") {
-        for (int i=0; i<matrix.rows; i++) {
-            for (int j=0; j<matrix.cols; j++) {
-                if (mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) continue;
-                float &val = matrix.at<float>(i,j);
-                if      (val == -std::numeric_limits<float>::max()) val = 0;
-                else if (val ==  std::numeric_limits<float>::max()) val = 1;
-                else                                                     val = (val - min) / (max - min);
-            }
-        }
-    } else if (method == "ZScore") {
-        if (stddev == 0) qFatal("Stddev is 0.");
-        for (int i=0; i<matrix.rows; i++) {
-            for (int j=0; j<matrix.cols; j++) {
-                if (mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) continue;
-                float &val = matrix.at<float>(i,j);
-                if      (val == -std::numeric_limits<float>::max()) val = (min - mean) / stddev;
-                else if (val ==  std::numeric_limits<float>::max()) val = (max - mean) / stddev;
-                else                                                val = (val - mean) / stddev;
-            }
-        }
-    } else {
-        qFatal("Invalid normalization method %s.", qPrintable(method));
+    void add(const Statistics &other)
+    {
+        if (other.count == 0) return;
+        const qint64 total = count + other.count;
+        const double delta = other.mean - mean;
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * count * other.count / total;
+        count = total;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
     }
-}
 
-void br::Fuse(const QStringList &inputSimmats, const QString &normalization, const QString &fusion, const QString &outputSimmat)
+    double stddev() const { return count == 0 ? 0 : sqrt(m2 / count); }
+};
+
+/*!
+ * Fuses similarity matrices in two passes over blocks of rows, the first collecting
+ * normalization statistics and the second normalizing, fusing and writing the result,
+ * so no input or output matrix is ever held in memory in its entirety.
+ */
+struct Fuser
 {
-    qDebug("Fusing %d to %s", inputSimmats.size(), qPrintable(outputSimmat));
+    enum Normalization { None, MinMax, ZScore };
+    enum Fusion { Max, Min, Sum, Replace, Difference, Single };
 
-    QString target, query, previousTarget, previousQuery;
-    QList<Mat> originalMatrices;
-    foreach (const QString &simmat, inputSimmats) {
-        originalMatrices.append(BEE::readMatrix(simmat,&target,&query));
-        // Make we're fusing score matrices for the same set of targets and querys
-        if (!previousTarget.isEmpty() && !previousQuery.isEmpty() && (previousTarget != target || previousQuery != query))
-            qFatal("Target or query files are not the same across fused matrices.");
-        previousTarget = target; previousQuery = query;
-    }
+    QList<BEE::MatrixReader*> readers;
+    QList<BEE::LabelMask> masks; // One per cross validation partition
+    QVector<Statistics> statistics; // Indexed by partition * readers.size() + reader
+    Normalization normalization;
+    Fusion fusion;
+    QList<float> weights;
+    int rows, cols;
+
+    Fuser(const QStringList &inputSimmats, const QString &normalizationMethod, const QString &fusionMethod)
+    {
+        QString target, query;
+        foreach (const QString &simmat, inputSimmats) {
+            BEE::MatrixReader *reader = new BEE::MatrixReader(simmat);
+            if (reader->isMask) qFatal("Expected a similarity matrix, got mask %s.", qPrintable(simmat));
+            // Make sure we're fusing score matrices for the same set of targets and queries
+            if (!readers.isEmpty() && ((reader->targetSigset != target) || (reader->querySigset != query)))
+                qFatal("Target or query files are not the same across fused matrices.");
+            if (!readers.isEmpty() && ((reader->rows != rows) || (reader->cols != cols)))
+                qFatal("Similarity matrix size mismatch.");
+            target = reader->targetSigset; query = reader->querySigset;
+            rows = reader->rows; cols = reader->cols;
+            readers.append(reader);
+        }
+
+        if ((readers.size() < 2) && (fusionMethod != "None")) qFatal("Expected at least two similarity matrices.");
+        if ((readers.size() > 1) && (fusionMethod == "None")) qFatal("Expected exactly one similarity matrix.");
 
-    if ((originalMatrices.size() < 2) && (fusion != "None")) qFatal("Expected at least two similarity matrices.");
-    if ((originalMatrices.size() > 1) && (fusion == "None")) qFatal("Expected exactly one similarity matrix.");
-
-    const FileList targetFiles = TemplateList::fromGallery(target).files();
-    const FileList queryFiles = TemplateList::fromGallery(query).files();
-
-    int partition = 0;
-    int crossValidate = Globals->crossValidate;
-    Mat buffer = Mat::zeros(originalMatrices.last().size(),originalMatrices.last().type());
-
-    do {
-        QList<Mat> matrices;
-        foreach (const Mat& matrix, originalMatrices)
-            matrices.append(matrix.clone());
-
-        Mat matrix_mask = BEE::makeMask(targetFiles,queryFiles,partition);
-        for (int i=0; i<matrices.size(); i++)
-            normalizeMatrix(matrices[i], matrix_mask, normalization);
-
-        Mat fused;
-        if (fusion == "Max") {
-            max(matrices[0], matrices[1], fused);
-            for (int i=2; i<matrices.size(); i++)
-                max(fused, matrices[i], fused);
-        } else if (fusion == "Min") {
-            min(matrices[0], matrices[1], fused);
-            for (int i=2; i<matrices.size(); i++)
-                min(fused, matrices[i], fused);
-        } else if (fusion.startsWith("Sum")) {
-            QList<float> weights;
-            QStringList words = fusion.right(fusion.size()-3).split(":", QString::SkipEmptyParts);
+        if      (normalizationMethod == "None")   normalization = None;
+        else if (normalizationMethod == "MinMax") normalization = MinMax;
+        else if (normalizationMethod == "ZScore") normalization = ZScore;
+        else    qFatal("Invalid normalization method %s.", qPrintable(normalizationMethod));
+
+        if      (fusionMethod == "Max")        fusion = Max;
+        else if (fusionMethod == "Min")        fusion = Min;
+        else if (fusionMethod == "Replace")    fusion = Replace;
+        else if (fusionMethod == "Difference") fusion = Difference;
+        else if (fusionMethod == "None")       fusion = Single;
+        else if (fusionMethod.startsWith("Sum")) {
+            fusion = Sum;
+            QStringList words = fusionMethod.right(fusionMethod.size()-3).split(":", QString::SkipEmptyParts);
             if (words.size() == 0) {
-                for (int k=0; k<matrices.size(); k++)
+                for (int k=0; k<readers.size(); k++)
                     weights.append(1);
-            } else if (words.size() == matrices.size()) {
+            } else if (words.size() == readers.size()) {
                 bool ok;
-                for (int k=0; k<matrices.size(); k++) {
+                for (int k=0; k<readers.size(); k++) {
                     float weight = words[k].toFloat(&ok);
                     if (!ok) qFatal("Non-numerical weight %s.", qPrintable(words[k]));
                     weights.append(weight);
@@ -136,32 +130,189 @@ void br::Fuse(const QStringList &inputSimmats, const QString &normalization, con
             } else {
                 qFatal("Number of weights does not match number of similarity matrices.");
             }
-
-            addWeighted(matrices[0], weights[0], matrices[1], weights[1], 0, fused);
-            for (int i=2; i<matrices.size(); i++)
-                addWeighted(fused, 1, matrices[i], weights[i], 0, fused);
-        } else if (fusion == "Replace") {
-            if (matrices.size() != 2) qFatal("Replace fusion requires exactly two matrices.");
-            fused = matrices.first().clone();
-            matrices.last().copyTo(fused, matrix_mask != BEE::DontCare);
-        } else if (fusion == "Difference") {
-            if (matrices.size() != 2) qFatal("Difference fusion requires exactly two matrices.");
-            subtract(matrices[0], matrices[1], fused);
-        } else if (fusion == "None") {
-            fused = matrices[0];
         } else {
-            qFatal("Invalid fusion method %s.", qPrintable(fusion));
+            qFatal("Invalid fusion method %s.", qPrintable(fusionMethod));
         }
 
-        // We don't want to add scores where the mask says we shouldn't care
-        Mat buffer_mask = Mat::ones(matrix_mask.size(),CV_8UC1);
-        buffer_mask.setTo(0,matrix_mask==BEE::DontCare);
+        if ((fusion == Replace) && (readers.size() != 2)) qFatal("Replace fusion requires exactly two matrices.");
+        if ((fusion == Difference) && (readers.size() != 2)) qFatal("Difference fusion requires exactly two matrices.");
+
+        const FileList targetFiles = TemplateList::fromGallery(target).files();
+        const FileList queryFiles = TemplateList::fromGallery(query).files();
+        if ((targetFiles.size() != cols) || (queryFiles.size() != rows))
+            qFatal("Similarity matrix size does not match the target and query galleries.");
 
-        add(buffer,fused,buffer,buffer_mask);
+        const int partitions = std::max(1, Globals->crossValidate);
+        for (int partition=0; partition<partitions; partition++)
+            masks.append(BEE::LabelMask(targetFiles, queryFiles, partition));
+    }
+
+    ~Fuser()
+    {
+        qDeleteAll(readers);
+    }
 
-        partition++;
+    int blockRows() const
+    {
+        // Roughly 4 MB of scores per input matrix per block
+        return std::max(1, (1 << 20) / std::max(1, cols));
+    }
 
-    } while (partition < crossValidate);
+    QList<Mat> readBlock(int row, int count) const
+    {
+        QList<Mat> block;
+        foreach (BEE::MatrixReader *reader, readers)
+            block.append(reader->readRows(row, count));
+        return block;
+    }
+
+    static QVector<Statistics> accumulate(const Fuser *fuser, int row, int count)
+    {
+        const int n = fuser->readers.size();
+        QVector<Statistics> statistics(fuser->masks.size() * n);
+        const QList<Mat> block = fuser->readBlock(row, count);
+        QVector<BEE::MaskValue> mask(fuser->cols);
+        for (int i=0; i<count; i++) {
+            for (int p=0; p<fuser->masks.size(); p++) {
+                if (!fuser->masks[p].isActive(row+i)) continue;
+                fuser->masks[p].fillRow(row+i, mask.data());
+                for (int k=0; k<n; k++) {
+                    const float *scores = block[k].ptr<float>(i);
+                    Statistics &s = statistics[p*n+k];
+                    for (int j=0; j<fuser->cols; j++) {
+                        const float val = scores[j];
+                        if ((mask[j] == BEE::DontCare) ||
+                            (val == -std::numeric_limits<float>::max()) ||
+                            (val ==  std::numeric_limits<float>::max()))
+                            continue;
+                        s.add(val);
+                    }
+                }
+            }
+        }
+        return statistics;
+    }
+
+    inline float normalize(float val, const Statistics &s) const
+    {
+        if (normalization == MinMax) {
+            if      (val == -std::numeric_limits<float>::max()) return 0;
+            else if (val ==  std::numeric_limits<float>::max()) return 1;
+            else                                                return (val - s.min) / (s.max - s.min);
+        } else if (normalization == ZScore) {
+            const double stddev = s.stddev();
+            if      (val == -std::numeric_limits<float>::max()) return (s.min - s.mean) / stddev;
+            else if (val ==  std::numeric_limits<float>::max()) return (s.max - s.mean) / stddev;
+            else                                                return (val - s.mean) / stddev;
+        }
+        return val;
+    }
+
+    static Mat fuseBlock(const Fuser *fuser, int row, int count)
+    {
+        const int n = fuser->readers.size();
+        const QList<Mat> block = fuser->readBlock(row, count);
+        Mat fused = Mat::zeros(count, fuser->cols, CV_32FC1);
+        QVector<BEE::MaskValue> mask(fuser->cols);
+        QVector<const float*> scores(n);
+        for (int i=0; i<count; i++) {
+            float *output = fused.ptr<float>(i);
+            for (int k=0; k<n; k++)
+                scores[k] = block[k].ptr<float>(i);
+
+            for (int p=0; p<fuser->masks.size(); p++) {
+                // We don't want to add scores where the mask says we shouldn't care
+                if (!fuser->masks[p].isActive(row+i)) continue;
+                fuser->masks[p].fillRow(row+i, mask.data());
+                const Statistics *s = &fuser->statistics[p*n];
+                for (int j=0; j<fuser->cols; j++) {
+                    if (mask[j] == BEE::DontCare) continue;
+                    float val;
+                    switch (fuser->fusion) {
+                      case Max:
+                        val = fuser->normalize(scores[0][j], s[0]);
+                        for (int k=1; k<n; k++) val = std::max(val, fuser->normalize(scores[k][j], s[k]));
+                        break;
+                      case Min:
+                        val = fuser->normalize(scores[0][j], s[0]);
+                        for (int k=1; k<n; k++) val = std::min(val, fuser->normalize(scores[k][j], s[k]));
+                        break;
+                      case Sum:
+                        val = 0;
+                        for (int k=0; k<n; k++) val += fuser->weights[k] * fuser->normalize(scores[k][j], s[k]);
+                        break;
+                      case Replace:
+                        val = fuser->normalize(scores[1][j], s[1]);
+                        break;
+                      case Difference:
+                        val = fuser->normalize(scores[0][j], s[0]) - fuser->normalize(scores[1][j], s[1]);
+                        break;
+                      default:
+                        val = fuser->normalize(scores[0][j], s[0]);
+                    }
+                    output[j] += val;
+                }
+            }
+        }
+        return fused;
+    }
+
+    void computeStatistics()
+    {
+        statistics = QVector<Statistics>(masks.size() * readers.size());
+        if (normalization == None) return;
+
+        const int blockSize = blockRows();
+        QFutureSynchronizer< QVector<Statistics> > futures;
+        QList< QVector<Statistics> > results;
+        for (int row=0; row<rows; row+=blockSize) {
+            const int count = std::min(blockSize, rows-row);
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(accumulate, this, row, count));
+            else                      results.append(accumulate(this, row, count));
+        }
+        futures.waitForFinished();
+        foreach (const QFuture< QVector<Statistics> > &future, futures.futures())
+            results.append(future.result());
+
+        foreach (const QVector<Statistics> &result, results)
+            for (int i=0; i<statistics.size(); i++)
+                statistics[i].add(result[i]);
+
+        if (normalization == ZScore)
+            foreach (const Statistics &s, statistics)
+                if (s.count > 0 && s.stddev() == 0) qFatal("Stddev is 0.");
+    }
+
+    void write(const File &outputSimmat)
+    {
+        const int blockSize = blockRows();
+        // Keep only as many blocks in flight as there are threads, writing them in order
+        const int inFlight = std::max(1, abs(Globals->parallelism));
+        BEE::MatrixWriter writer(outputSimmat.name, rows, cols, false, "Unknown_Target", "Unknown_Query",
+                                 outputSimmat.get<QString>("encoding", "float"), outputSimmat.get<float>("minScore", 0), outputSimmat.get<float>("maxScore", 0));
+        for (int row=0; row<rows; row+=blockSize*inFlight) {
+            QFutureSynchronizer<Mat> futures;
+            for (int i=0; i<inFlight; i++) {
+                const int begin = row + i*blockSize;
+                if (begin >= rows) break;
+                const int count = std::min(blockSize, rows-begin);
+                if (Globals->parallelism) futures.addFuture(QtConcurrent::run(fuseBlock, this, begin, count));
+                else                      writer.writeRows(fuseBlock(this, begin, count));
+            }
+            futures.waitForFinished();
+            foreach (const QFuture<Mat> &future, futures.futures())
+                writer.writeRows(future.result());
+        }
+    }
+};
+
+} // namespace
+
+void br::Fuse(const QStringList &inputSimmats, const QString &normalization, const QString &fusion, const QString &outputSimmat)
+{
+    qDebug("Fusing %d to %s", inputSimmats.size(), qPrintable(outputSimmat));
 
-    BEE::writeMatrix(buffer, outputSimmat);
+    Fuser fuser(inputSimmats, normalization, fusion);
+    fuser.computeStatistics();
+    fuser.write(outputSimmat);
 }
@@ -18,6 +18,9 @@
 #include <opencv2/highgui/highgui_c.h>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/imgproc/imgproc_c.h>
+#include <QAtomicInt>
+#include <QHash>
+#include <QMutex>
 #include <openbr/openbr_plugin.h>
 
 #include "opencvutils.h"
@@ -336,6 +339,25 @@ bool OpenCVUtils::overlaps(const QList<Rect> &posRects, const Rect &negRect, dou
     return false;
 }
 
+static QHash<QIODevice*, OpenCVUtils::MappedMatrices*> mappedDevices;
+static QMutex mappedDevicesLock;
+static QAtomicInt mappedDeviceCount;
+
+void OpenCVUtils::setMappedMatrices(QIODevice *device, MappedMatrices *matrices)
+{
+    QMutexLocker locker(&mappedDevicesLock);
+    if (matrices) mappedDevices.insert(device, matrices);
+    else          mappedDevices.remove(device);
+    mappedDeviceCount.store(mappedDevices.size());
+}
+
+static OpenCVUtils::MappedMatrices *mappedMatrices(const QDataStream &stream)
+{
+    if (mappedDeviceCount.load() == 0) return NULL; // Common case, no lock
+    QMutexLocker locker(&mappedDevicesLock);
+    return mappedDevices.value(stream.device(), NULL);
+}
+
 QDataStream &operator<<(QDataStream &stream, const Mat &m)
 {
     // Write header
@@ -346,6 +368,19 @@ QDataStream &operator<<(QDataStream &stream, const Mat &m)
 
     // Write data
     int len = rows * cols * m.elemSize();
+
+    // Store large matrices out of line, aligned for in-place binding when mapped
+    OpenCVUtils::MappedMatrices *mapped = (len >= 256) ? mappedMatrices(stream) : NULL;
+    if (mapped) {
+        if (!m.isContinuous()) qFatal("Can't serialize non-continuous matrices.");
+        const qint64 alignment = (len >= 4096) ? 4096 : 16;
+        const qint64 offset = (mapped->size + alignment - 1) / alignment * alignment;
+        mapped->matrices.append(QPair<qint64, Mat>(offset, m));
+        mapped->size = offset + len;
+        stream << int(-1) << offset;
+        return stream;
+    }
+
     stream << len;
     if (len > 0) {
         if (!m.isContinuous()) qFatal("Can't serialize non-continuous matrices.");
@@ -360,10 +395,21 @@ QDataStream &operator>>(QDataStream &stream, Mat &m)
     // Read header
     int rows, cols, type;
     stream >> rows >> cols >> type;
-    m.create(rows, cols, type);
 
     int len;
     stream >> len;
+
+    // Bind out of line matrices in place
+    if (len == -1) {
+        qint64 offset;
+        stream >> offset;
+        const OpenCVUtils::MappedMatrices *mapped = mappedMatrices(stream);
+        if (!mapped || !mapped->data) qFatal("Mat deserialization failure, out of line data requires a mapped model.");
+        m = Mat(rows, cols, type, (void*) (mapped->data + offset));
+        return stream;
+    }
+
+    m.create(rows, cols, type);
     char *data = (char*) m.data;
 
     // In certain circumstances, like reading from stdin or sockets, we may not
@@ -93,6 +93,19 @@ namespace OpenCVUtils
     float overlap(const QRectF &rect1, const QRectF &rect2);
 
     int getFourcc();
+
+    // Out-of-line matrix storage for memory mapped models
+    struct MappedMatrices
+    {
+        QList< QPair<qint64, cv::Mat> > matrices; // Offset and matrix, populated when writing
+        qint64 size;                              // Bytes of matrix data, populated when writing
+        const uchar *data;                        // Base address of matrix data, required when reading
+
+        MappedMatrices() : size(0), data(NULL) {}
+    };
+
+    // While set, large matrices serialized through the device are stored out of line
+    void setMappedMatrices(QIODevice *device, MappedMatrices *matrices); // NULL to unset
 }
 
 QDebug operator<<(QDebug dbg, const cv::Mat &m);
@@ -0,0 +1,373 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QPair>
+#include <QSet>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QThreadStorage>
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "profiler.h"
+#include "qtutils.h"
+
+using namespace br;
+
+namespace
+{
+
+struct Stats
+{
+    qint64 calls, wall, cpu, selfCpu, bytesIn, bytesOut, allocations, wait;
+
+    Stats() : calls(0), wall(0), cpu(0), selfCpu(0), bytesIn(0), bytesOut(0), allocations(0), wait(0) {}
+
+    void add(const Stats &other)
+    {
+        calls += other.calls;
+        wall += other.wall;
+        cpu += other.cpu;
+        selfCpu += other.selfCpu;
+        bytesIn += other.bytesIn;
+        bytesOut += other.bytesOut;
+        allocations += other.allocations;
+        wait += other.wait;
+    }
+
+    QJsonObject toJson() const
+    {
+        QJsonObject object;
+        object.insert("calls", double(calls));
+        object.insert("wallNs", double(wall));
+        object.insert("cpuNs", double(cpu));
+        object.insert("selfCpuNs", double(selfCpu));
+        object.insert("bytesIn", double(bytesIn));
+        object.insert("bytesOut", double(bytesOut));
+        object.insert("allocations", double(allocations));
+        object.insert("waitNs", double(wait));
+        return object;
+    }
+};
+
+QElapsedTimer startedTimer()
+{
+    QElapsedTimer timer;
+    timer.start();
+    return timer;
+}
+
+const QElapsedTimer wallClock = startedTimer();
+
+qint64 cpuClock()
+{
+#ifdef Q_OS_WIN
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return 0;
+    // 100 nanosecond units
+    return 100 * ((qint64(kernel.dwHighDateTime) << 32 | kernel.dwLowDateTime) +
+                  (qint64(user.dwHighDateTime) << 32 | user.dwLowDateTime));
+#else
+    timespec time;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0)
+        return 0;
+    return qint64(time.tv_sec) * 1000000000 + time.tv_nsec;
+#endif
+}
+
+qint64 bytes(const cv::Mat &m)
+{
+    return qint64(m.total()) * m.elemSize();
+}
+
+} // namespace
+
+// Interned call paths, shared by all threads since paths are handed between them
+static QMutex pathsLock;
+static QVector< QPair<int, QString> > interned; // Parent and node name of each path
+static QHash< QPair<int, QString>, int > internedIds;
+
+static int intern(int parent, const QString &name)
+{
+    QMutexLocker locker(&pathsLock);
+    const QPair<int, QString> key(parent, name);
+    QHash< QPair<int, QString>, int >::const_iterator it = internedIds.constFind(key);
+    if (it != internedIds.constEnd())
+        return it.value();
+    interned.append(key);
+    return internedIds.insert(key, interned.size()-1).value();
+}
+
+// Semicolon separated node names, as read by flamegraph.pl
+static QString pathName(int id)
+{
+    QMutexLocker locker(&pathsLock);
+    QStringList names;
+    for (; id >= 0; id = interned[id].first)
+        names.prepend(interned[id].second);
+    return names.join(";");
+}
+
+// Nodes whose path ids are cached. A destroyed node's address can be reused by a different node,
+// so destroying one invalidates every thread's cache. Never deleted, nodes may be destroyed during static destruction.
+static QMutex *const watchedLock = new QMutex();
+static QSet<const QObject*> *const watched = new QSet<const QObject*>();
+static QAtomicInt watchedEpoch;
+
+static void forget(QObject *node)
+{
+    QMutexLocker locker(watchedLock);
+    watched->remove(node);
+    watchedEpoch.ref();
+}
+
+static void watch(const Object *node)
+{
+    QMutexLocker locker(watchedLock);
+    if (watched->contains(node))
+        return;
+    watched->insert(node);
+    QObject::connect(node, &QObject::destroyed, forget);
+}
+
+struct Profiler::Thread
+{
+    QMutex mutex; // Only contended while a report is written
+    QHash<int, Stats> stats; // By path id
+
+    // Open scopes
+    QVector<const Object*> nodes;
+    QVector<int> paths;
+    QVector<qint64> childCpu;
+
+    QHash< QPair<int, const Object*>, int > children; // Path id of a node under a parent path
+    int epoch; // watchedEpoch when children was last valid
+
+    Thread() : epoch(0) {}
+
+    static Thread *current();
+
+    // Composites are named by class alone, their children appear as nested frames
+    int path(const Object *node, int parent)
+    {
+        const int current = watchedEpoch.loadAcquire();
+        if (current != epoch) {
+            children.clear();
+            epoch = current;
+        }
+
+        const QPair<int, const Object*> key((parent >= 0) ? parent : (paths.isEmpty() ? -1 : paths.last()), node);
+        QHash< QPair<int, const Object*>, int >::const_iterator child = children.constFind(key);
+        if (child != children.constEnd())
+            return child.value();
+        const QString name = (node->inherits("br::CompositeTransform") ? node->objectName() : node->description()).replace(';', ',');
+        watch(node);
+        return children.insert(key, intern(key.first, name)).value();
+    }
+
+    void record(int path, const Stats &s)
+    {
+        QMutexLocker locker(&mutex);
+        stats[path].add(s);
+    }
+};
+
+static QMutex threadsLock;
+static QList< QSharedPointer<Profiler::Thread> > threads;
+static QThreadStorage< QSharedPointer<Profiler::Thread> > currentThread;
+
+Profiler::Thread *Profiler::Thread::current()
+{
+    if (!currentThread.hasLocalData()) {
+        // Kept alive by threads after the owning thread exits, until the report is written
+        QSharedPointer<Thread> thread(new Thread());
+        currentThread.setLocalData(thread);
+        QMutexLocker locker(&threadsLock);
+        threads.append(thread);
+    }
+    return currentThread.localData().data();
+}
+
+/* Profiler::Scope - public methods */
+Profiler::Scope::Scope(const Object *node, int parent)
+    : thread(NULL), wall(0), cpu(0), bytesIn(0), bytesOut(0), allocations(0)
+{
+    if (!enabled())
+        return;
+
+    Thread *current = Thread::current();
+    if (!current->nodes.isEmpty() && (current->nodes.last() == node))
+        return;
+
+    current->paths.append(current->path(node, parent));
+    current->nodes.append(node);
+    current->childCpu.append(0);
+    thread = current;
+    cpu = cpuClock();
+    wall = clock();
+}
+
+Profiler::Scope::~Scope()
+{
+    if (!thread)
+        return;
+
+    Stats s;
+    s.calls = 1;
+    s.wall = clock() - wall;
+    s.cpu = cpuClock() - cpu;
+    s.selfCpu = s.cpu - thread->childCpu.last();
+    s.bytesIn = bytesIn;
+    s.bytesOut = bytesOut;
+    s.allocations = allocations;
+    thread->record(thread->paths.last(), s);
+
+    thread->paths.removeLast();
+    thread->nodes.removeLast();
+    thread->childCpu.removeLast();
+    if (!thread->childCpu.isEmpty())
+        thread->childCpu.last() += s.cpu;
+}
+
+void Profiler::Scope::input(const Template &t)
+{
+    if (!thread)
+        return;
+    foreach (const cv::Mat &m, t) {
+        bytesIn += bytes(m);
+        buffers.append(m.datastart);
+    }
+}
+
+void Profiler::Scope::input(const TemplateList &templates)
+{
+    foreach (const Template &t, templates)
+        input(t);
+}
+
+void Profiler::Scope::output(const Template &t)
+{
+    if (!thread)
+        return;
+    foreach (const cv::Mat &m, t) {
+        bytesOut += bytes(m);
+        if (m.datastart && !buffers.contains(m.datastart))
+            allocations++;
+    }
+}
+
+void Profiler::Scope::output(const TemplateList &templates)
+{
+    foreach (const Template &t, templates)
+        output(t);
+}
+
+/* Profiler - public methods */
+bool Profiler::enabled()
+{
+    return Globals && !Globals->profile.isEmpty();
+}
+
+int Profiler::path()
+{
+    if (!enabled())
+        return -1;
+    const Thread *thread = Thread::current();
+    return thread->paths.isEmpty() ? -1 : thread->paths.last();
+}
+
+qint64 Profiler::clock()
+{
+    return wallClock.nsecsElapsed();
+}
+
+void Profiler::wait(const Object *node, qint64 nsecs)
+{
+    if (!enabled())
+        return;
+    Thread *thread = Thread::current();
+    Stats s;
+    s.wait = nsecs;
+    thread->record(thread->path(node, -1), s);
+}
+
+void Profiler::report(const QString &file)
+{
+    QHash<int, Stats> ids;
+    {
+        QMutexLocker locker(&threadsLock);
+        foreach (const QSharedPointer<Thread> &thread, threads) {
+            QMutexLocker threadLocker(&thread->mutex);
+            for (QHash<int, Stats>::const_iterator it = thread->stats.constBegin(); it != thread->stats.constEnd(); ++it)
+                ids[it.key()].add(it.value());
+            thread->stats.clear();
+        }
+    }
+
+    QHash<QString, Stats> stacks;
+    for (QHash<int, Stats>::const_iterator it = ids.constBegin(); it != ids.constEnd(); ++it)
+        stacks[pathName(it.key())].add(it.value());
+
+    QStringList paths = stacks.keys();
+    paths.sort();
+
+    if (QFileInfo(file).suffix() == "json") {
+        QHash<QString, Stats> nodes;
+        foreach (const QString &path, paths)
+            nodes[path.section(';', -1)].add(stacks[path]);
+
+        QJsonArray nodeArray;
+        QStringList names = nodes.keys();
+        names.sort();
+        foreach (const QString &name, names) {
+            QJsonObject object = nodes[name].toJson();
+            object.insert("node", name);
+            nodeArray.append(object);
+        }
+
+        QJsonArray stackArray;
+        foreach (const QString &path, paths) {
+            QJsonObject object = stacks[path].toJson();
+            object.insert("stack", QJsonArray::fromStringList(path.split(';')));
+            stackArray.append(object);
+        }
+
+        QJsonObject report;
+        report.insert("nodes", nodeArray);
+        report.insert("stacks", stackArray);
+        QtUtils::writeFile(file, QJsonDocument(report).toJson());
+    } else {
+        // Self CPU time in microseconds, the collapsed format read by flamegraph.pl
+        QStringList lines;
+        foreach (const QString &path, paths) {
+            const qint64 micros = stacks[path].selfCpu / 1000;
+            if (micros > 0)
+                lines.append(path + " " + QString::number(micros));
+        }
+        QtUtils::writeFile(file, lines);
+    }
+}
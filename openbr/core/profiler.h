@@ -0,0 +1,67 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_PROFILER_H
+#define BR_PROFILER_H
+
+#include <QString>
+#include <QVector>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+// Opt-in profiler enabled by setting Globals->profile.
+// Each thread records the nodes it runs under their call path, the per-thread tables are
+// merged when the report is written by Context::finalize(). Call paths are interned as ids,
+// work handed to another thread keeps its call path by passing path() along as the parent
+// of the scopes opened there.
+class Profiler
+{
+public:
+    struct Thread;
+
+    // Times a call of node from construction to destruction, nested calls of the same node are ignored
+    class Scope
+    {
+    public:
+        explicit Scope(const Object *node, int parent = -1); // The current thread's path unless parent is given
+        ~Scope();
+
+        bool active() const { return thread != NULL; }
+        void input(const Template &t);
+        void input(const TemplateList &templates);
+        void output(const Template &t);
+        void output(const TemplateList &templates);
+
+    private:
+        Thread *thread;
+        qint64 wall, cpu, bytesIn, bytesOut, allocations;
+        QVector<const uchar*> buffers; // Of the input, outputs backed by other buffers count as allocations
+
+        Q_DISABLE_COPY(Scope)
+    };
+
+    static bool enabled();
+    static int path(); // Call path of the current thread, -1 at the root
+    static qint64 clock(); // Monotonic nanoseconds
+    static void wait(const Object *node, qint64 nsecs); // Time a queued input waited for node
+    static void report(const QString &file); // JSON if file ends in .json, otherwise collapsed stacks
+};
+
+} // namespace br
+
+#endif // BR_PROFILER_H
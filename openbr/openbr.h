@@ -75,6 +75,9 @@ BR_EXPORT void br_cat(int num_input_galleries, const char *input_galleries[], co
  * \param output_gallery Deduplicated gallery.
  * \param threshold Comparisons with a match score >= this value are designated to be duplicates.
  * \note If a gallery contains n duplicates, the first n-1 duplicates in the gallery will be removed and the nth will be kept.
+ * \note Set \c hashBits on \c output_gallery to only compare templates sharing a sign random projection hash in at least one of \c hashTables (default 8) tables.
+ * If the buckets would propose more than \c hashMaxCandidates (default 2^24) pairs, or a quarter of all pairs, every pair is compared instead.
+ * \note Set \c report on \c output_gallery to write the duplicate groups as CSV.
  * \note Users are encouraged to use binary gallery formats as the entire gallery is read into memory in one call to Gallery::read.
  */
 
@@ -86,6 +89,8 @@ BR_EXPORT void br_deduplicate(const char *input_gallery, const char *output_gall
  * A similarity matrix is a type of br::Output. The current clustering algorithm is a simplified implementation of \cite zhu11.
  * \param num_simmats Size of \c simmats.
  * \param simmats Array of \ref simmat composing one large self-similarity matrix arranged in row major order.
+ *                Alternatively a single enrolled gallery, compared against itself on the fly with its \c algorithm.
+ *                The \c neighbors argument of the first element sets how many neighbors are kept per template (default 20).
  * \param aggressiveness The higher the aggressiveness the larger the clusters. Suggested range is [0,10].
  * \param csv The cluster results file to generate. Results are stored one row per cluster and use gallery indices.
  */
@@ -112,6 +117,9 @@ BR_EXPORT void br_combine_masks(int num_input_masks, const char *input_masks[],
  *                      A value of '.' reuses the target gallery as the query gallery.
  * \param output Optional br::Output file to contain the results of comparing the templates.
  *               The default behavior is to print scores to the terminal.
+ * \note Set \c shards (and optionally \c colShards) on a \c mtx, \c rr or \c tail \c output to partition the query (and target) gallery
+ *       into tiles compared by up to \c processes local processes whose partial outputs are then merged.
+ *       Adding \c shard computes a single tile, tiles already computed are not recomputed before merging.
  * \see br_enroll
  */
 BR_EXPORT void br_compare(const char *target_gallery, const char *query_gallery, const char *output = "");
@@ -445,6 +453,8 @@ BR_EXPORT int br_time_remaining();
  * \param model Optional string specifying the binary file to serialize training results to.
  *              The trained algorithm can be recovered by using this file as the algorithm.
  *              By default the trained algorithm will not be serialized to disk.
+ *              Append <tt>[mapped=true]</tt> to store an uncompressed model whose large matrices are
+ *              memory mapped and used in place when loaded, instead of decompressed and copied.
  * \see br_train_n
  */
 BR_EXPORT void br_train(const char *input, const char *model = "");
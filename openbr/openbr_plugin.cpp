@@ -34,9 +34,11 @@
 
 #include "openbr_plugin.h"
 #include "version.h"
+#include "core/arena.h"
 #include "core/bee.h"
 #include "core/common.h"
 #include "core/opencvutils.h"
+#include "core/profiler.h"
 #include "core/qtutils.h"
 #include "openbr/plugins/openbr_internal.h"
 
@@ -1054,6 +1056,14 @@ void br::Context::finalize()
     foreach (const QSharedPointer<Initializer> &initializer, initializers)
         initializer->finalize();
 
+    if (!Globals->profile.isEmpty())
+        Profiler::report(Globals->profile);
+
+    if (Globals->arena) {
+        qDebug("%s", qPrintable(Arena::statistics()));
+        Arena::trim();
+    }
+
     delete Globals;
     Globals = NULL;
 
@@ -1168,6 +1178,7 @@ void Output::initialize(const FileList &targetFiles, const FileList &queryFiles)
         blockCols = Globals->blockSize;
 
     selfSimilar = (queryFiles == targetFiles) && (targetFiles.size() > 1) && (queryFiles.size() > 1);
+    upperTriangle = false;
 }
 
 void Output::setBlock(int rowBlock, int columnBlock)
@@ -1183,6 +1194,17 @@ void Output::setRelative(float value, int i, int j)
     if (!next.isNull()) next->setRelative(value, i, j);
 }
 
+bool Output::needsMirror() const
+{
+    return !upperTriangular() || (!next.isNull() && next->needsMirror());
+}
+
+void Output::setUpperTriangle(bool upperTriangle)
+{
+    this->upperTriangle = upperTriangle;
+    if (!next.isNull()) next->setUpperTriangle(upperTriangle);
+}
+
 Output *Output::make(const File &file, const FileList &targetFiles, const FileList &queryFiles)
 {
     Output *output = NULL;
@@ -1228,7 +1250,12 @@ TemplateList Gallery::read()
 {
     TemplateList templates;
     bool done = false;
-    while (!done) templates.append(readBlock(&done));
+    while (!done) {
+        Profiler::Scope scope(this);
+        const TemplateList block = readBlock(&done);
+        scope.output(block);
+        templates.append(block);
+    }
     return templates;
 }
 
@@ -1236,16 +1263,28 @@ FileList Gallery::files()
 {
     FileList files;
     bool done = false;
-    while (!done) files.append(readBlock(&done).files());
+    while (!done) {
+        Profiler::Scope scope(this);
+        files.append(readBlock(&done).files());
+    }
     return files;
 }
 
 void Gallery::writeBlock(const TemplateList &templates)
 {
-    foreach (const Template &t, templates) write(t);
+    {
+        Profiler::Scope scope(this);
+        scope.input(templates);
+        writeTemplates(templates);
+    }
     if (!next.isNull()) next->writeBlock(templates);
 }
 
+void Gallery::writeTemplates(const TemplateList &templates)
+{
+    foreach (const Template &t, templates) write(t);
+}
+
 Gallery *Gallery::make(const File &file)
 {
     Gallery *gallery = NULL;
@@ -1425,8 +1464,120 @@ Distance *Distance::make(QString str, QObject *parent)
     return distance;
 }
 
+/*!
+ * Evaluates each pair of a self-comparison once, one output block of the upper triangle
+ * at a time. The rows of each block are split into chunks that the thread pool balances
+ * across threads, and scores are mirrored into the lower triangle only when an output needs it.
+ */
+struct SymmetricCompare
+{
+    const Distance *distance;
+    const TemplateList *templates;
+    Output *output;
+    int blockSize;
+    int rowOffset, columnOffset; // Of the current block
+    cv::Mat scores;
+    int path; // Profiler call path of run()
+    bool progress; // Report through Globals, as ProgressCounter does for the comparison pipeline
+
+    SymmetricCompare(const Distance *distance, const TemplateList *templates, Output *output, bool progress)
+        : distance(distance), templates(templates), output(output), blockSize(output->blockRows), path(-1), progress(progress) {}
+
+    static void compareRows(SymmetricCompare *compare, int begin, int end)
+    {
+        Profiler::Scope scope(compare->distance, compare->path);
+        const bool diagonal = compare->rowOffset == compare->columnOffset;
+        for (int i=begin; i<end; i++) {
+            const Template &query = compare->templates->at(compare->rowOffset+i);
+            float *row = compare->scores.ptr<float>(i);
+            for (int j=(diagonal ? i : 0); j<compare->scores.cols; j++) {
+                const Template &target = compare->templates->at(compare->columnOffset+j);
+                row[j] = (target.isEmpty() || query.isEmpty()) ? -std::numeric_limits<float>::max()
+                                                               : compare->distance->compare(target, query);
+            }
+        }
+    }
+
+    void run()
+    {
+        const int size = templates->size();
+        const int blocks = (size + blockSize - 1) / blockSize;
+        const bool mirror = output->needsMirror();
+        const int chunks = 4 * std::max(1, abs(Globals->parallelism));
+        path = Profiler::path();
+        output->setUpperTriangle(!mirror);
+
+        QElapsedTimer timer;
+        if (progress) {
+            timer.start();
+            Globals->startTime.start();
+            Globals->currentStep = 0;
+            Globals->currentProgress = 0;
+            Globals->totalSteps = double(size) * (size + 1) / 2; // Pairs evaluated
+        }
+
+        for (int rowBlock=0; rowBlock<blocks; rowBlock++) {
+            for (int columnBlock=rowBlock; columnBlock<blocks; columnBlock++) {
+                rowOffset = rowBlock * blockSize;
+                columnOffset = columnBlock * blockSize;
+                const int rows = std::min(blockSize, size - rowOffset);
+                const int columns = std::min(blockSize, size - columnOffset);
+                const bool diagonal = rowBlock == columnBlock;
+                scores.create(rows, columns, CV_32FC1);
+
+                const int step = std::max(1, rows / chunks);
+                QFutureSynchronizer<void> futures;
+                for (int begin=0; begin<rows; begin+=step) {
+                    const int end = std::min(rows, begin+step);
+                    if (Globals->parallelism) futures.addFuture(QtConcurrent::run(compareRows, this, begin, end));
+                    else                      compareRows(this, begin, end);
+                }
+                futures.waitForFinished();
+
+                if (progress) {
+                    Globals->currentProgress += diagonal ? double(rows) * (rows + 1) / 2 : double(rows) * columns;
+                    if (columnBlock == blocks-1)
+                        Globals->currentStep += rows;
+                    if (timer.elapsed() > 1000) {
+                        Globals->printStatus();
+                        timer.start();
+                    }
+                }
+
+                Profiler::Scope scope(output);
+                output->setBlock(rowBlock, columnBlock);
+                for (int i=0; i<rows; i++)
+                    for (int j=(diagonal ? i : 0); j<columns; j++)
+                        output->setRelative(scores.at<float>(i,j), i, j);
+
+                if (!mirror)
+                    continue;
+
+                if (diagonal) {
+                    for (int i=0; i<rows; i++)
+                        for (int j=i+1; j<columns; j++)
+                            output->setRelative(scores.at<float>(i,j), j, i);
+                } else {
+                    output->setBlock(columnBlock, rowBlock);
+                    for (int i=0; i<rows; i++)
+                        for (int j=0; j<columns; j++)
+                            output->setRelative(scores.at<float>(i,j), j, i);
+                }
+            }
+        }
+        output->setUpperTriangle(false);
+    }
+};
+
 void Distance::compare(const TemplateList &target, const TemplateList &query, Output *output) const
 {
+    // Self-comparisons of symmetric distances with aligned square blocks only need the upper triangle
+    if (symmetric() && output->selfSimilar && (output->blockRows == output->blockCols) && (output->blockRows > 0) &&
+        (target.size() == query.size()) && (target.files() == query.files())) {
+        compareSymmetric(target, output);
+        return;
+    }
+
     const bool stepTarget = target.size() > query.size();
     const int totalSize = std::max(target.size(), query.size());
     int stepSize = ceil(float(totalSize) / float(std::max(1, abs(Globals->parallelism))));
@@ -1481,8 +1632,18 @@ float Distance::compare(const uchar *, const uchar *, size_t) const
 }
 
 /* Distance - private methods */
+void Distance::compareSymmetric(const TemplateList &templates, Output *output, bool progress) const
+{
+    if (output->blockRows != output->blockCols)
+        qFatal("Symmetric comparison requires square output blocks.");
+    SymmetricCompare(this, &templates, output, progress).run();
+}
+
 void Distance::compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
 {
+    Profiler::Scope scope(this);
+    scope.input(target);
+    scope.input(query);
     for (int i=0; i<query.size(); i++)
         for (int j=0; j<target.size(); j++)
             if (target[j].isEmpty() || query[i].isEmpty()) output->setRelative(-std::numeric_limits<float>::max(),i+queryOffset, j+targetOffset);
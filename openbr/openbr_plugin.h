@@ -741,6 +741,19 @@ public:
     Q_PROPERTY(int crossValidate READ get_crossValidate WRITE set_crossValidate RESET reset_crossValidate)
     BR_PROPERTY(int, crossValidate, 0)
 
+    /*!
+     * \brief Profile transforms, distances, galleries and outputs, writing the report to this file at br::Context::finalize().
+     * \c .json files get call counts, times and bytes per node and call stack, other files get collapsed stacks of self CPU time for flame graphs.
+     */
+    Q_PROPERTY(QString profile READ get_profile WRITE set_profile RESET reset_profile)
+    BR_PROPERTY(QString, profile, "")
+
+    /*!
+     * \brief Recycle stream frame buffers through per-thread arenas, reporting their use at br::Context::finalize().
+     */
+    Q_PROPERTY(bool arena READ get_arena WRITE set_arena RESET reset_arena)
+    BR_PROPERTY(bool, arena, false)
+
     QHash<QString,QString> abbreviations; /*!< \brief Used by br::Transform::make() to expand abbreviated algorithms into their complete definitions. */
     QTime startTime; /*!< \brief Used to estimate timeRemaining(). */
 
@@ -1022,11 +1035,15 @@ public:
     FileList targetFiles; /*!< \brief List of files representing the gallery templates. */
     FileList queryFiles; /*!< \brief List of files representing the probe templates. */
     bool selfSimilar; /*!< \brief \c true if the \em targetFiles == \em queryFiles, \c false otherwise. */
+    bool upperTriangle; /*!< \brief \c true while only self-similar scores with \em i <= \em j are being set. */
 
     virtual ~Output() {}
     virtual void initialize(const FileList &targetFiles, const FileList &queryFiles); /*!< \brief Initializes class data members. */
     virtual void setBlock(int rowBlock, int columnBlock); /*!< \brief Set the current block. */
     virtual void setRelative(float value, int i, int j); /*!< \brief Set a score relative to the current block. */
+    virtual bool upperTriangular() const { return false; } /*!< \brief \c true if only self-similar scores with \em i <= \em j are needed. */
+    bool needsMirror() const; /*!< \brief \c true if any output in the chain needs both halves of a self-similar matrix. */
+    void setUpperTriangle(bool upperTriangle); /*!< \brief Set \em upperTriangle for every output in the chain. */
 
     static Output *make(const File &file, const FileList &targetFiles, const FileList &queryFiles); /*!< \brief Make an output from a file and gallery/probe file lists. */
 
@@ -1114,6 +1131,9 @@ public:
     virtual qint64 totalSize() { return std::numeric_limits<qint64>::max(); }
     virtual qint64 position() { return 0; }
 
+protected:
+    virtual void writeTemplates(const TemplateList &templates); /*!< \brief Serialize a template list, by default calls write() for each template. */
+
 private:
     QSharedPointer<Gallery> next;
 };
@@ -1363,12 +1383,14 @@ public:
     virtual float compare(const Template &a, const Template &b) const; /*!< \brief Compute the distance between two templates. */
     virtual float compare(const cv::Mat &a, const cv::Mat &b) const; /*!< \brief Compute the distance between two biometric signatures. */
     virtual float compare(const uchar *a, const uchar *b, size_t size) const; /*!< \brief Compute the distance between two buffers. */
+    virtual bool symmetric() const { return false; } /*!< \brief Returns \c true if compare(a, b) always equals compare(b, a), self-comparisons then evaluate each pair once. */
 
 protected:
     inline Distance *make(const QString &description) { return make(description, this); } /*!< \brief Make a subdistance. */
 
 private:
     virtual void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const;
+    void compareSymmetric(const TemplateList &templates, Output *output, bool progress = false) const;
 
     friend struct AlgorithmCore;
     virtual bool compare(const File &targetGallery, const File &queryGallery, const File &output) const /*!< \brief Escape hatch for algorithms that need customized file I/O during comparison. */
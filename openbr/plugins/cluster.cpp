@@ -14,20 +14,301 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QtConcurrentRun>
 #include <opencv2/flann/flann.hpp>
 
 #include "openbr_internal.h"
 #include "openbr/core/common.h"
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/qtutils.h"
 
 using namespace cv;
 
 namespace br
 {
 
+/*!
+ * \brief Streaming, multi-threaded mini-batch k-means.
+ *
+ * Rows are addressed in place across the templates of a TemplateList rather than concatenated into one matrix.
+ * Seeding is k-means|| followed by weighted k-means++ over the oversampled candidates.
+ * Center updates follow Sculley's "Web-Scale K-Means Clustering" (2010).
+ * \author Josh Klontz \cite jklontz
+ */
+class MiniBatchKMeans
+{
+    QList<Mat> mats; // Keeps referenced template data alive
+    QVector<const float*> rows;
+    int dims;
+
+    static float distance(const float *a, const float *b, int size)
+    {
+        float sum = 0;
+        for (int i=0; i<size; i++) {
+            const float delta = a[i] - b[i];
+            sum += delta * delta;
+        }
+        return sum;
+    }
+
+    static float nearest(const float *row, const Mat &centers, int *index = NULL)
+    {
+        float best = std::numeric_limits<float>::max();
+        for (int i=0; i<centers.rows; i++) {
+            const float dist = distance(row, centers.ptr<float>(i), centers.cols);
+            if (dist < best) {
+                best = dist;
+                if (index) *index = i;
+            }
+        }
+        return best;
+    }
+
+    // Rows [begin, end) of the provided row indicies, or of all rows if indicies is NULL
+    struct AssignBlock
+    {
+        const int *indicies;
+        const Mat *centers;
+        int *labels;
+        float *dists;
+        int begin, end;
+    };
+
+    /* Index drawn with probability proportional to its weight, -1 if every weight is zero */
+    static int weightedSample(const QList<float> &weights)
+    {
+        QVector<double> cdf(weights.size());
+        double sum = 0;
+        for (int i=0; i<weights.size(); i++)
+            cdf[i] = (sum += weights[i]);
+        if (sum <= 0)
+            return -1;
+
+        // First index whose cumulative weight exceeds r, zero weight entries are never chosen
+        const double r = theRNG().uniform(0.0, 1.0) * sum;
+        const int index = std::upper_bound(cdf.begin(), cdf.end(), r) - cdf.begin();
+        return std::min(index, cdf.size()-1);
+    }
+
+    static void assignBlock(const MiniBatchKMeans *kmeans, AssignBlock block)
+    {
+        for (int i=block.begin; i<block.end; i++) {
+            const float *row = kmeans->rows[block.indicies ? block.indicies[i] : i];
+            block.dists[i] = nearest(row, *block.centers, &block.labels[i]);
+        }
+    }
+
+    void assign(const int *indicies, int size, const Mat &centers, int *labels, float *dists) const
+    {
+        const int blocks = std::max(1, std::min(abs(Globals->parallelism), size));
+        const int stepSize = (size + blocks - 1) / blocks;
+        QFutureSynchronizer<void> futures;
+        for (int begin=0; begin<size; begin+=stepSize) {
+            AssignBlock block = { indicies, &centers, labels, dists, begin, std::min(begin + stepSize, size) };
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(assignBlock, this, block));
+            else                      assignBlock(this, block);
+        }
+        futures.waitForFinished();
+    }
+
+    struct OversampleBlock
+    {
+        const Mat *candidates;
+        float *dists;
+        float weight;
+        quint64 seed;
+        QList<int> *sampled;
+        int begin, end;
+    };
+
+    static void oversampleBlock(const MiniBatchKMeans *kmeans, OversampleBlock block)
+    {
+        RNG rng(block.seed);
+        for (int i=block.begin; i<block.end; i++) {
+            block.dists[i] = std::min(block.dists[i], nearest(kmeans->rows[i], *block.candidates));
+            if (rng.uniform(0.f, 1.f) < block.dists[i] * block.weight)
+                block.sampled->append(i);
+        }
+    }
+
+    // k-means|| (Bahmani et al. 2012) with the given number of rounds
+    Mat initialize(int k, int rounds) const
+    {
+        const int n = rows.size();
+        Mat candidates(0, dims, CV_32FC1);
+        candidates.push_back(Mat(1, dims, CV_32FC1, (void*)rows[theRNG().uniform(0, n)]));
+
+        QVector<float> dists(n, std::numeric_limits<float>::max());
+        Mat newCandidates = candidates;
+        const int blocks = std::max(1, std::min(abs(Globals->parallelism), n));
+        const int stepSize = (n + blocks - 1) / blocks;
+        double phi = 0;
+        for (int round=0; round<=rounds; round++) {
+            // The first round only initializes distances, it does not sample
+            const float weight = (round == 0 || phi == 0) ? 0 : float(2.0 * k / phi);
+            QVector< QList<int> > sampled(blocks);
+            QFutureSynchronizer<void> futures;
+            for (int b=0; b<blocks; b++) {
+                OversampleBlock block = { &newCandidates, dists.data(), weight, quint64(round)*blocks + b + 1, &sampled[b], b*stepSize, std::min((b+1)*stepSize, n) };
+                if (block.begin >= block.end) continue;
+                if (Globals->parallelism) futures.addFuture(QtConcurrent::run(oversampleBlock, this, block));
+                else                      oversampleBlock(this, block);
+            }
+            futures.waitForFinished();
+
+            phi = 0;
+            for (int i=0; i<n; i++)
+                phi += dists[i];
+
+            newCandidates = Mat(0, dims, CV_32FC1);
+            foreach (const QList<int> &block, sampled)
+                foreach (int i, block)
+                    newCandidates.push_back(Mat(1, dims, CV_32FC1, (void*)rows[i]));
+            if (newCandidates.rows == 0)
+                newCandidates = candidates.row(candidates.rows-1);
+            else
+                candidates.push_back(newCandidates);
+        }
+
+        if (candidates.rows <= k) {
+            // Too few candidates, fill the remainder uniformly at random
+            foreach (int i, Common::RandSample(k - candidates.rows, n))
+                candidates.push_back(Mat(1, dims, CV_32FC1, (void*)rows[i]));
+            return candidates;
+        }
+
+        // Weight each candidate by the number of rows closest to it
+        QVector<int> labels(n);
+        assign(NULL, n, candidates, labels.data(), dists.data());
+        QList<float> weights; weights.reserve(candidates.rows);
+        for (int i=0; i<candidates.rows; i++) weights.append(0);
+        foreach (int label, labels) weights[label]++;
+
+        // Weighted k-means++ over the (small) candidate set
+        Mat seeds(0, dims, CV_32FC1);
+        seeds.push_back(candidates.row(weightedSample(weights)));
+        QList<float> candidateDists;
+        for (int i=0; i<candidates.rows; i++)
+            candidateDists.append(std::numeric_limits<float>::max());
+        while (seeds.rows < k) {
+            QList<float> probabilities;
+            for (int i=0; i<candidates.rows; i++) {
+                candidateDists[i] = std::min(candidateDists[i], distance(candidates.ptr<float>(i), seeds.ptr<float>(seeds.rows-1), dims));
+                probabilities.append(weights[i] * candidateDists[i]);
+            }
+            const int index = weightedSample(probabilities);
+            if (index < 0) {
+                // Every candidate coincides with a seed, fill the remainder uniformly at random
+                foreach (int i, Common::RandSample(k - seeds.rows, candidates.rows, 0, true))
+                    seeds.push_back(candidates.row(i));
+                break;
+            }
+            seeds.push_back(candidates.row(index));
+        }
+        return seeds;
+    }
+
+    void loadCheckpoint(const QString &checkpoint)
+    {
+        QByteArray data;
+        QtUtils::readFile(checkpoint, data);
+        QDataStream stream(&data, QIODevice::ReadOnly);
+        stream >> centers >> counts >> iteration;
+        if ((centers.cols != dims) || (counts.size() != centers.rows))
+            qFatal("Checkpoint %s does not match training data.", qPrintable(checkpoint));
+        qDebug("Resuming KMeans from %s at iteration %d", qPrintable(checkpoint), iteration);
+    }
+
+    void storeCheckpoint(const QString &checkpoint) const
+    {
+        QByteArray data;
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream << centers << counts << iteration;
+        QtUtils::writeFile(checkpoint + ".tmp", data);
+        QFile::remove(checkpoint);
+        QFile::rename(checkpoint + ".tmp", checkpoint);
+    }
+
+public:
+    Mat centers;
+    QVector<qint64> counts;
+    int iteration;
+
+    MiniBatchKMeans(const TemplateList &data) : dims(0), iteration(0)
+    {
+        foreach (const Template &t, data) {
+            if (t.isEmpty() || t.first().empty()) continue;
+            Mat m = t.first();
+            if (m.depth() != CV_32F) m.convertTo(m, CV_32F);
+            if (!m.isContinuous()) m = m.clone();
+            m = m.reshape(1, m.rows);
+            if (dims == 0) dims = m.cols;
+            if (m.cols != dims) qFatal("Invalid matrix.");
+            mats.append(m);
+            for (int i=0; i<m.rows; i++)
+                rows.append(m.ptr<float>(i));
+        }
+        if (rows.isEmpty()) qFatal("No training data.");
+    }
+
+    int size() const
+    {
+        return rows.size();
+    }
+
+    int dimensions() const
+    {
+        return dims;
+    }
+
+    const float *row(int index) const
+    {
+        return rows[index];
+    }
+
+    void train(int k, int batchSize, int iterations, const QString &checkpoint, int checkpointInterval)
+    {
+        if (!checkpoint.isEmpty() && QFileInfo(checkpoint).exists()) {
+            loadCheckpoint(checkpoint);
+        } else {
+            centers = initialize(k, 5);
+            counts = QVector<qint64>(centers.rows, 0);
+        }
+
+        QVector<int> labels(batchSize);
+        QVector<float> dists(batchSize);
+        while (iteration < iterations) {
+            const QList<int> batch = Common::RandSample(batchSize, rows.size());
+            const QVector<int> indicies = batch.toVector();
+            assign(indicies.data(), batchSize, centers, labels.data(), dists.data());
+
+            double inertia = 0;
+            for (int i=0; i<batchSize; i++) {
+                const int label = labels[i];
+                const float eta = 1.f / ++counts[label];
+                float *center = centers.ptr<float>(label);
+                const float *row = rows[indicies[i]];
+                for (int j=0; j<dims; j++)
+                    center[j] += eta * (row[j] - center[j]);
+                inertia += dists[i];
+            }
+
+            iteration++;
+            if (Globals->verbose)
+                qDebug("KMeans iteration %d/%d inertia = %f", iteration, iterations, inertia / batchSize);
+            if (!checkpoint.isEmpty() && (checkpointInterval > 0) && ((iteration % checkpointInterval == 0) || (iteration == iterations)))
+                storeCheckpoint(checkpoint);
+        }
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV kmeans and flann.
+ *
+ * When \em batchSize is positive, training uses streaming mini-batch k-means with k-means|| seeding instead of OpenCV kmeans.
+ * \em checkpoint names a file the mini-batch centers are periodically saved to and resumed from.
  * \author Josh Klontz \cite jklontz
  */
 class KMeansTransform : public Transform
@@ -35,8 +316,16 @@ class KMeansTransform : public Transform
     Q_OBJECT
     Q_PROPERTY(int kTrain READ get_kTrain WRITE set_kTrain RESET reset_kTrain STORED false)
     Q_PROPERTY(int kSearch READ get_kSearch WRITE set_kSearch RESET reset_kSearch STORED false)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize STORED false)
+    Q_PROPERTY(int iterations READ get_iterations WRITE set_iterations RESET reset_iterations STORED false)
+    Q_PROPERTY(QString checkpoint READ get_checkpoint WRITE set_checkpoint RESET reset_checkpoint STORED false)
+    Q_PROPERTY(int checkpointInterval READ get_checkpointInterval WRITE set_checkpointInterval RESET reset_checkpointInterval STORED false)
     BR_PROPERTY(int, kTrain, 256)
     BR_PROPERTY(int, kSearch, 1)
+    BR_PROPERTY(int, batchSize, 0)
+    BR_PROPERTY(int, iterations, 100)
+    BR_PROPERTY(QString, checkpoint, "")
+    BR_PROPERTY(int, checkpointInterval, 10)
 
     Mat centers;
     mutable QScopedPointer<flann::Index> index;
@@ -49,6 +338,14 @@ class KMeansTransform : public Transform
 
     void train(const TemplateList &data)
     {
+        if (batchSize > 0) {
+            MiniBatchKMeans kmeans(data);
+            kmeans.train(kTrain, batchSize, iterations, checkpoint, checkpointInterval);
+            centers = kmeans.centers;
+            reindex();
+            return;
+        }
+
         Mat bestLabels;
         const double compactness = kmeans(OpenCVUtils::toMatByRow(data.data()), kTrain, bestLabels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, centers);
         qDebug("KMeans compactness = %f", compactness);
@@ -175,10 +472,11 @@ class RandomCentroidsTransform : public Transform
 
     void train(const TemplateList &data)
     {
-        Mat flat = OpenCVUtils::toMatByRow(data.data());
-        QList<int> sample = Common::RandSample(kTrain, flat.rows, 0, true);
+        const MiniBatchKMeans rows(data);
+        QList<int> sample = Common::RandSample(kTrain, rows.size(), 0, true);
+        centers.release();
         foreach (const int &idx, sample)
-            centers.push_back(flat.row(idx));
+            centers.push_back(Mat(1, rows.dimensions(), CV_32FC1, (void*)rows.row(idx)));
         reindex();
     }
 
@@ -29,7 +29,7 @@ namespace br
  * \brief Colorspace conversion.
  * \author Josh Klontz \cite jklontz
  */
-class CvtTransform : public UntrainableTransform
+class CvtTransform : public PointwiseTransform
 {
     Q_OBJECT
     Q_ENUMS(ColorSpace)
@@ -63,6 +63,37 @@ private:
             dst = mv[channel % (int)mv.size()];
         }
     }
+
+    int pointwiseType(int type) const
+    {
+        if ((channel != -1) || ((colorSpace != Gray) && (colorSpace != RGBGray))) return -1;
+        const int depth = CV_MAT_DEPTH(type), channels = CV_MAT_CN(type);
+        if (channels == 1) return type;
+        if ((channels != 3) && (channels != 4)) return -1;
+        if ((depth != CV_8U) && (depth != CV_16U) && (depth != CV_32F)) return -1;
+        return CV_MAKETYPE(depth, 1);
+    }
+
+    void pointwise(const float *src, float *dst, int n, int type) const
+    {
+        const int channels = CV_MAT_CN(type);
+        if (channels == 1) {
+            std::copy(src, src+n, dst);
+            return;
+        }
+
+        // Same coefficients and order of operations as cvtColor
+        const bool bgr = (colorSpace == Gray);
+        if (CV_MAT_DEPTH(type) == CV_32F) {
+            const float c0 = bgr ? 0.114f : 0.299f, c1 = 0.587f, c2 = bgr ? 0.299f : 0.114f;
+            for (int i=0; i<n; i++, src+=channels)
+                dst[i] = src[0]*c0 + src[1]*c1 + src[2]*c2;
+        } else {
+            const int c0 = bgr ? 1868 : 4899, c1 = 9617, c2 = bgr ? 4899 : 1868;
+            for (int i=0; i<n; i++, src+=channels)
+                dst[i] = (int(src[0])*c0 + int(src[1])*c1 + int(src[2])*c2 + (1 << 13)) >> 14;
+        }
+    }
 };
 
 BR_REGISTER(Transform, CvtTransform)
@@ -72,7 +103,7 @@ BR_REGISTER(Transform, CvtTransform)
  * \brief Convert to floating point format.
  * \author Josh Klontz \cite jklontz
  */
-class CvtFloatTransform : public UntrainableTransform
+class CvtFloatTransform : public PointwiseTransform
 {
     Q_OBJECT
 
@@ -80,6 +111,16 @@ class CvtFloatTransform : public UntrainableTransform
     {
         src.m().convertTo(dst, CV_32F);
     }
+
+    int pointwiseType(int type) const
+    {
+        return CV_MAKETYPE(CV_32F, CV_MAT_CN(type));
+    }
+
+    void pointwise(const float *src, float *dst, int n, int type) const
+    {
+        std::copy(src, src+n*CV_MAT_CN(type), dst);
+    }
 };
 
 BR_REGISTER(Transform, CvtFloatTransform)
@@ -206,7 +247,7 @@ BR_REGISTER(Transform, RGTransform)
  * \brief dst = a*src+b
  * \author Josh Klontz \cite jklontz
  */
-class MAddTransform : public UntrainableTransform
+class MAddTransform : public PointwiseTransform
 {
     Q_OBJECT
     Q_PROPERTY(double a READ get_a WRITE set_a RESET reset_a STORED false)
@@ -218,6 +259,18 @@ class MAddTransform : public UntrainableTransform
     {
         src.m().convertTo(dst.m(), src.m().depth(), a, b);
     }
+
+    int pointwiseType(int type) const
+    {
+        return type;
+    }
+
+    void pointwise(const float *src, float *dst, int n, int type) const
+    {
+        const int depth = CV_MAT_DEPTH(type);
+        for (int i=0; i<n*CV_MAT_CN(type); i++)
+            dst[i] = saturate(float(src[i]*a + b), depth);
+    }
 };
 
 BR_REGISTER(Transform, MAddTransform)
@@ -227,7 +280,7 @@ BR_REGISTER(Transform, MAddTransform)
  * \brief Computes the absolute value of each element.
  * \author Josh Klontz \cite jklontz
  */
-class AbsTransform : public UntrainableTransform
+class AbsTransform : public PointwiseTransform
 {
     Q_OBJECT
 
@@ -235,6 +288,18 @@ class AbsTransform : public UntrainableTransform
     {
         dst = abs(src);
     }
+
+    int pointwiseType(int type) const
+    {
+        return type;
+    }
+
+    void pointwise(const float *src, float *dst, int n, int type) const
+    {
+        const int depth = CV_MAT_DEPTH(type);
+        for (int i=0; i<n*CV_MAT_CN(type); i++)
+            dst[i] = saturate(std::abs(src[i]), depth);
+    }
 };
 
 BR_REGISTER(Transform, AbsTransform)
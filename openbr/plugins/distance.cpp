@@ -119,6 +119,12 @@ private:
 
         return dot / (sqrt(magA)*sqrt(magB));
     }
+
+    bool symmetric() const
+    {
+        // Chi-squared normalizes by the first histogram
+        return metric != ChiSquared;
+    }
 };
 
 BR_REGISTER(Distance, DistDistance)
@@ -142,6 +148,11 @@ class DefaultDistance : public Distance
     {
         return distance->compare(a, b);
     }
+
+    bool symmetric() const
+    {
+        return distance->symmetric();
+    }
 };
 
 BR_REGISTER(Distance, DefaultDistance)
@@ -179,6 +190,14 @@ class PipeDistance : public Distance
         }
         return result;
     }
+
+    bool symmetric() const
+    {
+        foreach (br::Distance *distance, distances)
+            if (!distance->symmetric())
+                return false;
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, PipeDistance)
@@ -254,6 +273,14 @@ private:
         return 0;
     }
 
+    bool symmetric() const
+    {
+        foreach (br::Distance *distance, distances)
+            if (!distance->symmetric())
+                return false;
+        return !distances.isEmpty();
+    }
+
     void store(QDataStream &stream) const
     {
         stream << distances.size();
@@ -287,6 +314,11 @@ class ByteL1Distance : public Distance
     {
         return l1(a, b, size);
     }
+
+    bool symmetric() const
+    {
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, ByteL1Distance)
@@ -304,6 +336,11 @@ class HalfByteL1Distance : public Distance
     {
         return packed_l1(a.data, b.data, a.total());
     }
+
+    bool symmetric() const
+    {
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, HalfByteL1Distance)
@@ -329,6 +366,11 @@ class NegativeLogPlusOneDistance : public Distance
         return -log(distance->compare(a,b)+1);
     }
 
+    bool symmetric() const
+    {
+        return distance->symmetric();
+    }
+
     void store(QDataStream &stream) const
     {
         distance->store(stream);
@@ -359,6 +401,11 @@ class IdenticalDistance : public Distance
             if (a.data[i] != b.data[i]) return 0;
         return 1;
     }
+
+    bool symmetric() const
+    {
+        return true;
+    }
 };        
 
 BR_REGISTER(Distance, IdenticalDistance)
@@ -448,6 +495,14 @@ class SumDistance : public Distance
 
         return result;
     }
+
+    bool symmetric() const
+    {
+        foreach (br::Distance *distance, distances)
+            if (!distance->symmetric())
+                return false;
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, SumDistance)
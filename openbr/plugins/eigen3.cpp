@@ -666,6 +666,11 @@ class L1Distance : public Distance
         Eigen::Map<Eigen::VectorXf> bMap((float*)b.data, size);
         return (aMap-bMap).cwiseAbs().sum();
     }
+
+    bool symmetric() const
+    {
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, L1Distance)
@@ -686,6 +691,11 @@ class L2Distance : public Distance
         Eigen::Map<Eigen::VectorXf> bMap((float*)b.data, size);
         return (aMap-bMap).squaredNorm();
     }
+
+    bool symmetric() const
+    {
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, L2Distance)
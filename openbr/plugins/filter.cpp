@@ -28,7 +28,7 @@ namespace br
  * \brief Gamma correction
  * \author Josh Klontz \cite jklontz
  */
-class GammaTransform : public UntrainableTransform
+class GammaTransform : public PointwiseTransform
 {
     Q_OBJECT
     Q_PROPERTY(float gamma READ get_gamma WRITE set_gamma RESET reset_gamma STORED false)
@@ -47,6 +47,19 @@ class GammaTransform : public UntrainableTransform
     {
         LUT(src, lut, dst);
     }
+
+    int pointwiseType(int type) const
+    {
+        if (CV_MAT_DEPTH(type) != CV_8U) return -1;
+        return CV_MAKETYPE(CV_32F, CV_MAT_CN(type));
+    }
+
+    void pointwise(const float *src, float *dst, int n, int type) const
+    {
+        const float *table = lut.ptr<float>();
+        for (int i=0; i<n*CV_MAT_CN(type); i++)
+            dst[i] = table[int(src[i])];
+    }
 };
 
 BR_REGISTER(Transform, GammaTransform)
@@ -222,7 +235,7 @@ BR_REGISTER(Transform, ContrastEqTransform)
  * \brief Raise each element to the specified power.
  * \author Josh Klontz \cite jklontz
  */
-class PowTransform : public UntrainableTransform
+class PowTransform : public PointwiseTransform
 {
     Q_OBJECT
     Q_PROPERTY(float power READ get_power WRITE set_power RESET reset_power STORED false)
@@ -235,6 +248,25 @@ class PowTransform : public UntrainableTransform
         pow(preserveSign ? abs(src) : src.m(), power, dst);
         if (preserveSign) subtract(Scalar::all(0), dst, dst, src.m() < 0);
     }
+
+    int pointwiseType(int type) const
+    {
+        return type;
+    }
+
+    void pointwise(const float *src, float *dst, int n, int type) const
+    {
+        // Like cv::pow, integer powers keep the sign and other powers use the magnitude
+        const int depth = CV_MAT_DEPTH(type);
+        const int ipower = cvRound(power);
+        const bool integer = (ipower == power);
+        for (int i=0; i<n*CV_MAT_CN(type); i++) {
+            const float value = (integer && !preserveSign) ? float(std::pow(src[i], ipower)) : std::pow(std::abs(src[i]), power);
+            dst[i] = saturate(value, depth);
+            if (preserveSign && (src[i] < 0))
+                dst[i] = saturate(-dst[i], depth);
+        }
+    }
 };
 
 BR_REGISTER(Transform, PowTransform)
@@ -298,7 +298,7 @@ class mtxFormat : public Format
 
     void write(const Template &t) const
     {
-        BEE::writeMatrix(t, file);
+        BEE::writeMatrix(t, file, "Unknown_Target", "Unknown_Query", file.get<QString>("encoding", "float"));
     }
 };
 
@@ -39,6 +39,14 @@
 #include "MatlabIOContainer.hpp"
 #endif
 
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace br
 {
 
@@ -89,6 +97,20 @@ class arffGallery : public Gallery
 
 BR_REGISTER(Gallery, arffGallery)
 
+/*!
+ * \brief Base class for galleries stored as a sequence of serialized templates.
+ *
+ * Writes are batched, templates in a block are serialized in parallel and
+ * appended to a buffer which is written to disk on a separate thread once
+ * it exceeds \em writeBuffer bytes (default 8 MB).
+ * \em sync controls durability, "block" fsyncs after every buffer write,
+ * "close" once the gallery is closed, and "none" (the default) never.
+ *
+ * Formats that read back the file name of every template they write can keep a br::GalleryIndex next to the gallery,
+ * by default with \em append or when \em index is set explicitly.
+ * Index records are written after the templates they describe,
+ * so reopening a gallery truncates anything past the last indexed template.
+ */
 class BinaryGallery : public Gallery
 {
     Q_OBJECT
@@ -104,8 +126,10 @@ class BinaryGallery : public Gallery
             gallery.open(stderr, QFile::WriteOnly);
         } else {
             gallery.setFileName(file);
-            if (file.get<bool>("remove"))
+            if (file.get<bool>("remove")) {
                 gallery.remove();
+                QFile::remove(GalleryIndex::fileName(file));
+            }
             QtUtils::touchDir(gallery);
             QFile::OpenMode mode = QFile::ReadWrite;
 
@@ -116,10 +140,21 @@ class BinaryGallery : public Gallery
                 qFatal("Can't open gallery: %s", qPrintable(gallery.fileName()));
         }
         stream.setDevice(&gallery);
+
+        if (!gallery.isSequential() && file.get<bool>("index", file.get<bool>("append"))) {
+            if (supportsIndex()) openIndex();
+            else if (file.contains("index")) qWarning("%s galleries can't be indexed, ignoring index.", qPrintable(file.suffix()));
+        }
+
+        writeBuffer = file.get<int>("writeBuffer", 1 << 23);
+        sync = file.get<QString>("sync", "none");
     }
 
     TemplateList readBlock(bool *done)
     {
+        // Pending writes must land before we read
+        flush(true);
+
         if (stream.atEnd())
             gallery.seek(0);
 
@@ -142,29 +177,278 @@ class BinaryGallery : public Gallery
 
     void write(const Template &t)
     {
-        writeTemplate(t);
-        if (gallery.isSequential())
-            gallery.flush();
+        const int begin = pending.size();
+        writeTemplate(t, pending);
+        if (index.isOpen() && (pending.size() > begin))
+            indexTemplate(t.file.name, pending.size());
+        flush(false);
+    }
+
+    // A block of serialized templates and where each one ends, -1 if it wrote nothing
+    struct Serialized
+    {
+        QByteArray data;
+        QVector<int> ends;
+    };
+
+    static void serialize(BinaryGallery *gallery, const TemplateList *templates, int begin, int end, Serialized *serialized)
+    {
+        for (int i=begin; i<end; i++) {
+            const int size = serialized->data.size();
+            gallery->writeTemplate(templates->at(i), serialized->data);
+            serialized->ends.append((serialized->data.size() > size) ? serialized->data.size() : -1);
+        }
+    }
+
+    void writeTemplates(const TemplateList &templates)
+    {
+        const int blocks = std::max(1, std::min(abs(Globals->parallelism), templates.size()));
+        const int stepSize = (templates.size() + blocks - 1) / blocks;
+        QVector<Serialized> serialized(blocks);
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<blocks; i++) {
+            const int begin = i*stepSize, end = std::min((i+1)*stepSize, templates.size());
+            if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(serialize, this, &templates, begin, end, &serialized[i]));
+            else                          serialize(this, &templates, begin, end, &serialized[i]);
+        }
+        futures.waitForFinished();
+
+        for (int i=0; i<blocks; i++) {
+            const int offset = pending.size();
+            pending.append(serialized[i].data);
+            if (index.isOpen())
+                for (int j=0; j<serialized[i].ends.size(); j++)
+                    if (serialized[i].ends[j] != -1)
+                        indexTemplate(templates[i*stepSize+j].file.name, offset + serialized[i].ends[j]);
+        }
+        flush(false);
+    }
+
+    static void writeAll(QFile *file, const QByteArray &data)
+    {
+        const char *ptr = data.constData();
+        qint64 bytesNeeded = data.size();
+        while (bytesNeeded > 0) {
+            const qint64 bytesWritten = file->write(ptr, bytesNeeded);
+            if (bytesWritten <= 0)
+                qFatal("Failed to write: %s", qPrintable(file->fileName()));
+            bytesNeeded -= bytesWritten;
+            ptr += bytesWritten;
+        }
+        file->flush();
+    }
+
+    // Index records are only written once the templates they describe are
+    static void writeData(QFile *file, QByteArray data, bool sync, QFile *indexFile, QByteArray indexData)
+    {
+        writeAll(file, data);
+        if (sync)
+            syncFile(file);
+
+        if (indexData.isEmpty())
+            return;
+        writeAll(indexFile, indexData);
+        if (sync)
+            syncFile(indexFile);
+    }
+
+    static void syncFile(QFile *file)
+    {
+#ifdef Q_OS_WIN
+        _commit(file->handle());
+#else
+        fsync(file->handle());
+#endif
     }
 
 protected:
     QFile gallery;
     QDataStream stream;
 
+    ~BinaryGallery()
+    {
+        flush(true);
+        if (sync == "close" && gallery.isOpen()) {
+            gallery.flush();
+            syncFile(&gallery);
+        }
+        if (sync == "close" && index.isOpen())
+            syncFile(&index);
+    }
+
     qint64 totalSize()
     {
+        flush(true);
         return gallery.size();
     }
 
     qint64 position()
     {
+        // The asynchronous writer moves the position, wait for it
+        flush(true);
         return gallery.pos();
     }
 
     virtual Template readTemplate() = 0;
-    virtual void writeTemplate(const Template &t) = 0;
+
+    // Whether readTemplate() recovers the file name writeTemplate() was given, which the index is keyed on
+    virtual bool supportsIndex() const { return false; }
+
+    // Serialize t, appending the result to data. May be called concurrently.
+    virtual void writeTemplate(const Template &t, QByteArray &data) = 0;
+
+private:
+    QByteArray pending;
+    QFuture<void> writing;
+    int writeBuffer;
+    QString sync;
+
+    QFile index;
+    QVector<GalleryIndex::Record> pendingIndex; // Ends relative to the start of pending
+
+    void indexTemplate(const QString &name, int end)
+    {
+        GalleryIndex::Record record;
+        record.hash = GalleryIndex::hash(name);
+        record.end = end;
+        pendingIndex.append(record);
+    }
+
+    void openIndex()
+    {
+        index.setFileName(GalleryIndex::fileName(file));
+        if (!file.get<bool>("append"))
+            index.remove();
+        if (!index.open(QFile::ReadWrite | QFile::Append))
+            qFatal("Can't open gallery index: %s", qPrintable(index.fileName()));
+
+        if ((index.size() == 0) && (gallery.size() > 0)) rebuildIndex();
+        else                                              recoverIndex();
+    }
+
+    // Drop index records past the end of the gallery, and gallery data past the last index record
+    void recoverIndex()
+    {
+        qint64 records = index.size() / sizeof(GalleryIndex::Record);
+        qint64 end = 0;
+        while (records > 0) {
+            GalleryIndex::Record record;
+            index.seek((records-1) * sizeof(GalleryIndex::Record));
+            if ((index.read((char*)&record, sizeof(record)) == sizeof(record)) && (record.end <= gallery.size())) {
+                end = record.end;
+                break;
+            }
+            records--;
+        }
+
+        if (index.size() != qint64(records * sizeof(GalleryIndex::Record)))
+            index.resize(records * sizeof(GalleryIndex::Record));
+        if (gallery.size() > end) {
+            qWarning("Truncating %s from %lld to %lld bytes, the last complete template.", qPrintable(gallery.fileName()), gallery.size(), end);
+            gallery.resize(end);
+        }
+    }
+
+    // Galleries written without an index are read once to build one
+    void rebuildIndex()
+    {
+        qDebug("Indexing %s", qPrintable(gallery.fileName()));
+        gallery.seek(0);
+        qint64 end = 0;
+        QByteArray indexData;
+        while (!stream.atEnd()) {
+            const Template t = readTemplate();
+            if (stream.status() != QDataStream::Ok)
+                break;
+            end = gallery.pos();
+            if (t.isEmpty() && t.file.isNull())
+                continue;
+            GalleryIndex::Record record;
+            record.hash = GalleryIndex::hash(t.file.name);
+            record.end = end;
+            indexData.append((const char*)&record, sizeof(record));
+        }
+        stream.resetStatus();
+
+        writeAll(&index, indexData);
+        if (gallery.size() > end) {
+            qWarning("Truncating %s from %lld to %lld bytes, the last complete template.", qPrintable(gallery.fileName()), gallery.size(), end);
+            gallery.resize(end);
+        }
+    }
+
+    // Hand pending data to the writer thread if there is enough of it,
+    // or unconditionally and wait for it to be written if force is set.
+    void flush(bool force)
+    {
+        // Pipes are written immediately so downstream consumers see templates as soon as possible
+        if (gallery.isSequential())
+            force = true;
+
+        if (!force && (pending.size() < writeBuffer))
+            return;
+
+        // At most one write is in flight, this bounds memory use
+        writing.waitForFinished();
+        if (pending.isEmpty())
+            return;
+
+        QByteArray data;
+        data.swap(pending);
+
+        // All earlier writes have landed, so the gallery size is where this data begins
+        QByteArray indexData;
+        if (!pendingIndex.isEmpty()) {
+            const qint64 offset = file.get<bool>("append") ? gallery.size() : gallery.pos();
+            for (int i=0; i<pendingIndex.size(); i++)
+                pendingIndex[i].end += offset;
+            indexData = QByteArray((const char*)pendingIndex.constData(), pendingIndex.size() * sizeof(GalleryIndex::Record));
+            pendingIndex.clear();
+        }
+
+        if (force) writeData(&gallery, data, sync == "block", &index, indexData);
+        else       writing = QtConcurrent::run(writeData, &gallery, data, sync == "block", &index, indexData);
+    }
 };
 
+QString GalleryIndex::fileName(const File &gallery)
+{
+    return gallery.name + ".index";
+}
+
+quint64 GalleryIndex::hash(const QString &name)
+{
+    const QByteArray bytes = name.toUtf8();
+    quint64 hash = Q_UINT64_C(14695981039346656037);
+    for (int i=0; i<bytes.size(); i++) {
+        hash ^= uchar(bytes[i]);
+        hash *= Q_UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+bool GalleryIndex::read(const File &gallery, QVector<quint64> &hashes)
+{
+    QFile index(fileName(gallery));
+    const qint64 gallerySize = QFileInfo(gallery.name).size();
+    if (!index.exists() || ((index.size() == 0) && (gallerySize > 0)) || !index.open(QFile::ReadOnly))
+        return false;
+
+    // Records past the end of the gallery were never completely written
+    hashes.clear();
+    hashes.reserve(index.size() / sizeof(Record));
+    QVector<Record> records(1 << 16);
+    qint64 bytesRead;
+    while ((bytesRead = index.read((char*)records.data(), records.size() * sizeof(Record))) > 0) {
+        for (int i=0; i<int(bytesRead / sizeof(Record)); i++) {
+            if (records[i].end > gallerySize) break;
+            hashes.append(records[i].hash);
+        }
+    }
+    std::sort(hashes.begin(), hashes.end());
+    return true;
+}
+
 /*!
  * \ingroup galleries
  * \brief A binary gallery.
@@ -184,11 +468,17 @@ class galGallery : public BinaryGallery
         return t;
     }
 
-    void writeTemplate(const Template &t)
+    bool supportsIndex() const
+    {
+        return true;
+    }
+
+    void writeTemplate(const Template &t, QByteArray &data)
     {
         if (t.isEmpty() && t.file.isNull())
             return;
-        stream << t;
+        QDataStream out(&data, QIODevice::Append);
+        out << t;
     }
 };
 
@@ -243,7 +533,7 @@ class utGallery : public BinaryGallery
         return t;
     }
 
-    void writeTemplate(const Template &t)
+    void writeTemplate(const Template &t, QByteArray &output)
     {
         const QByteArray imageID = QByteArray::fromHex(t.file.get<QByteArray>("ImageID", QByteArray(32, '0')));
         if (imageID.size() != 16)
@@ -284,11 +574,12 @@ class utGallery : public BinaryGallery
         const QByteArray templateID = data.isEmpty() ? QByteArray(16, 0) : QCryptographicHash::hash(data, QCryptographicHash::Md5);
         const uint32_t size = data.size();
 
-        gallery.write(imageID);
-        gallery.write(templateID);
-        gallery.write((const char*) &algorithmID, 4);
-        gallery.write((const char*) &size, 4);
-        gallery.write(data);
+        output.reserve(output.size() + sizeof(br_universal_template) + size);
+        output.append(imageID);
+        output.append(templateID);
+        output.append((const char*) &algorithmID, 4);
+        output.append((const char*) &size, 4);
+        output.append(data);
     }
 };
 
@@ -309,12 +600,12 @@ class utdGallery : public BinaryGallery
         return Template();
     }
 
-    void writeTemplate(const Template &t)
+    void writeTemplate(const Template &t, QByteArray &data)
     {
         if (t.empty())
             return;
-        gallery.write(QByteArray((const char*) t.m().data, t.m().rows * t.m().cols * t.m().elemSize()));
-        gallery.write("\n");
+        data.append((const char*) t.m().data, t.m().rows * t.m().cols * t.m().elemSize());
+        data.append('\n');
     }
 };
 
@@ -338,12 +629,12 @@ class urlGallery : public BinaryGallery
         return t;
     }
 
-    void writeTemplate(const Template &t)
+    void writeTemplate(const Template &t, QByteArray &data)
     {
         const QString url = t.file.get<QString>("URL", t.file.name);
         if (!url.isEmpty()) {
-            gallery.write(qPrintable(url));
-            gallery.write("\n");
+            data.append(url.toLocal8Bit());
+            data.append('\n');
         }
     }
 };
@@ -368,29 +659,289 @@ class jsonGallery : public BinaryGallery
         return file;
     }
 
-    void writeTemplate(const Template &t)
+    void writeTemplate(const Template &t, QByteArray &data)
     {
         const QByteArray json = QJsonDocument(QJsonObject::fromVariantMap(t.file.localMetadata())).toJson().replace('\n', "");
         if (!json.isEmpty()) {
-            gallery.write(json);
-            gallery.write("\n");
+            data.append(json);
+            data.append('\n');
         }
     }
 };
 
 BR_REGISTER(Gallery, jsonGallery)
 
+/*!
+ * \brief Lists a directory tree on a pool of threads, every directory is a separate task.
+ *
+ * Files are visited in the same order as QtUtils::getFiles(), except that the root's subfolders come before its own files.
+ * Directories whose modification time matches a previous crawl's manifest reuse its listing instead of being read again.
+ * A directory's modification time only changes when entries are added, removed or renamed in it, and may only have
+ * one or two second resolution, so listings taken within two seconds of a change are never reused.
+ */
+class DirectoryCrawler
+{
+public:
+    struct Directory
+    {
+        QString name, path; // path is canonical
+        qint64 modified;
+        QStringList files;
+        QList<Directory*> children;
+        bool listed;
+
+        Directory(const QString &name, const QString &path) : name(name), path(path), modified(0), listed(false) {}
+        ~Directory() { qDeleteAll(children); }
+    };
+
+    DirectoryCrawler(const QString &rootPath, const QString &manifest)
+        : manifest(manifest), root(QDir(rootPath).dirName(), QDir(rootPath).canonicalPath()), changed(false), cancelled(0)
+    {
+        readManifest();
+        pool.setMaxThreadCount(2 * QThread::idealThreadCount()); // Listing mostly waits on the file system
+        stack.push(Frame(&root));
+        schedule(QList<Directory*>() << &root);
+    }
+
+    ~DirectoryCrawler()
+    {
+        cancelled.store(1);
+        pool.waitForDone();
+    }
+
+    // Next file and the name of the root subfolder it is in, or of the root itself
+    bool next(QString &path, QString &label)
+    {
+        while (!stack.isEmpty()) {
+            Directory *directory = stack.top().directory;
+            wait(directory);
+
+            const bool isRoot = (stack.size() == 1);
+            Frame &frame = stack.top();
+            if ((!isRoot || (frame.child == directory->children.size())) && (frame.file < directory->files.size())) {
+                path = directory->path + "/" + directory->files[frame.file++];
+                label = isRoot ? directory->name : stack[1].directory->name;
+                return true;
+            }
+
+            if (frame.child < directory->children.size()) {
+                Directory *child = directory->children[frame.child++];
+                stack.push(Frame(child));
+                continue;
+            }
+            stack.pop();
+        }
+
+        if (changed && !manifest.isEmpty())
+            writeManifest();
+        return false;
+    }
+
+private:
+    struct Frame
+    {
+        Directory *directory;
+        int child, file;
+        Frame(Directory *directory = NULL) : directory(directory), child(0), file(0) {}
+    };
+
+    struct Listing
+    {
+        qint64 modified;
+        QStringList files, names, paths;
+    };
+
+    class Task : public QRunnable
+    {
+        DirectoryCrawler *crawler;
+        Directory *directory;
+
+    public:
+        Task(DirectoryCrawler *crawler, Directory *directory) : crawler(crawler), directory(directory) {}
+        void run() { crawler->list(directory); }
+    };
+
+    QString manifest;
+    QHash<QString, Listing> cached; // Read only once crawling starts
+    Directory root;
+    QStack<Frame> stack;
+    QThreadPool pool;
+    QMutex mutex;
+    QWaitCondition listedCondition;
+    bool changed;
+    QAtomicInt cancelled;
+
+    void schedule(const QList<Directory*> &directories)
+    {
+        foreach (Directory *directory, directories)
+            pool.start(new Task(this, directory));
+    }
+
+    void wait(Directory *directory)
+    {
+        QMutexLocker locker(&mutex);
+        while (!directory->listed)
+            listedCondition.wait(&mutex);
+    }
+
+    void list(Directory *directory)
+    {
+        Listing listing;
+        bool relisted = false;
+        if (!cancelled.load()) {
+            listing.modified = QFileInfo(directory->path).lastModified().toMSecsSinceEpoch();
+            const QHash<QString, Listing>::const_iterator it = cached.find(directory->path);
+            if ((it != cached.end()) && (it->modified == listing.modified)) {
+                listing = *it;
+            } else {
+                read(directory->path, listing);
+                relisted = true;
+                // Entries added later within the same timestamp tick wouldn't change it
+                if (QDateTime::currentMSecsSinceEpoch() - listing.modified < 2000)
+                    listing.modified = -1;
+            }
+        }
+
+        QList<Directory*> children;
+        for (int i=0; i<listing.names.size(); i++)
+            children.append(new Directory(listing.names[i], listing.paths[i]));
+
+        QMutexLocker locker(&mutex);
+        directory->modified = listing.modified;
+        directory->files = listing.files;
+        directory->children = children;
+        directory->listed = true;
+        changed = changed || relisted;
+        listedCondition.wakeAll();
+        locker.unlock();
+
+        if (!cancelled.load())
+            schedule(children);
+        else
+            foreach (Directory *child, children)
+                child->listed = true;
+    }
+
+    // Files and subfolders, without hidden entries, in natural order
+    static void read(const QString &path, Listing &listing)
+    {
+        QStringList names;
+        QHash<QString, QString> paths;
+#ifdef Q_OS_UNIX
+        // The entry type from readdir saves a stat per entry, only links and unknown types are resolved
+        DIR *dir = opendir(QFile::encodeName(path).constData());
+        if (dir) {
+            while (struct dirent *entry = readdir(dir)) {
+                if (entry->d_name[0] == '.') continue;
+                const QString name = QFile::decodeName(entry->d_name);
+                bool isFile = (entry->d_type == DT_REG), isDir = (entry->d_type == DT_DIR);
+                if ((entry->d_type == DT_LNK) || (entry->d_type == DT_UNKNOWN)) {
+                    struct stat status;
+                    if (stat(QFile::encodeName(path + "/" + name).constData(), &status) != 0) continue;
+                    isFile = S_ISREG(status.st_mode);
+                    isDir = S_ISDIR(status.st_mode);
+                }
+
+                if (isFile) {
+                    listing.files.append(name);
+                } else if (isDir) {
+                    names.append(name);
+                    paths.insert(name, (entry->d_type == DT_LNK) ? QDir(path + "/" + name).canonicalPath() : path + "/" + name);
+                }
+            }
+            closedir(dir);
+        }
+#else
+        const QDir dir(path);
+        listing.files = dir.entryList(QDir::Files);
+        foreach (const QString &name, dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+            names.append(name);
+            paths.insert(name, QDir(dir.absoluteFilePath(name)).canonicalPath());
+        }
+#endif
+        listing.files = QtUtils::naturalSort(listing.files);
+        listing.names = QtUtils::naturalSort(names);
+        foreach (const QString &name, listing.names)
+            listing.paths.append(paths[name]);
+    }
+
+    void readManifest()
+    {
+        QFile file(manifest);
+        if (manifest.isEmpty() || !file.open(QFile::ReadOnly))
+            return;
+
+        QDataStream stream(&file);
+        QString rootPath;
+        int size;
+        stream >> rootPath >> size;
+        if ((stream.status() != QDataStream::Ok) || (rootPath != root.path))
+            return;
+
+        for (int i=0; (i<size) && (stream.status() == QDataStream::Ok); i++) {
+            QString path;
+            Listing listing;
+            stream >> path >> listing.modified >> listing.files >> listing.names >> listing.paths;
+            cached.insert(path, listing);
+        }
+        if (stream.status() != QDataStream::Ok)
+            cached.clear();
+    }
+
+    void writeManifest()
+    {
+        QList<const Directory*> directories;
+        directories.append(&root);
+        for (int i=0; i<directories.size(); i++)
+            foreach (const Directory *child, directories[i]->children)
+                directories.append(child);
+
+        QtUtils::touchDir(QFileInfo(manifest));
+        QFile file(manifest + ".tmp");
+        if (!file.open(QFile::WriteOnly)) {
+            qWarning("Unable to write directory manifest %s.", qPrintable(manifest));
+            return;
+        }
+
+        QDataStream stream(&file);
+        stream << root.path << directories.size();
+        foreach (const Directory *directory, directories) {
+            QStringList names, paths;
+            foreach (const Directory *child, directory->children) {
+                names.append(child->name);
+                paths.append(child->path);
+            }
+            stream << directory->path << directory->modified << directory->files << names << paths;
+        }
+        file.close();
+
+        QFile::remove(manifest);
+        QFile::rename(file.fileName(), manifest);
+    }
+};
+
 /*!
  * \ingroup galleries
  * \brief Reads/writes templates to/from folders.
  * \author Josh Klontz \cite jklontz
  * \param regexp An optional regular expression to match against the files extension.
+ * \param manifest Optional file to cache the directory listing in between runs.
+ *
+ * Folders are listed in parallel and templates are returned in blocks of \c readBlockSize as soon as they are found.
+ *
+ * The manifest is checked against directory modification times only. Restoring a directory's timestamp after
+ * changing it, clock skew on network file systems, or a file system that doesn't update them will return the old listing.
+ * Delete the manifest to force a full listing.
  */
 class EmptyGallery : public Gallery
 {
     Q_OBJECT
     Q_PROPERTY(QString regexp READ get_regexp WRITE set_regexp RESET reset_regexp STORED false)
+    Q_PROPERTY(QString manifest READ get_manifest WRITE set_manifest RESET reset_manifest STORED false)
     BR_PROPERTY(QString, regexp, QString())
+    BR_PROPERTY(QString, manifest, QString())
+
+    QScopedPointer<DirectoryCrawler> crawler;
 
     void init()
     {
@@ -405,30 +956,23 @@ class EmptyGallery : public Gallery
         // Enrolling a null file is used as an idiom to initialize an algorithm
         if (file.isNull()) return templates;
 
-        // Add immediate subfolders
-        QDir dir(file);
-        QList< QFuture<TemplateList> > futures;
-        foreach (const QString &folder, QtUtils::naturalSort(dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot))) {
-            const QDir subdir = dir.absoluteFilePath(folder);
-            futures.append(QtConcurrent::run(&EmptyGallery::getTemplates, subdir));
-        }
-        foreach (const QFuture<TemplateList> &future, futures)
-            templates.append(future.result());
-
-        // Add root folder
-        foreach (const QString &fileName, QtUtils::getFiles(file.name, false))
-            templates.append(File(fileName, dir.dirName()));
-
-        if (!regexp.isEmpty()) {
-            QRegExp re(regexp);
-            re.setPatternSyntax(QRegExp::Wildcard);
-            for (int i=templates.size()-1; i>=0; i--) {
-                if (!re.exactMatch(templates[i].file.fileName())) {
-                    templates.removeAt(i);
-                }
+        if (!crawler)
+            crawler.reset(new DirectoryCrawler(file.name, manifest));
+
+        QRegExp re(regexp);
+        re.setPatternSyntax(QRegExp::Wildcard);
+
+        QString path, label;
+        while (templates.size() < readBlockSize) {
+            if (!crawler->next(path, label)) {
+                crawler.reset();
+                return templates;
             }
+            if (regexp.isEmpty() || re.exactMatch(QFileInfo(path).fileName()))
+                templates.append(File(path, label));
         }
 
+        *done = false;
         return templates;
     }
 
@@ -451,15 +995,6 @@ class EmptyGallery : public Gallery
             format->write(t);
         }
     }
-
-    static TemplateList getTemplates(const QDir &dir)
-    {
-        const QStringList files = QtUtils::getFiles(dir, true);
-        TemplateList templates; templates.reserve(files.size());
-        foreach (const QString &file, files)
-            templates.append(File(file, dir.dirName()));
-        return templates;
-    }
 };
 
 BR_REGISTER(Gallery, EmptyGallery)
@@ -785,6 +1320,10 @@ FileList FileList::fromGallery(const File &file, bool cache)
  * Columns should be comma separated with first row containing headers.
  * The first column in the file should be the path to the file to enroll.
  * Other columns will be treated as file metadata.
+ * Blocks of lines are parsed in parallel.
+ *
+ * Rows are written as templates arrive.
+ * The header is fixed by the first template, or by \c columns if set, and later metadata keys outside it are not saved.
  *
  * \see txtGallery
  */
@@ -792,48 +1331,59 @@ class csvGallery : public FileGallery
 {
     Q_OBJECT
     Q_PROPERTY(int fileIndex READ get_fileIndex WRITE set_fileIndex RESET reset_fileIndex)
+    Q_PROPERTY(QStringList columns READ get_columns WRITE set_columns RESET reset_columns STORED false)
     BR_PROPERTY(int, fileIndex, 0)
+    BR_PROPERTY(QStringList, columns, QStringList())
 
-    FileList files;
     QStringList headers;
+    QByteArray buffer; // Read but not yet parsed
+    qint64 bufferOffset;
 
-    ~csvGallery()
-    {
-        f.close();
-
-        if (files.isEmpty()) return;
+    QStringList keys;
+    QSet<QString> written, dropped;
 
-        QMap<QString,QVariant> samples;
-        foreach (const File &file, files)
-            foreach (const QString &key, file.localKeys())
-                if (!samples.contains(key))
-                    samples.insert(key, file.value(key));
-
-        // Don't create columns in the CSV for these special fields
-        samples.remove("Points");
-        samples.remove("Rects");
-
-        QStringList lines;
-        lines.reserve(files.size()+1);
+    static QString toString(const char *begin, const char *end)
+    {
+        for (const char *c=begin; c<end; c++)
+            if (*c & 0x80) return QString::fromLocal8Bit(begin, end-begin);
+        return QString::fromLatin1(begin, end-begin);
+    }
 
-        { // Make header
-            QStringList words;
-            words.append("File");
-            foreach (const QString &key, samples.keys())
-                words.append(getCSVElement(key, samples[key], true));
-            lines.append(words.join(","));
+    // Begin and end pointers of each comma separated field, without surrounding whitespace
+    static void split(const char *begin, const char *end, QVector<const char*> &fields)
+    {
+        fields.clear();
+        while (true) {
+            const char *comma = static_cast<const char*>(memchr(begin, ',', end-begin));
+            const char *fieldBegin = begin, *fieldEnd = comma ? comma : end;
+            while ((fieldBegin < fieldEnd) && isspace(uchar(*fieldBegin))) fieldBegin++;
+            while ((fieldEnd > fieldBegin) && isspace(uchar(fieldEnd[-1]))) fieldEnd--;
+            fields.append(fieldBegin);
+            fields.append(fieldEnd);
+            if (!comma) break;
+            begin = comma + 1;
         }
+    }
 
-        // Make table
-        foreach (const File &file, files) {
-            QStringList words;
-            words.append(file.name);
-            foreach (const QString &key, samples.keys())
-                words.append(getCSVElement(key, file.value(key), false));
-            lines.append(words.join(","));
-        }
+    void parseLines(int begin, int end, TemplateList *templates) const
+    {
+        const char *data = buffer.constData();
+        QVector<const char*> fields;
+        while (begin < end) {
+            const char *line = data + begin;
+            const char *newline = static_cast<const char*>(memchr(line, '\n', end-begin));
+            const char *lineEnd = newline ? newline : data + end;
+            begin = lineEnd - data + 1;
 
-        QtUtils::writeFile(file, lines);
+            split(line, lineEnd, fields);
+            if ((fields.size() != 2*headers.size()) || ((fields.size() == 2) && (fields[0] == fields[1]))) continue;
+            File fi;
+            fi.name = toString(fields[0], fields[1]);
+            for (int j=1; j<headers.size(); j++)
+                fi.set(headers[j], toString(fields[2*j], fields[2*j+1]));
+            templates->append(fi);
+            templates->last().file.set("progress", bufferOffset + std::min(begin, end));
+        }
     }
 
     TemplateList readBlock(bool *done)
@@ -844,38 +1394,92 @@ class csvGallery : public FileGallery
             *done = true;
             return templates;
         }
-        QRegExp regexp("\\s*,\\s*");
 
-        if (f.pos() == 0)
-        {
-            // read a line
-            QByteArray lineBytes = f.readLine();
-            QString line = QString::fromLocal8Bit(lineBytes).trimmed();
-            headers = line.split(regexp);
+        if (f.pos() == 0) {
+            const QByteArray line = f.readLine();
+            QVector<const char*> fields;
+            split(line.constData(), line.constData() + line.size(), fields);
+            headers.clear();
+            for (int i=0; i<fields.size(); i+=2)
+                headers.append(toString(fields[i], fields[i+1]));
+            buffer.clear();
+            bufferOffset = f.pos();
         }
 
-        for (qint64 i = 0; i < this->readBlockSize && !f.atEnd(); i++){
-            QByteArray lineBytes = f.readLine();
-            QString line = QString::fromLocal8Bit(lineBytes).trimmed();
+        // Buffer readBlockSize complete lines, or the rest of the file
+        int lines = 0, end = 0;
+        while (lines < readBlockSize) {
+            const char *newline = static_cast<const char*>(memchr(buffer.constData() + end, '\n', buffer.size() - end));
+            if (newline) {
+                end = newline - buffer.constData() + 1;
+                lines++;
+            } else if (f.atEnd()) {
+                end = buffer.size();
+                break;
+            } else {
+                buffer.append(f.read(1 << 20));
+            }
+        }
 
-            QStringList words = line.split(regexp);
-            if (words.size() != headers.size()) continue;
-            File fi;
-            for (int j=0; j<words.size(); j++) {
-                if (j == 0) fi.name = words[j];
-                else        fi.set(headers[j], words[j]);
+        // Split on line boundaries into one slice per thread
+        const int slices = ((Globals->parallelism > 1) && (end > (1 << 16))) ? Globals->parallelism : 1;
+        QVector<TemplateList> parsed(slices);
+        QFutureSynchronizer<void> futures;
+        for (int i=0, begin=0; (i<slices) && (begin<end); i++) {
+            int sliceEnd = (i == slices-1) ? end : begin + (end-begin)/(slices-i);
+            if (sliceEnd < end) {
+                const char *newline = static_cast<const char*>(memchr(buffer.constData() + sliceEnd, '\n', end - sliceEnd));
+                sliceEnd = newline ? newline - buffer.constData() + 1 : end;
             }
-            templates.append(fi);
-            templates.last().file.set("progress", f.pos());
+            if (slices > 1) futures.addFuture(QtConcurrent::run(this, &csvGallery::parseLines, begin, sliceEnd, &parsed[i]));
+            else            parseLines(begin, sliceEnd, &parsed[i]);
+            begin = sliceEnd;
         }
-        *done = f.atEnd();
+        futures.waitForFinished();
+
+        foreach (const TemplateList &slice, parsed)
+            templates.append(slice);
+        buffer.remove(0, end);
+        bufferOffset += end;
+        *done = buffer.isEmpty() && f.atEnd();
 
         return templates;
     }
 
     void write(const Template &t)
     {
-        files.append(t.file);
+        if (keys.isEmpty() && written.isEmpty()) {
+            keys = columns;
+            if (keys.isEmpty()) {
+                keys = t.file.localKeys();
+                // Don't create columns in the CSV for these special fields
+                keys.removeAll("Points");
+                keys.removeAll("Rects");
+                keys.sort();
+            }
+            written = keys.toSet();
+            written.insert("Points");
+            written.insert("Rects");
+
+            QStringList words;
+            words.append("File");
+            foreach (const QString &key, keys)
+                words.append(getCSVElement(key, t.file.value(key), true));
+            f.resize(0);
+            f.write((words.join(",")+"\n").toLocal8Bit());
+        }
+
+        foreach (const QString &key, t.file.localKeys())
+            if (!written.contains(key) && !dropped.contains(key)) {
+                qWarning("Metadata key %s is not in the header of %s and will not be written.", qPrintable(key), qPrintable(file.name));
+                dropped.insert(key);
+            }
+
+        QStringList words;
+        words.append(t.file.name);
+        foreach (const QString &key, keys)
+            words.append(getCSVElement(key, t.file.value(key), false));
+        f.write((words.join(",")+"\n").toLocal8Bit());
     }
 
     static QString getCSVElement(const QString &key, const QVariant &value, bool header)
@@ -896,6 +1500,9 @@ class csvGallery : public FileGallery
             else        return QString::number(std::numeric_limits<float>::quiet_NaN());
         }
     }
+
+public:
+    csvGallery() : bufferOffset(0) {}
 };
 
 BR_REGISTER(Gallery, csvGallery)
@@ -15,7 +15,11 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <QCryptographicHash>
+#include <QFutureSynchronizer>
+#include <QtConcurrentRun>
 #include "openbr_internal.h"
+#include "openbr/core/distance_sse.h"
+#include "openbr/core/opencvutils.h"
 #include "openbr/core/qtutils.h"
 
 using namespace cv;
@@ -90,6 +94,204 @@ class KernelHashTransform : public UntrainableTransform
 
 BR_REGISTER(Transform, KernelHashTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Appends a compact binary sketch of the template for CascadeDistance.
+ *
+ * Bits are the signs of a Gaussian random projection of the mean centered features.
+ * If \em iterations > 0 the projection is instead PCA followed by an orthogonal rotation
+ * learned to minimize the quantization error (ITQ).
+ */
+class SketchTransform : public Transform
+{
+    Q_OBJECT
+    Q_PROPERTY(int bits READ get_bits WRITE set_bits RESET reset_bits STORED false)
+    Q_PROPERTY(int iterations READ get_iterations WRITE set_iterations RESET reset_iterations STORED false)
+    Q_PROPERTY(int seed READ get_seed WRITE set_seed RESET reset_seed STORED false)
+    BR_PROPERTY(int, bits, 256)
+    BR_PROPERTY(int, iterations, 0)
+    BR_PROPERTY(int, seed, 0)
+
+    Mat mean, projection;
+
+    static Mat features(const Template &t)
+    {
+        Mat row;
+        foreach (const Mat &m, t) {
+            Mat n;
+            m.reshape(1, 1).convertTo(n, CV_32F);
+            if (row.empty()) row = n;
+            else             hconcat(row, n, row);
+        }
+        return row;
+    }
+
+    void train(const TemplateList &data)
+    {
+        QList<Mat> rows;
+        foreach (const Template &t, data)
+            rows.append(features(t));
+        const Mat samples = OpenCVUtils::toMat(rows);
+        reduce(samples, mean, 0, CV_REDUCE_AVG);
+        const Mat centered = samples - repeat(mean, samples.rows, 1);
+
+        RNG rng(seed);
+        if (iterations == 0) {
+            projection.create(samples.cols, bits, CV_32FC1);
+            rng.fill(projection, RNG::NORMAL, 0, 1);
+            return;
+        }
+
+        if (bits > samples.cols) qFatal("ITQ requires bits <= feature dimensionality.");
+        PCA pca(centered, Mat(), CV_PCA_DATA_AS_ROW, bits);
+        projection = pca.eigenvectors.t();
+        projection.convertTo(projection, CV_32F);
+
+        // Alternate between the binary codes and the rotation that best fits them
+        const Mat projected = centered * projection;
+        Mat gaussian(bits, bits, CV_32FC1);
+        rng.fill(gaussian, RNG::NORMAL, 0, 1);
+        SVD random(gaussian);
+        Mat rotation = random.u;
+        for (int i=0; i<iterations; i++) {
+            const Mat rotated = projected * rotation;
+            Mat codes(rotated.size(), CV_32FC1);
+            for (int j=0; j<rotated.rows; j++)
+                for (int k=0; k<rotated.cols; k++)
+                    codes.at<float>(j,k) = (rotated.at<float>(j,k) > 0) ? 1 : -1;
+            SVD svd(codes.t() * projected);
+            rotation = svd.vt.t() * svd.u.t();
+        }
+        projection = projection * rotation;
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const Mat projected = (features(src) - mean) * projection;
+        Mat code = Mat::zeros(1, (bits + 7) / 8, CV_8UC1);
+        for (int i=0; i<bits; i++)
+            if (projected.at<float>(0, i) > 0)
+                code.at<uchar>(0, i/8) |= uchar(1 << (i%8));
+        dst = src;
+        dst.append(code);
+    }
+
+    void store(QDataStream &stream) const
+    {
+        stream << mean << projection;
+    }
+
+    void load(QDataStream &stream)
+    {
+        stream >> mean >> projection;
+    }
+};
+
+BR_REGISTER(Transform, SketchTransform)
+
+/*!
+ * \ingroup distances
+ * \brief Compares only the candidates whose SketchTransform codes are nearest in Hamming distance.
+ *
+ * The last matrix of each template is its sketch and the remaining matrices are compared by \em distance.
+ * The shortlist is the larger of \em shortlist and \em fraction of the gallery, ties broken by gallery order.
+ * Targets outside the shortlist score -FLT_MAX.
+ */
+class CascadeDistance : public Distance
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance)
+    Q_PROPERTY(int shortlist READ get_shortlist WRITE set_shortlist RESET reset_shortlist STORED false)
+    Q_PROPERTY(float fraction READ get_fraction WRITE set_fraction RESET reset_fraction STORED false)
+    BR_PROPERTY(br::Distance*, distance, Distance::make("Dist(L2)", this))
+    BR_PROPERTY(int, shortlist, 100)
+    BR_PROPERTY(float, fraction, 0)
+
+    static Template features(const Template &t)
+    {
+        if (t.size() < 2) qFatal("CascadeDistance expects templates ending with a SketchTransform code.");
+        Template result(t.file);
+        for (int i=0; i<t.size()-1; i++)
+            result.append(t[i]);
+        return result;
+    }
+
+    void train(const TemplateList &src)
+    {
+        TemplateList data; data.reserve(src.size());
+        foreach (const Template &t, src)
+            data.append(features(t));
+        distance->train(data);
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        return distance->compare(features(a), features(b));
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        QList<float> scores;
+        for (int i=0; i<targets.size(); i++)
+            scores.append(-std::numeric_limits<float>::max());
+        if (query.isEmpty()) return scores;
+
+        // Hamming scan over the sketches
+        const Mat &sketch = query.last();
+        const int size = sketch.total();
+        QVector<int> hammingDistances(targets.size(), -1);
+        QVector<int> histogram(8*size+1, 0);
+        for (int i=0; i<targets.size(); i++) {
+            if (targets[i].isEmpty()) continue;
+            const Mat &targetSketch = targets[i].last();
+            if ((int)targetSketch.total() != size) qFatal("Sketch size mismatch.");
+            hammingDistances[i] = hamming(targetSketch.data, sketch.data, size);
+            histogram[hammingDistances[i]]++;
+        }
+
+        // Radius admitting the shortlist
+        int remaining = qMax(shortlist, int(ceil(fraction * targets.size())));
+        int radius = 0;
+        while ((radius < histogram.size()-1) && (histogram[radius] < remaining))
+            remaining -= histogram[radius++];
+
+        // Re-rank the shortlist
+        const Template queryFeatures = features(query);
+        for (int i=0; i<targets.size(); i++) {
+            if ((hammingDistances[i] < 0) || (hammingDistances[i] > radius)) continue;
+            if (hammingDistances[i] == radius) {
+                if (remaining == 0) continue;
+                remaining--;
+            }
+            scores[i] = distance->compare(features(targets[i]), queryFeatures);
+        }
+        return scores;
+    }
+
+    void compareQueries(const TemplateList &target, const TemplateList &query, Output *output, int begin, int end) const
+    {
+        for (int i=begin; i<end; i++) {
+            const QList<float> scores = compare(target, query[i]);
+            for (int j=0; j<scores.size(); j++)
+                output->setRelative(scores[j], i, j);
+        }
+    }
+
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const
+    {
+        const int stepSize = ceil(float(query.size()) / float(std::max(1, abs(Globals->parallelism))));
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<query.size(); i+=stepSize) {
+            const int end = std::min(query.size(), i+stepSize);
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &CascadeDistance::compareQueries, target, query, output, i, end));
+            else                      compareQueries(target, query, output, i, end);
+        }
+        futures.waitForFinished();
+    }
+};
+
+BR_REGISTER(Distance, CascadeDistance)
+
 } // namespace br
 
 #include "hash.moc"
@@ -157,6 +157,8 @@ BR_REGISTER(Transform, RankTransform)
 /*!
  * \ingroup transforms
  * \brief An integral histogram
+ *
+ * Cell (i, j) holds the counts of the top left i*radius by j*radius pixels, values at or above bins are ignored.
  * \author Josh Klontz \cite jklontz
  */
 class IntegralHistTransform : public UntrainableTransform
@@ -172,16 +174,24 @@ class IntegralHistTransform : public UntrainableTransform
         const Mat &m = src.m();
         if (m.type() != CV_8UC1) qFatal("IntegralHist requires 8UC1 matrices.");
 
-        Mat integral(m.rows/radius+1, (m.cols/radius+1)*bins, CV_32SC1);
-        integral.setTo(0);
-        for (int i=1; i<integral.rows; i++) {
-            for (int j=1; j<integral.cols; j+=bins) {
-                for (int k=0; k<bins; k++) integral.at<qint32>(i, j+k) += integral.at<qint32>(i-1, j     +k);
-                for (int k=0; k<bins; k++) integral.at<qint32>(i, j+k) += integral.at<qint32>(i  , j-bins+k);
-                for (int k=0; k<bins; k++) integral.at<qint32>(i, j+k) -= integral.at<qint32>(i-1, j-bins+k);
-                for (int k=0; k<radius; k++)
-                    for (int l=0; l<radius; l++)
-                        integral.at<qint32>(i, j+m.at<quint8>((i-1)*radius+k,(j/bins-1)*radius+l))++;
+        // Each row of cells adds the running histogram of its band of image rows to the row above
+        const int rows = m.rows/radius, columns = m.cols/radius;
+        Mat integral(rows+1, (columns+1)*bins, CV_32SC1);
+        integral.row(0).setTo(0);
+        std::vector<qint32> band(bins);
+        for (int i=1; i<=rows; i++) {
+            const qint32 *above = integral.ptr<qint32>(i-1);
+            qint32 *current = integral.ptr<qint32>(i);
+            std::fill(band.begin(), band.end(), 0);
+            std::fill(current, current+bins, 0);
+            for (int j=1; j<=columns; j++) {
+                for (int y=(i-1)*radius; y<i*radius; y++) {
+                    const quint8 *p = m.ptr<quint8>(y) + (j-1)*radius;
+                    for (int x=0; x<radius; x++)
+                        if (p[x] < bins) band[p[x]]++;
+                }
+                for (int k=0; k<bins; k++)
+                    current[j*bins+k] = above[j*bins+k] + band[k];
             }
         }
         dst = integral;
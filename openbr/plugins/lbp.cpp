@@ -19,6 +19,9 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/highgui/highgui_c.h>
 #include <limits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
 #include "openbr_internal.h"
 
 using namespace cv;
@@ -43,9 +46,11 @@ class LBPTransform : public UntrainableTransform
     BR_PROPERTY(int, maxTransitions, 8)
     BR_PROPERTY(bool, rotationInvariant, false)
 
+protected:
     uchar lut[256];
     uchar null;
 
+private:
     friend class ColoredU2Transform;
 
     /* Returns the number of 0->1 or 1->0 transitions in i */
@@ -98,32 +103,178 @@ class LBPTransform : public UntrainableTransform
                 lut[i] = null; // Set to null id
     }
 
+#ifdef __SSE2__
+    static __m128i greaterEqual(const uchar *p, __m128i cval, char bit)
+    {
+        const __m128i v = _mm_loadu_si128((const __m128i*)p);
+        return _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, cval), v), _mm_set1_epi8(bit));
+    }
+
+    static __m128i greaterEqual(const float *p, __m128 cval, int bit)
+    {
+        return _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(p), cval)), _mm_set1_epi32(bit));
+    }
+#endif // __SSE2__
+
+    /* Raw 8-bit patterns of columns [begin, end) given the rows radius above (a), at (c) and below (b) the center */
+    template <typename T>
+    static void patterns(const T *a, const T *c, const T *b, int r, int begin, int end, uchar *dst)
+    {
+        for (int i=begin; i<end; i++) {
+            const T cval = c[i];
+            dst[i] = (a[i-r] >= cval ? 128 : 0) |
+                     (a[i  ] >= cval ? 64  : 0) |
+                     (a[i+r] >= cval ? 32  : 0) |
+                     (c[i+r] >= cval ? 16  : 0) |
+                     (b[i+r] >= cval ? 8   : 0) |
+                     (b[i  ] >= cval ? 4   : 0) |
+                     (b[i-r] >= cval ? 2   : 0) |
+                     (c[i-r] >= cval ? 1   : 0);
+        }
+    }
+
+    static void patterns(const uchar *a, const uchar *c, const uchar *b, int r, int begin, int end, uchar *dst)
+    {
+        int i = begin;
+#ifdef __SSE2__
+        // Unsigned x >= y is max(x, y) == x
+        for (; i+16<=end; i+=16) {
+            const __m128i cval = _mm_loadu_si128((const __m128i*)(c+i));
+            __m128i code = _mm_or_si128(greaterEqual(a+i-r, cval, char(128)), greaterEqual(a+i, cval, 64));
+            code = _mm_or_si128(code, _mm_or_si128(greaterEqual(a+i+r, cval, 32), greaterEqual(c+i+r, cval, 16)));
+            code = _mm_or_si128(code, _mm_or_si128(greaterEqual(b+i+r, cval, 8), greaterEqual(b+i, cval, 4)));
+            code = _mm_or_si128(code, _mm_or_si128(greaterEqual(b+i-r, cval, 2), greaterEqual(c+i-r, cval, 1)));
+            _mm_storeu_si128((__m128i*)(dst+i), code);
+        }
+#endif // __SSE2__
+        patterns<uchar>(a, c, b, r, i, end, dst);
+    }
+
+    static void patterns(const float *a, const float *c, const float *b, int r, int begin, int end, uchar *dst)
+    {
+        int i = begin;
+#ifdef __SSE2__
+        for (; i+4<=end; i+=4) {
+            const __m128 cval = _mm_loadu_ps(c+i);
+            __m128i code = _mm_or_si128(greaterEqual(a+i-r, cval, 128), greaterEqual(a+i, cval, 64));
+            code = _mm_or_si128(code, _mm_or_si128(greaterEqual(a+i+r, cval, 32), greaterEqual(c+i+r, cval, 16)));
+            code = _mm_or_si128(code, _mm_or_si128(greaterEqual(b+i+r, cval, 8), greaterEqual(b+i, cval, 4)));
+            code = _mm_or_si128(code, _mm_or_si128(greaterEqual(b+i-r, cval, 2), greaterEqual(c+i-r, cval, 1)));
+            code = _mm_packs_epi32(code, code);
+            code = _mm_packus_epi16(code, code);
+            const int packed = _mm_cvtsi128_si32(code);
+            memcpy(dst+i, &packed, 4);
+        }
+#endif // __SSE2__
+        patterns<float>(a, c, b, r, i, end, dst);
+    }
+
+protected:
+    /* 8U and 32F are compared natively, other depths as 32F */
+    static Mat patternInput(const Mat &src)
+    {
+        if (src.channels() != 1)
+            qFatal("LBP requires single channel matrices.");
+        if ((src.depth() == CV_8U) || (src.depth() == CV_32F))
+            return src;
+        Mat m; src.convertTo(m, CV_32F);
+        return m;
+    }
+
+    /* Pattern ids of row y, pixels within radius of the border are null */
+    void codes(const Mat &m, int y, uchar *dst) const
+    {
+        const int begin = radius, end = m.cols - radius;
+        if ((y < radius) || (y >= m.rows - radius) || (begin >= end)) {
+            memset(dst, null, m.cols);
+            return;
+        }
+
+        memset(dst, null, begin);
+        memset(dst + end, null, m.cols - end);
+        if (m.depth() == CV_8U) patterns(m.ptr<uchar>(y-radius), m.ptr<uchar>(y), m.ptr<uchar>(y+radius), radius, begin, end, dst);
+        else                    patterns(m.ptr<float>(y-radius), m.ptr<float>(y), m.ptr<float>(y+radius), radius, begin, end, dst);
+        for (int i=begin; i<end; i++)
+            dst[i] = lut[dst[i]];
+    }
+
     void project(const Template &src, Template &dst) const
     {
-        Mat m; src.m().convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
+        const Mat m = patternInput(src);
         Mat n(m.rows, m.cols, CV_8UC1);
-        n = null; // Initialize to NULL LBP pattern
-
-        const float *p = (const float*)m.ptr();
-        for (int r=radius; r<m.rows-radius; r++) {
-            for (int c=radius; c<m.cols-radius; c++) {
-                const float cval  =     (p[(r+0*radius)*m.cols+c+0*radius]);
-                n.at<uchar>(r, c) = lut[(p[(r-1*radius)*m.cols+c-1*radius] >= cval ? 128 : 0) |
-                                        (p[(r-1*radius)*m.cols+c+0*radius] >= cval ? 64  : 0) |
-                                        (p[(r-1*radius)*m.cols+c+1*radius] >= cval ? 32  : 0) |
-                                        (p[(r+0*radius)*m.cols+c+1*radius] >= cval ? 16  : 0) |
-                                        (p[(r+1*radius)*m.cols+c+1*radius] >= cval ? 8   : 0) |
-                                        (p[(r+1*radius)*m.cols+c+0*radius] >= cval ? 4   : 0) |
-                                        (p[(r+1*radius)*m.cols+c-1*radius] >= cval ? 2   : 0) |
-                                        (p[(r+0*radius)*m.cols+c-1*radius] >= cval ? 1   : 0)];
+        for (int y=0; y<m.rows; y++)
+            codes(m, y, n.ptr(y));
+        dst += n;
+    }
+};
+
+BR_REGISTER(Transform, LBPTransform)
+
+/*!
+ * \ingroup transforms
+ * \brief Histograms of LBP pattern ids over a grid of rectangular regions.
+ *
+ * Equivalent to LBP+RectRegions+Hist with one bin per pattern id, including the null id,
+ * but computed in one pass over the image without materializing the pattern image or the regions.
+ * For example, LBPHist(1,2,false,8,8,6,6) matches LBP(1,2)+RectRegions(8,8,6,6)+Hist(59).
+ */
+class LBPHistTransform : public LBPTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int width READ get_width WRITE set_width RESET reset_width STORED false)
+    Q_PROPERTY(int height READ get_height WRITE set_height RESET reset_height STORED false)
+    Q_PROPERTY(int widthStep READ get_widthStep WRITE set_widthStep RESET reset_widthStep STORED false)
+    Q_PROPERTY(int heightStep READ get_heightStep WRITE set_heightStep RESET reset_heightStep STORED false)
+    BR_PROPERTY(int, width, 8)
+    BR_PROPERTY(int, height, 8)
+    BR_PROPERTY(int, widthStep, -1)
+    BR_PROPERTY(int, heightStep, -1)
+
+    void project(const Template &src, Template &dst) const
+    {
+        const int widthStep = this->widthStep == -1 ? width : this->widthStep;
+        const int heightStep = this->heightStep == -1 ? height : this->heightStep;
+        const Mat m = patternInput(src);
+        const int bins = null + 1;
+        const int columns = m.cols < width  ? 0 : (m.cols - width ) / widthStep  + 1;
+        const int rows    = (m.rows < height) || (columns == 0) ? 0 : (m.rows - height) / heightStep + 1;
+
+        // Row major by region
+        std::vector<qint32> counts(rows * columns * bins, 0);
+        std::vector<uchar> code(m.cols);
+        for (int y=0; y<m.rows; y++) {
+            // Regions containing row y
+            const int firstRow = y < height ? 0 : (y - height) / heightStep + 1;
+            const int lastRow = std::min(rows - 1, y / heightStep);
+            if (firstRow > lastRow)
+                continue;
+
+            codes(m, y, &code[0]);
+            for (int j=firstRow; j<=lastRow; j++) {
+                for (int i=0; i<columns; i++) {
+                    qint32 *hist = &counts[(j * columns + i) * bins];
+                    const uchar *region = &code[i * widthStep];
+                    for (int x=0; x<width; x++)
+                        hist[region[x]]++;
+                }
             }
         }
 
-        dst += n;
+        // Same order as RectRegions
+        for (int i=0; i<columns; i++) {
+            for (int j=0; j<rows; j++) {
+                Mat hist(1, bins, CV_32FC1);
+                const qint32 *count = &counts[(j * columns + i) * bins];
+                float *h = hist.ptr<float>();
+                for (int k=0; k<bins; k++)
+                    h[k] = count[k];
+                dst += hist;
+            }
+        }
     }
 };
 
-BR_REGISTER(Transform, LBPTransform)
+BR_REGISTER(Transform, LBPHistTransform)
 
 /*!
  * \ingroup transforms
@@ -17,6 +17,9 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/imgproc/imgproc_c.h>
 #include <limits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
 #include "openbr_internal.h"
 
 using namespace cv;
@@ -39,6 +42,7 @@ class LTPTransform : public UntrainableTransform
     BR_PROPERTY(float, threshold, 0.1F)
 
     unsigned short lut[8][3];
+    unsigned short offset; // Code when every neighbour is above the threshold
     uchar null;
 
     void init()
@@ -49,61 +53,126 @@ class LTPTransform : public UntrainableTransform
                 lut[i][j] = cnt++;
             cnt++;  //we skip the 4th number (only three patterns)
         }
+
+        // lut[i][j] == lut[i][0] + j, so a code is offset plus the sum of the neighbour states
+        offset = 0;
+        for (int i = 0; i < 8; i++)
+            offset += lut[i][0];
+        null = 0;
+    }
+
+    /* Neighbour state, 0 above the threshold, 1 below the negative threshold, 2 otherwise */
+    template <typename T, typename D>
+    static int state(T neighbour, T center, D threshold, D thresholdNeg)
+    {
+        const D diff = D(neighbour) - D(center);
+        if      (diff > threshold)    return 0;
+        else if (diff < thresholdNeg) return 1;
+        else                          return 2;
+    }
+
+    /* Codes of columns [begin, end) given the rows radius above (a), at (c) and below (b) the center */
+    template <typename T, typename D>
+    void codes(const T *a, const T *c, const T *b, int r, int begin, int end, D threshold, D thresholdNeg, unsigned short *dst) const
+    {
+        for (int i=begin; i<end; i++) {
+            const T cval = c[i];
+            dst[i] = offset + state(a[i-r], cval, threshold, thresholdNeg) +
+                              state(a[i  ], cval, threshold, thresholdNeg) +
+                              state(a[i+r], cval, threshold, thresholdNeg) +
+                              state(c[i+r], cval, threshold, thresholdNeg) +
+                              state(b[i+r], cval, threshold, thresholdNeg) +
+                              state(b[i  ], cval, threshold, thresholdNeg) +
+                              state(b[i-r], cval, threshold, thresholdNeg) +
+                              state(c[i-r], cval, threshold, thresholdNeg);
+        }
+    }
+
+#ifdef __SSE2__
+    // Adds 2*above + belowOnly where the masks are -1 or 0, so that 2 + result is the neighbour state
+    static __m128i state(__m128i neighbour, __m128i center, __m128i threshold, __m128i thresholdNeg)
+    {
+        const __m128i diff = _mm_sub_epi16(neighbour, center);
+        const __m128i above = _mm_cmpgt_epi16(diff, threshold);
+        const __m128i below = _mm_andnot_si128(above, _mm_cmplt_epi16(diff, thresholdNeg));
+        return _mm_add_epi16(_mm_add_epi16(above, above), below);
+    }
+
+    static __m128i state(__m128 neighbour, __m128 center, __m128 threshold, __m128 thresholdNeg)
+    {
+        const __m128 diff = _mm_sub_ps(neighbour, center);
+        const __m128i above = _mm_castps_si128(_mm_cmpgt_ps(diff, threshold));
+        const __m128i below = _mm_andnot_si128(above, _mm_castps_si128(_mm_cmplt_ps(diff, thresholdNeg)));
+        return _mm_add_epi32(_mm_add_epi32(above, above), below);
+    }
+
+    static __m128i widen(const uchar *p)
+    {
+        return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128());
+    }
+#endif // __SSE2__
+
+    void codes(const uchar *a, const uchar *c, const uchar *b, int r, int begin, int end, unsigned short *dst) const
+    {
+        // Differences of integers exceed a threshold exactly when they exceed its integer part
+        const int threshold = int(floor(qBound(-256.0, double(this->threshold), 256.0)));
+        const int thresholdNeg = int(ceil(qBound(-256.0, -1.0 * this->threshold, 256.0)));
+
+        int i = begin;
+#ifdef __SSE2__
+        const __m128i t = _mm_set1_epi16(threshold), tNeg = _mm_set1_epi16(thresholdNeg);
+        const __m128i base = _mm_set1_epi16(offset + 16);
+        for (; i+8<=end; i+=8) {
+            const __m128i cval = widen(c+i);
+            __m128i code = _mm_add_epi16(state(widen(a+i-r), cval, t, tNeg), state(widen(a+i), cval, t, tNeg));
+            code = _mm_add_epi16(code, _mm_add_epi16(state(widen(a+i+r), cval, t, tNeg), state(widen(c+i+r), cval, t, tNeg)));
+            code = _mm_add_epi16(code, _mm_add_epi16(state(widen(b+i+r), cval, t, tNeg), state(widen(b+i), cval, t, tNeg)));
+            code = _mm_add_epi16(code, _mm_add_epi16(state(widen(b+i-r), cval, t, tNeg), state(widen(c+i-r), cval, t, tNeg)));
+            _mm_storeu_si128((__m128i*)(dst+i), _mm_add_epi16(base, code));
+        }
+#endif // __SSE2__
+        codes(a, c, b, r, i, end, threshold, thresholdNeg, dst);
+    }
+
+    void codes(const float *a, const float *c, const float *b, int r, int begin, int end, unsigned short *dst) const
+    {
+        const float thresholdNeg = -1.0 * threshold;
+
+        int i = begin;
+#ifdef __SSE2__
+        const __m128 t = _mm_set1_ps(threshold), tNeg = _mm_set1_ps(thresholdNeg);
+        const __m128i base = _mm_set1_epi32(offset + 16);
+        for (; i+4<=end; i+=4) {
+            const __m128 cval = _mm_loadu_ps(c+i);
+            __m128i code = _mm_add_epi32(state(_mm_loadu_ps(a+i-r), cval, t, tNeg), state(_mm_loadu_ps(a+i), cval, t, tNeg));
+            code = _mm_add_epi32(code, _mm_add_epi32(state(_mm_loadu_ps(a+i+r), cval, t, tNeg), state(_mm_loadu_ps(c+i+r), cval, t, tNeg)));
+            code = _mm_add_epi32(code, _mm_add_epi32(state(_mm_loadu_ps(b+i+r), cval, t, tNeg), state(_mm_loadu_ps(b+i), cval, t, tNeg)));
+            code = _mm_add_epi32(code, _mm_add_epi32(state(_mm_loadu_ps(b+i-r), cval, t, tNeg), state(_mm_loadu_ps(c+i-r), cval, t, tNeg)));
+            code = _mm_add_epi32(base, code);
+            _mm_storel_epi64((__m128i*)(dst+i), _mm_packs_epi32(code, code));
+        }
+#endif // __SSE2__
+        codes(a, c, b, r, i, end, threshold, thresholdNeg, dst);
     }
 
     void project(const Template &src, Template &dst) const
     {
-        Mat m; src.m().convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
+        // 8U is compared natively, other depths as 32F
+        if (src.m().channels() != 1)
+            qFatal("LTP requires single channel matrices.");
+        Mat m;
+        if ((src.m().depth() == CV_8U) || (src.m().depth() == CV_32F)) m = src.m();
+        else                                                          src.m().convertTo(m, CV_32F);
 
         Mat n(m.rows, m.cols, CV_16U);
-        n = null; 
-        float thresholdNeg = -1.0 * threshold; //compute once (can move to init)
-
-        const float *p = (const float*)m.ptr();
-        float diff;
-        for (int r=radius; r<m.rows-radius; r++) {
-            for (int c=radius; c<m.cols-radius; c++) {
-                const float cval  = (p[(r+0*radius)*m.cols+c+0*radius]);
-
-                diff = p[(r-1*radius)*m.cols+c-1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) = lut[0][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) = lut[0][1];
-                else                            n.at<unsigned short>(r,c) = lut[0][2];
-
-                diff = p[(r-1*radius)*m.cols+c+0*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[1][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[1][1];
-                else                            n.at<unsigned short>(r,c) += lut[1][2];
-
-                diff = p[(r-1*radius)*m.cols+c+1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[2][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[2][1];
-                else                            n.at<unsigned short>(r,c) += lut[2][2];
-
-                diff = p[(r+0*radius)*m.cols+c+1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[3][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[3][1];
-                else                            n.at<unsigned short>(r,c) += lut[3][2];
-
-                diff = p[(r+1*radius)*m.cols+c+1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[4][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[4][1];
-                else                            n.at<unsigned short>(r,c) += lut[4][2];
-
-                diff = p[(r+1*radius)*m.cols+c+0*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[5][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[5][1];
-                else                            n.at<unsigned short>(r,c) += lut[5][2];
-
-                diff = p[(r+1*radius)*m.cols+c-1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[6][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[6][1];
-                else                            n.at<unsigned short>(r,c) += lut[6][2];
-
-                diff = p[(r+0*radius)*m.cols+c-1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[7][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[7][1];
-                else                            n.at<unsigned short>(r,c) += lut[7][2];
+        n = null;
+
+        const int begin = radius, end = m.cols - radius;
+        if (begin < end) {
+            for (int y=radius; y<m.rows-radius; y++) {
+                unsigned short *row = n.ptr<unsigned short>(y);
+                if (m.depth() == CV_8U) codes(m.ptr<uchar>(y-radius), m.ptr<uchar>(y), m.ptr<uchar>(y+radius), radius, begin, end, row);
+                else                    codes(m.ptr<float>(y-radius), m.ptr<float>(y), m.ptr<float>(y+radius), radius, begin, end, row);
             }
         }
 
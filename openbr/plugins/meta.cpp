@@ -20,6 +20,7 @@
 #include "openbr_internal.h"
 #include "openbr/core/common.h"
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/profiler.h"
 #include "openbr/core/qtutils.h"
 #include "openbr/core/resource.h"
 
@@ -63,12 +64,106 @@ static void _train(Transform *transform, const QList<TemplateList> *data)
     transform->train(*data);
 }
 
+static void _projectUpdate(Transform *transform, const TemplateList *src, TemplateList *dst)
+{
+    transform->projectUpdate(*src, *dst);
+}
+
+/*!
+ * \brief A run of br::PointwiseTransform applied in one pass over row strips.
+ *
+ * Created by PipeTransform::simplify(), the pixels of each strip are converted to floats once,
+ * passed through every transform in cache, and converted to the final type once.
+ */
+class FusedPointwiseTransform : public UntrainableTransform
+{
+    Q_OBJECT
+
+    QList<const PointwiseTransform*> transforms;
+
+    QString description(bool expanded) const
+    {
+        QStringList descriptions;
+        foreach (const PointwiseTransform *transform, transforms)
+            descriptions.append(transform->description(expanded));
+        return descriptions.join("+");
+    }
+
+    static bool supported(int type)
+    {
+        const int depth = CV_MAT_DEPTH(type);
+        return (depth == CV_8U) || (depth == CV_8S) || (depth == CV_16U) || (depth == CV_16S) || (depth == CV_32F);
+    }
+
+    Mat project(const File &file, const Mat &src) const
+    {
+        QVector<int> types; types.append(src.type());
+        int channels = CV_MAT_CN(src.type());
+        foreach (const PointwiseTransform *transform, transforms) {
+            if (!supported(types.last())) break;
+            types.append(transform->pointwiseType(types.last()));
+            channels = std::max(channels, CV_MAT_CN(types.last()));
+        }
+
+        // Types that can't be fused are processed one transform at a time
+        if ((types.size() <= transforms.size()) || !supported(types.last())) {
+            Template t(file, src);
+            foreach (const PointwiseTransform *transform, transforms)
+                t >> *transform;
+            return t.m();
+        }
+
+        Mat dst(src.size(), types.last());
+        Mat in = src, out = dst;
+        if (src.isContinuous() && dst.isContinuous()) {
+            in = src.reshape(0, 1);
+            out = dst.reshape(0, 1);
+        }
+
+        const int stripSize = 1024;
+        QVector<float> buffer(2 * stripSize * channels);
+        for (int row=0; row<in.rows; row++) {
+            for (int col=0; col<in.cols; col+=stripSize) {
+                const int n = std::min(stripSize, in.cols-col);
+                float *a = buffer.data(), *b = buffer.data() + stripSize*channels;
+
+                Mat strip(1, n, CV_32FC(CV_MAT_CN(types.first())), a);
+                in(Range(row, row+1), Range(col, col+n)).convertTo(strip, CV_32F);
+                for (int i=0; i<transforms.size(); i++) {
+                    transforms[i]->pointwise(a, b, n, types[i]);
+                    std::swap(a, b);
+                }
+
+                Mat result = out(Range(row, row+1), Range(col, col+n));
+                Mat(1, n, CV_32FC(CV_MAT_CN(types.last())), a).convertTo(result, CV_MAT_DEPTH(types.last()));
+            }
+        }
+        return dst;
+    }
+
+    // Like IndependentTransform, each matrix is processed separately
+    void project(const Template &src, Template &dst) const
+    {
+        dst.file = src.file;
+        QList<Mat> mats;
+        foreach (const Mat &m, src)
+            mats.append(project(src.file, m));
+        dst.append(mats);
+    }
+
+public:
+    FusedPointwiseTransform(const QList<const PointwiseTransform*> &transforms) : UntrainableTransform(true), transforms(transforms) {}
+};
+
 /*!
  * \ingroup Transforms
  * \brief Transforms in series.
  * \author Josh Klontz \cite jklontz
  *
  * The source br::Template is given to the first transform and the resulting br::Template is passed to the next transform, etc.
+ * When projecting a br::TemplateList, consecutive independent, time invariant transforms are applied to one template at a time,
+ * so only the transforms in between, such as ExpandTransform, wait for the whole list.
+ * Once simplified, consecutive br::PointwiseTransform are fused into a single pass.
  *
  * \see ExpandTransform
  * \see ForkTransform
@@ -77,10 +172,116 @@ class PipeTransform : public CompositeTransform
 {
     Q_OBJECT    
 
+    friend class ForkTransform;
+
     void _projectPartial(TemplateList *srcdst, int startIndex, int stopIndex)
     {
-        for (int i=startIndex; i<stopIndex; i++)
-            *srcdst >> *transforms[i];
+        _projectRange(*srcdst, startIndex, stopIndex);
+    }
+
+    // The pointwise transform behind a stage, if any
+    static const PointwiseTransform *pointwise(const Transform *transform)
+    {
+        if (transform->inherits("br::IndependentTransform"))
+            transform = qvariant_cast<Transform*>(transform->property("transform"));
+        return dynamic_cast<const PointwiseTransform*>(transform);
+    }
+
+    // Replace runs of two or more pointwise stages with a FusedPointwiseTransform
+    Transform *simplify(bool &newTransform)
+    {
+        Transform *simplified = CompositeTransform::simplify(newTransform);
+        PipeTransform *pipe = dynamic_cast<PipeTransform*>(simplified);
+        if (!pipe) return simplified;
+
+        QList<Transform*> fused;
+        QList<Transform*> created;
+        for (int i=0; i<pipe->transforms.size();) {
+            QList<const PointwiseTransform*> run;
+            for (int j=i; j<pipe->transforms.size(); j++) {
+                const PointwiseTransform *transform = pointwise(pipe->transforms[j]);
+                if (!transform) break;
+                run.append(transform);
+            }
+
+            if (run.size() < 2) {
+                fused.append(pipe->transforms[i++]);
+            } else {
+                created.append(new FusedPointwiseTransform(run));
+                fused.append(created.last());
+                i += run.size();
+            }
+        }
+
+        if (created.isEmpty())
+            return simplified;
+
+        if (!newTransform) {
+            // Make a copy of the current object, with empty transforms
+            QList<Transform*> children = transforms;
+            transforms = QList<Transform*>();
+            pipe = dynamic_cast<PipeTransform*>(Transform::make(description(false), NULL));
+            transforms = children;
+            newTransform = true;
+        }
+
+        pipe->transforms = fused;
+        foreach (Transform *transform, created)
+            transform->setParent(pipe);
+        pipe->init();
+        return pipe;
+    }
+
+    // Independent, time invariant transforms map each template on its own,
+    // Transform::make() wraps them in an IndependentTransform
+    static bool elementwise(const Transform *transform)
+    {
+        return (transform->independent || transform->inherits("br::IndependentTransform")) && !transform->timeVarying();
+    }
+
+    // Pass a single template through a run of elementwise transforms, parent is the caller's profiler path
+    void _projectElementwise(Template *srcdst, int startIndex, int stopIndex, int parent = -1) const
+    {
+        for (int i=startIndex; i<stopIndex; i++) {
+            Profiler::Scope scope(transforms[i], parent);
+            scope.input(*srcdst);
+            try {
+                *srcdst >> *transforms[i];
+                scope.output(*srcdst);
+            } catch (...) {
+                qWarning("Exception triggered when processing %s with transform %s", qPrintable(srcdst->file.flat()), qPrintable(transforms[i]->objectName()));
+                *srcdst = Template(srcdst->file);
+                srcdst->file.set("FTE", true);
+            }
+        }
+    }
+
+    // Runs of elementwise transforms are applied depth-first so each template finishes the run
+    // before the next one starts, other transforms act as barriers and see the whole list
+    void _projectRange(TemplateList &srcdst, int startIndex, int stopIndex) const
+    {
+        const int path = Profiler::path();
+        int i = startIndex;
+        while (i < stopIndex) {
+            if (!elementwise(transforms[i])) {
+                Profiler::Scope scope(transforms[i]);
+                scope.input(srcdst);
+                srcdst >> *transforms[i++];
+                scope.output(srcdst);
+                continue;
+            }
+
+            int j = i+1;
+            while ((j < stopIndex) && elementwise(transforms[j]))
+                j++;
+
+            QFutureSynchronizer<void> futures;
+            for (int k=0; k<srcdst.size(); k++)
+                if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(this, &PipeTransform::_projectElementwise, &srcdst[k], i, j, path));
+                else                          _projectElementwise(&srcdst[k], i, j);
+            futures.waitForFinished();
+            i = j;
+        }
     }
 
     void train(const QList<TemplateList> &data)
@@ -137,8 +338,11 @@ class PipeTransform : public CompositeTransform
     {
         dst = src;
         foreach (Transform *f, transforms) {
+            Profiler::Scope scope(f);
+            scope.input(dst);
             try {
                 f->projectUpdate(dst);
+                scope.output(dst);
             } catch (...) {
                 qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(f->objectName()));
                 dst = Template(src.file);
@@ -154,7 +358,10 @@ class PipeTransform : public CompositeTransform
         dst = src;
         foreach (Transform *f, transforms)
         {
+            Profiler::Scope scope(f);
+            scope.input(dst);
             f->projectUpdate(dst);
+            scope.output(dst);
         }
     }
 
@@ -206,9 +413,7 @@ protected:
    void _project(const TemplateList &src, TemplateList &dst) const
     {
         dst = src;
-        foreach (const Transform *f, transforms) {
-            dst >> *f;
-        }
+        _projectRange(dst, 0, transforms.size());
     }
 
    // Single template const project, pass the template through each sub-transform, one after the other
@@ -216,8 +421,11 @@ protected:
    {
        dst = src;
        foreach (const Transform *f, transforms) {
+           Profiler::Scope scope(f);
+           scope.input(dst);
            try {
                dst >> *f;
+               scope.output(dst);
            } catch (...) {
                qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(f->objectName()));
                dst = Template(src.file);
@@ -299,6 +507,8 @@ BR_REGISTER(Transform, ContractTransform)
  * \author Josh Klontz \cite jklontz
  *
  * The source br::Template is seperately given to each transform and the results are appended together.
+ * Branches run concurrently, and leading untrainable, time invariant stages with identical descriptions,
+ * like the A+B in <tt>(A+B+X)/(A+B+Y)</tt>, are projected once and shared by the branches that start with them.
  *
  * \see PipeTransform
  */
@@ -332,12 +542,107 @@ class ForkTransform : public CompositeTransform
     }
 
     void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        QVector<TemplateList> outputs(transforms.size());
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<transforms.size(); i++)
+            if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(_projectUpdate, transforms[i], &src, &outputs[i]));
+            else                          _projectUpdate(transforms[i], &src, &outputs[i]);
+        futures.waitForFinished();
+        merge(src, outputs, dst);
+    }
+
+    // A stage projected once for every branch that starts with it
+    struct SharedStage
+    {
+        int input; // Index of the shared stage feeding this one, -1 for the source
+        Transform *stage;
+        SharedStage(int input = -1, Transform *stage = NULL) : input(input), stage(stage) {}
+    };
+
+    QList< QList<Transform*> > branchStages;
+    QList<SharedStage> sharedStages;
+    QVector<int> branchInputs, branchDepths; // Where each branch picks up after its shared stages
+
+    void init()
+    {
+        CompositeTransform::init();
+
+        branchStages.clear();
+        foreach (Transform *f, transforms) {
+            PipeTransform *pipe = dynamic_cast<PipeTransform*>(f);
+            branchStages.append(pipe ? pipe->transforms : QList<Transform*>() << f);
+        }
+
+        sharedStages.clear();
+        branchInputs = QVector<int>(transforms.size(), -1);
+        branchDepths = QVector<int>(transforms.size(), 0);
+        QList<int> branches;
+        for (int i=0; i<transforms.size(); i++)
+            branches.append(i);
+        share(branches, 0, -1);
+    }
+
+    // Group branches by the description of their stage at depth, recursing into groups of more than one
+    void share(const QList<int> &branches, int depth, int input)
+    {
+        QStringList keys;
+        QHash<QString, QList<int> > groups;
+        foreach (int branch, branches) {
+            const QList<Transform*> &stages = branchStages[branch];
+            const bool shareable = (depth < stages.size()) && !stages[depth]->trainable && !stages[depth]->timeVarying();
+            const QString key = shareable ? stages[depth]->description() : QString();
+            if (!key.isEmpty() && !groups.contains(key)) keys.append(key);
+            if (!key.isEmpty()) groups[key].append(branch);
+            else                { branchInputs[branch] = input; branchDepths[branch] = depth; }
+        }
+
+        foreach (const QString &key, keys) {
+            const QList<int> &group = groups[key];
+            if (group.size() == 1) {
+                branchInputs[group.first()] = input;
+                branchDepths[group.first()] = depth;
+                continue;
+            }
+            sharedStages.append(SharedStage(input, branchStages[group.first()][depth]));
+            share(group, depth+1, sharedStages.size()-1);
+        }
+    }
+
+    // Project src through the stages of a branch that were not shared
+    void projectBranch(int branch, const Template &src, Template &dst) const
+    {
+        Profiler::Scope scope(transforms[branch]);
+        const int depth = branchDepths[branch];
+        if (depth == branchStages[branch].size()) {
+            dst = src;
+        } else if (depth == 0) {
+            dst = (*transforms[branch])(src);
+        } else {
+            dst = src;
+            static_cast<const PipeTransform*>(transforms[branch])->_projectElementwise(&dst, depth, branchStages[branch].size());
+        }
+    }
+
+    void projectBranchList(int branch, const TemplateList *src, TemplateList *dst, int parent) const
+    {
+        Profiler::Scope scope(transforms[branch], parent);
+        const int depth = branchDepths[branch];
+        if (depth == branchStages[branch].size()) {
+            *dst = *src;
+        } else if (depth == 0) {
+            transforms[branch]->project(*src, *dst);
+        } else {
+            *dst = *src;
+            static_cast<const PipeTransform*>(transforms[branch])->_projectRange(*dst, depth, branchStages[branch].size());
+        }
+    }
+
+    static void merge(const TemplateList &src, const QVector<TemplateList> &outputs, TemplateList &dst)
     {
         dst.reserve(src.size());
         for (int i=0; i<src.size(); i++) dst.append(Template(src[i].file));
-        foreach (Transform *f, transforms) {
-            TemplateList m;
-            f->projectUpdate(src, m);
+        foreach (const TemplateList &m, outputs) {
             if (m.size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
             for (int i=0; i<src.size(); i++) dst[i].merge(m[i]);
         }
@@ -376,27 +681,56 @@ protected:
     // Apply each transform to src, concatenate the results
     void _project(const Template &src, Template &dst) const
     {
-        foreach (const Transform *f, transforms) {
+        QVector<Template> shared(sharedStages.size());
+        for (int i=0; i<sharedStages.size(); i++) {
+            const Template &input = (sharedStages[i].input < 0) ? src : shared[sharedStages[i].input];
+            Profiler::Scope scope(sharedStages[i].stage);
+            scope.input(input);
             try {
-                dst.merge((*f)(src));
+                shared[i] = (*sharedStages[i].stage)(input);
+                scope.output(shared[i]);
             } catch (...) {
-                qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(f->objectName()));
+                qWarning("Exception triggered when processing %s with transform %s", qPrintable(input.file.flat()), qPrintable(sharedStages[i].stage->objectName()));
+                shared[i] = Template(input.file);
+                shared[i].file.set("FTE", true);
+            }
+        }
+
+        for (int i=0; i<transforms.size(); i++) {
+            try {
+                Template m;
+                projectBranch(i, (branchInputs[i] < 0) ? src : shared[branchInputs[i]], m);
+                dst.merge(m);
+            } catch (...) {
+                qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(transforms[i]->objectName()));
                 dst = Template(src.file);
                 dst.file.set("FTE", true);
             }
         }
     }
 
+    // Shared stages are projected first, then the remainder of every branch runs concurrently
     void _project(const TemplateList &src, TemplateList &dst) const
     {
-        dst.reserve(src.size());
-        for (int i=0; i<src.size(); i++) dst.append(Template(src[i].file));
-        foreach (const Transform *f, transforms) {
-            TemplateList m;
-            f->project(src, m);
-            if (m.size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
-            for (int i=0; i<src.size(); i++) dst[i].merge(m[i]);
+        QVector<TemplateList> shared(sharedStages.size());
+        for (int i=0; i<sharedStages.size(); i++) {
+            shared[i] = (sharedStages[i].input < 0) ? src : shared[sharedStages[i].input];
+            Profiler::Scope scope(sharedStages[i].stage);
+            scope.input(shared[i]);
+            shared[i] >> *sharedStages[i].stage;
+            scope.output(shared[i]);
         }
+
+        const int path = Profiler::path();
+        QVector<TemplateList> outputs(transforms.size());
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<transforms.size(); i++) {
+            const TemplateList *input = (branchInputs[i] < 0) ? &src : &shared[branchInputs[i]];
+            if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(this, &ForkTransform::projectBranchList, i, input, &outputs[i], path));
+            else                          projectBranchList(i, input, &outputs[i], path);
+        }
+        futures.waitForFinished();
+        merge(src, outputs, dst);
     }
 
 };
@@ -820,6 +820,8 @@ class FileExclusionTransform : public UntrainableMetaTransform
     BR_PROPERTY(QString, exclusionGallery, "")
 
     QSet<QString> excluded;
+    QVector<quint64> indexed; // Sorted file name hashes when the gallery has a GalleryIndex
+    bool useIndex;
 
     void project(const Template &, Template &) const
     {
@@ -829,15 +831,21 @@ class FileExclusionTransform : public UntrainableMetaTransform
     void project(const TemplateList &src, TemplateList &dst) const
     {
         foreach (const Template &srcTemp, src) {
-            if (!excluded.contains(srcTemp.file))
+            const bool exclude = useIndex ? std::binary_search(indexed.begin(), indexed.end(), GalleryIndex::hash(srcTemp.file.name))
+                                          : excluded.contains(srcTemp.file);
+            if (!exclude)
                 dst.append(srcTemp);
         }
     }
 
     void init()
     {
+        useIndex = false;
         if (exclusionGallery.isEmpty())
             return;
+        useIndex = GalleryIndex::read(exclusionGallery, indexed);
+        if (useIndex)
+            return;
         FileList temp = FileList::fromGallery(exclusionGallery);
         excluded = QSet<QString>::fromList(temp.names());
     }
@@ -45,6 +45,44 @@ protected:
     UntrainableMetaTransform() : UntrainableTransform(false) {}
 };
 
+/*!
+ * \brief A br::UntrainableTransform where each output pixel depends only on the same input pixel.
+ *
+ * Runs of pointwise transforms in a br::PipeTransform are fused by \c simplify() into a single pass over row strips.
+ */
+class BR_EXPORT PointwiseTransform : public UntrainableTransform
+{
+    Q_OBJECT
+
+public:
+    /*!
+     * \brief Matrix type produced for an input of the given type, or -1 if it can't be computed pointwise.
+     */
+    virtual int pointwiseType(int type) const = 0;
+
+    /*!
+     * \brief Compute \em n pixels of pointwiseType(type) from \em n pixels of \em type, both stored as floats.
+     */
+    virtual void pointwise(const float *src, float *dst, int n, int type) const = 0;
+
+    /*!
+     * \brief Round and clamp to the range of an integer depth, as cv::saturate_cast would.
+     */
+    static inline float saturate(float value, int depth)
+    {
+        switch (depth) {
+          case CV_8U:  return cv::saturate_cast<uchar>(value);
+          case CV_8S:  return cv::saturate_cast<schar>(value);
+          case CV_16U: return cv::saturate_cast<ushort>(value);
+          case CV_16S: return cv::saturate_cast<short>(value);
+          default:     return value;
+        }
+    }
+
+protected:
+    PointwiseTransform() : UntrainableTransform(true) {}
+};
+
 class TransformCopier : public ResourceMaker<Transform>
 {
 public:
@@ -475,6 +513,25 @@ public:
 };
 
 
+/*!
+ * \brief Sidecar index of the templates in a \c .gal gallery written with \c append or \c index.
+ *
+ * Stored next to the gallery with an ".index" suffix, one record per template holding
+ * a 64-bit hash of its file name and the gallery offset just past it.
+ */
+struct BR_EXPORT GalleryIndex
+{
+    struct Record
+    {
+        quint64 hash;
+        qint64 end;
+    };
+
+    static QString fileName(const File &gallery); /*!< \brief Path of the index for a gallery. */
+    static quint64 hash(const QString &name); /*!< \brief FNV-1a hash of a file name. */
+    static bool read(const File &gallery, QVector<quint64> &hashes); /*!< \brief Sorted hashes of the complete templates in a gallery, false if it isn't indexed. */
+};
+
 void applyAdditionalProperties(const File &temp, Transform *target);
 
 Transform *wrapTransform(Transform *base, const QString &target);
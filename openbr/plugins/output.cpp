@@ -130,6 +130,11 @@ class meltOutput : public MatrixOutput
 {
     Q_OBJECT
 
+    bool upperTriangular() const
+    {
+        return true;
+    }
+
     ~meltOutput()
     {
         if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
@@ -178,43 +183,51 @@ class mtxOutput : public Output
 
     Q_PROPERTY(QString targetGallery READ get_targetGallery WRITE set_targetGallery RESET reset_targetGallery STORED false)
     Q_PROPERTY(QString queryGallery READ get_queryGallery WRITE set_queryGallery RESET reset_queryGallery STORED false)
+    Q_PROPERTY(QString encoding READ get_encoding WRITE set_encoding RESET reset_encoding STORED false)
+    Q_PROPERTY(float minScore READ get_minScore WRITE set_minScore RESET reset_minScore STORED false)
+    Q_PROPERTY(float maxScore READ get_maxScore WRITE set_maxScore RESET reset_maxScore STORED false)
     BR_PROPERTY(QString, targetGallery, "Unknown_Target")
     BR_PROPERTY(QString, queryGallery, "Unknown_Query")
+    BR_PROPERTY(QString, encoding, "float") // See BEE::SimmatEncoding
+    BR_PROPERTY(float, minScore, 0) // Linear encoding range, uint8 and uint16 fall back to float unless minScore < maxScore
+    BR_PROPERTY(float, maxScore, 0)
 
     int headerSize, rowBlock, columnBlock;
+    qint64 clipped;
     cv::Mat blockScores;
+    BEE::SimmatEncoding matrixEncoding;
 
+public:
+    mtxOutput() : headerSize(-1), rowBlock(0), columnBlock(0), clipped(0) {}
+
+private:
     ~mtxOutput()
     {
         writeBlock();
+        if (clipped > 0)
+            qWarning("Clipped %lld scores outside [%g, %g] in %s.", clipped, minScore, maxScore, qPrintable(file.name));
+    }
+
+    void initializeFile()
+    {
+        QFile f(file);
+        // Blocks arrive one at a time, so nothing representative is available to learn from
+        matrixEncoding = BEE::SimmatEncoding::make(BEE::SimmatEncoding::blockwise(encoding, minScore, maxScore), cv::Mat(), minScore, maxScore);
+        BEE::writeHeader(f, false, queryFiles.size(), targetFiles.size(), targetGallery, queryGallery, matrixEncoding);
+        headerSize = f.pos();
+
+        cv::Mat defaultRow;
+        matrixEncoding.encode(cv::Mat(1, targetFiles.size(), CV_32FC1, cv::Scalar(-std::numeric_limits<float>::max())), defaultRow);
+        for (int i=0; i<queryFiles.size(); i++)
+            f.write((const char*)defaultRow.data, defaultRow.total()*defaultRow.elemSize());
+        f.close();
     }
 
     void setBlock(int rowBlock, int columnBlock)
     {
         if ((rowBlock == 0) && (columnBlock == 0)) {
-            // Initialize the file
-            QFile f(file);
-            QtUtils::touchDir(f);
-            if (!f.open(QFile::WriteOnly))
-                qFatal("Unable to open %s for writing.", qPrintable(file));
-            const int endian = 0x12345678;
-            QByteArray header;
-            header.append("S2\n");
-            header.append(qPrintable(targetGallery));
-            header.append("\n");
-            header.append(qPrintable(queryGallery));
-            header.append("\nMF ");
-            header.append(qPrintable(QString::number(queryFiles.size())));
-            header.append(" ");
-            header.append(qPrintable(QString::number(targetFiles.size())));
-            header.append(" ");
-            header.append(QByteArray((const char*)&endian, 4));
-            header.append("\n");
-            headerSize = f.write(header);
-            const float defaultValue = -std::numeric_limits<float>::max();
-            for (int i=0; i<targetFiles.size()*queryFiles.size(); i++)
-                f.write((const char*)&defaultValue, 4);
-            f.close();
+            // Initialize the file with the first block
+            headerSize = -1;
         } else {
             writeBlock();
         }
@@ -241,12 +254,19 @@ class mtxOutput : public Output
 
     void writeBlock()
     {
+        if (headerSize < 0)
+            initializeFile();
+
+        cv::Mat codes;
+        clipped += matrixEncoding.encode(blockScores, codes);
+        const qint64 elemSize = codes.elemSize();
+
         QFile f(file);
         if (!f.open(QFile::ReadWrite))
             qFatal("Unable to open %s for modifying.", qPrintable(file));
-        for (int i=0; i<blockScores.rows; i++) {
-            f.seek(headerSize + sizeof(float)*(quint64(rowBlock*this->blockRows+i)*targetFiles.size()+(columnBlock*this->blockCols)));
-            f.write((const char*)blockScores.row(i).data, sizeof(float)*blockScores.cols);
+        for (int i=0; i<codes.rows; i++) {
+            f.seek(headerSize + elemSize*(quint64(rowBlock*this->blockRows+i)*targetFiles.size()+(columnBlock*this->blockCols)));
+            f.write((const char*)codes.row(i).data, elemSize*codes.cols);
         }
         f.close();
     }
@@ -409,6 +429,11 @@ class nullOutput : public Output
 {
     Q_OBJECT
 
+    bool upperTriangular() const
+    {
+        return true;
+    }
+
     void set(float value, int i, int j)
     {
         (void) value; (void) i; (void) j;
@@ -520,10 +545,18 @@ class tailOutput : public Output
         lastValue = -std::numeric_limits<float>::max();
     }
 
+    bool upperTriangular() const
+    {
+        return true;
+    }
+
     void set(float value, int i, int j)
     {
-        // Return early for self similar matrices
-        if (selfSimilar && (i <= j)) return;
+        // Self similar matrices report the lower triangle, which the symmetric walk provides transposed
+        if (selfSimilar) {
+            if (upperTriangle && (i < j)) std::swap(i, j);
+            if (i <= j) return;
+        }
 
         // Consider only values passing the criteria
         if ((value < threshold) && (value <= lastValue) && (comparisons.size() >= atLeast))
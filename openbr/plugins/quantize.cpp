@@ -16,6 +16,9 @@
 
 #include <QFutureSynchronizer>
 #include <QtConcurrentRun>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif // __AVX2__
 #include "openbr_internal.h"
 
 #include "openbr/core/common.h"
@@ -126,17 +129,40 @@ class BayesianQuantizationDistance : public Distance
 
     QVector<float> loglikelihoods;
 
-    static void computeLogLikelihood(const Mat &data, const QList<int> &labels, float *loglikelihood)
+    // Integer copy of loglikelihoods compared with, padded for 32-bit gathers
+    QVector<qint16> lut;
+    float lutScale;
+
+    // Genuine pairs are counted from per-label value histograms, impostors are the remaining pairs
+    static void computeLogLikelihood(const Mat &data, const QVector<int> &order, const QVector<int> &groups, float *loglikelihood)
     {
-        const QList<uchar> vals = OpenCVUtils::matrixToVector<uchar>(data);
-        if (vals.size() != labels.size())
-            qFatal("Logic error.");
+        QVector<quint64> genuines(256, 0), impostors(256, 0), histogram(256, 0), groupHistogram(256, 0);
+        QVector<int> values; values.reserve(256);
+        for (int g=0; g+1<groups.size(); g++) {
+            for (int k=groups[g]; k<groups[g+1]; k++) {
+                const uchar value = data.at<uchar>(order[k], 0);
+                if (groupHistogram[value]++ == 0) values.append(value);
+                histogram[value]++;
+            }
+            std::sort(values.begin(), values.end());
+            for (int u=0; u<values.size(); u++) {
+                const quint64 count = groupHistogram[values[u]];
+                genuines[0] += count * (count - 1) / 2;
+                for (int v=u+1; v<values.size(); v++)
+                    genuines[values[v]-values[u]] += count * groupHistogram[values[v]];
+            }
+            foreach (int value, values)
+                groupHistogram[value] = 0;
+            values.clear();
+        }
 
-        QVector<quint64> genuines(256, 0), impostors(256,0);
-        for (int i=0; i<vals.size(); i++)
-            for (int j=i+1; j<vals.size(); j++)
-                if (labels[i] == labels[j]) genuines[abs(vals[i]-vals[j])]++;
-                else                        impostors[abs(vals[i]-vals[j])]++;
+        for (int u=0; u<256; u++) {
+            impostors[0] += histogram[u] * (histogram[u] - 1) / 2;
+            for (int v=u+1; v<256; v++)
+                impostors[v-u] += histogram[u] * histogram[v];
+        }
+        for (int i=0; i<256; i++)
+            impostors[i] -= genuines[i];
 
         quint64 totalGenuines(0), totalImpostors(0);
         for (int i=0; i<256; i++) {
@@ -148,6 +174,46 @@ class BayesianQuantizationDistance : public Distance
             loglikelihood[i] = log((float(genuines[i]+1)/totalGenuines)/(float(impostors[i]+1)/totalImpostors));
     }
 
+    // Scale so every dimension fits in 16 bits and any sum fits in 32 bits
+    void quantize()
+    {
+        float maxAbs = 0;
+        foreach (float loglikelihood, loglikelihoods)
+            maxAbs = std::max(maxAbs, std::abs(loglikelihood));
+        const int dimensions = std::max(1, loglikelihoods.size() / 256);
+        lutScale = (maxAbs == 0) ? 1 : float(std::min(32767.0 / maxAbs, double(std::numeric_limits<qint32>::max() - dimensions) / (dimensions * double(maxAbs))));
+
+        lut = QVector<qint16>(loglikelihoods.size() + 1, 0);
+        for (int i=0; i<loglikelihoods.size(); i++)
+            lut[i] = qint16(cvRound(loglikelihoods[i] * lutScale));
+    }
+
+    static qint32 likelihood(const uchar *a, const uchar *b, const qint16 *lut, int size)
+    {
+        qint32 sum = 0;
+        int i = 0;
+#ifdef __AVX2__
+        // Gather eight 16-bit entries at a time, reading 32 bits each and sign extending the low half
+        const __m256i offsets = _mm256_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792);
+        __m256i accumulate = _mm256_setzero_si256();
+        for (; i+8<=size; i+=8) {
+            const __m128i av = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(a+i));
+            const __m128i bv = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(b+i));
+            const __m128i difference = _mm_or_si128(_mm_subs_epu8(av, bv), _mm_subs_epu8(bv, av));
+            const __m256i indices = _mm256_add_epi32(_mm256_cvtepu8_epi32(difference), offsets);
+            const __m256i entries = _mm256_i32gather_epi32(reinterpret_cast<const int*>(lut + i*256), indices, 2);
+            accumulate = _mm256_add_epi32(accumulate, _mm256_srai_epi32(_mm256_slli_epi32(entries, 16), 16));
+        }
+        qint32 lanes[8];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), accumulate);
+        for (int j=0; j<8; j++)
+            sum += lanes[j];
+#endif // __AVX2__
+        for (; i<size; i++)
+            sum += lut[i*256 + abs(a[i]-b[i])];
+        return sum;
+    }
+
     void train(const TemplateList &src)
     {
         if ((src.first().size() > 1) || (src.first().m().type() != CV_8UC1))
@@ -157,21 +223,61 @@ class BayesianQuantizationDistance : public Distance
         const QList<int> templateLabels = src.indexProperty(inputVariable);
         loglikelihoods = QVector<float>(data.cols*256, 0);
 
+        // Templates ordered by label, with the boundaries of each label's group
+        QVector<int> order(templateLabels.size()), groups;
+        for (int i=0; i<order.size(); i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), LabelLess(templateLabels));
+        for (int i=0; i<order.size(); i++)
+            if ((i == 0) || (templateLabels[order[i]] != templateLabels[order[i-1]]))
+                groups.append(i);
+        groups.append(order.size());
+
         QFutureSynchronizer<void> futures;
         for (int i=0; i<data.cols; i++)
-            futures.addFuture(QtConcurrent::run(&BayesianQuantizationDistance::computeLogLikelihood, data.col(i), templateLabels, &loglikelihoods.data()[i*256]));
+            futures.addFuture(QtConcurrent::run(&BayesianQuantizationDistance::computeLogLikelihood, data.col(i), order, groups, &loglikelihoods.data()[i*256]));
         futures.waitForFinished();
+        quantize();
     }
 
+    struct LabelLess
+    {
+        const QList<int> *labels;
+        LabelLess(const QList<int> &labels) : labels(&labels) {}
+        bool operator()(int a, int b) const { return (*labels)[a] < (*labels)[b]; }
+    };
+
     float compare(const cv::Mat &a, const cv::Mat &b) const
     {
-        const uchar *aData = a.data;
-        const uchar *bData = b.data;
-        const int size = a.rows * a.cols;
-        float likelihood = 0;
-        for (int i=0; i<size; i++)
-            likelihood += loglikelihoods[i*256+abs(aData[i]-bData[i])];
-        return likelihood;
+        return likelihood(a.data, b.data, lut.constData(), a.rows * a.cols) / lutScale;
+    }
+
+    // Compares blocks of targets one cache sized slice of the LUT at a time
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        if ((query.size() != 1) || (query.m().type() != CV_8UC1))
+            return Distance::compare(targets, query);
+
+        const int size = query.m().rows * query.m().cols;
+        const int blockSize = 64, sliceSize = 32;
+        QList<float> scores; scores.reserve(targets.size());
+        QVector<qint32> sums(blockSize);
+        for (int begin=0; begin<targets.size(); begin+=blockSize) {
+            const int end = std::min(targets.size(), begin+blockSize);
+            sums.fill(0);
+            for (int slice=0; slice<size; slice+=sliceSize) {
+                const int length = std::min(sliceSize, size-slice);
+                for (int i=begin; i<end; i++)
+                    if (targets[i].size() == 1)
+                        sums[i-begin] += likelihood(targets[i].m().data + slice, query.m().data + slice, lut.constData() + slice*256, length);
+            }
+            for (int i=begin; i<end; i++) {
+                if      (targets[i].size() == 1) scores.append(sums[i-begin] / lutScale);
+                else if (targets[i].isEmpty())   scores.append(-std::numeric_limits<float>::max());
+                else                             scores.append(Distance::compare(targets[i], query));
+            }
+        }
+        return scores;
     }
 
     void store(QDataStream &stream) const
@@ -182,7 +288,11 @@ class BayesianQuantizationDistance : public Distance
     void load(QDataStream &stream)
     {
         stream >> loglikelihoods;
+        quantize();
     }
+
+public:
+    BayesianQuantizationDistance() : lutScale(1) {}
 };
 
 BR_REGISTER(Distance, BayesianQuantizationDistance)
@@ -1,4 +1,5 @@
 #include <fstream>
+#include <QElapsedTimer>
 #include <QReadWriteLock>
 #include <QWaitCondition>
 #include <QThreadPool>
@@ -9,8 +10,10 @@
 #include <opencv/highgui.h>
 #include <opencv2/highgui/highgui.hpp>
 #include "openbr_internal.h"
+#include "openbr/core/arena.h"
 #include "openbr/core/common.h"
 #include "openbr/core/opencvutils.h"
+#include "openbr/core/profiler.h"
 #include "openbr/core/qtutils.h"
 
 using namespace cv;
@@ -28,14 +31,46 @@ public:
                      StreamGallery,
                      Auto};
 
+    // Real-time admission policies, frames dropped by these policies never
+    // enter the stream so stages see consecutive sequence numbers.
+    enum FrameModes { AllFrames,    // Process every frame
+                      DropToLatest, // Always process the most recent frame the source produced
+                      EveryNth,     // Process every frameStep'th frame of the source
+                      Deadline};    // Drop frames which can't be processed within deadline ms
+
     Q_ENUMS(StreamModes)
+    Q_ENUMS(FrameModes)
 };
 
+// Milliseconds since the first call, shared by all streams for frame timing
+static qint64 streamClock()
+{
+    static QElapsedTimer timer;
+    static QMutex timerLock;
+    QMutexLocker lock(&timerLock);
+    if (!timer.isValid())
+        timer.start();
+    return timer.elapsed();
+}
+
 class FrameData
 {
 public:
+    FrameData() : sequenceNumber(-1), admitted(0), queued(-1) {}
+
     int sequenceNumber;
     TemplateList data;
+
+    // Pixel storage recycled across uses of this FrameData, readers decode
+    // into it rather than allocating a new matrix for every frame. There is
+    // one buffer per template in data when multiplexing sources.
+    QVector<cv::Mat> buffers;
+
+    // streamClock() time at which the frame was admitted to the stream
+    qint64 admitted;
+
+    // Profiler::clock() time at which the frame was queued for a single thread stage, -1 if not profiled
+    qint64 queued;
 };
 
 // A buffer shared between adjacent processing stages in a stream
@@ -204,7 +239,26 @@ public:
     virtual bool open(Template &input)=0;
     virtual bool isOpen()=0;
     virtual void close()=0;
-    virtual bool getNextTemplate(Template &output)=0;
+    // buffer is storage owned by the requesting FrameData, processors may
+    // decode into it (reusing its allocation) and alias it from output.
+    virtual bool getNextTemplate(Template &output, cv::Mat &buffer)=0;
+
+    // Advance past the next template without returning it, processors may
+    // override this to avoid decoding frames that will be dropped.
+    virtual bool skipTemplate()
+    {
+        Template discard;
+        cv::Mat discardBuffer;
+        return getNextTemplate(discard, discardBuffer);
+    }
+
+    // Index in the underlying source of the template last returned, for
+    // processors which drop frames themselves. -1 if every frame is returned.
+    virtual int sourcePosition() { return -1; }
+
+    // Frames are produced independently of the consumer (videos and cameras),
+    // as opposed to templates which must all be delivered.
+    virtual bool isVideo() { return false; }
 protected:
     Template basis;
     string getAbsolutePath(QString filename)
@@ -259,7 +313,9 @@ public:
 
     void close() { video.release(); }
 
-    bool getNextTemplate(Template &output)
+    bool isVideo() { return true; }
+
+    bool getNextTemplate(Template &output, cv::Mat &buffer)
     {
         if (!isOpen()) {
             qDebug("video source is not open");
@@ -278,16 +334,235 @@ public:
             return false;
         }
 
-        // This clone is critical, if we don't do it then the matrix will
+        // This copy is critical, if we don't do it then the matrix will
         // be an alias of an internal buffer of the video source, leading
-        // to various problems later.
-        output.m() = temp.clone();
+        // to various problems later. We copy into the frame's recycled
+        // buffer, which only allocates if the frame size or type changed.
+        temp.copyTo(buffer);
+        output.m() = buffer;
+        return true;
+    }
+
+    bool skipTemplate()
+    {
+        if (!isOpen())
+            return false;
+
+        // grab advances the capture without decoding the frame
+        if (!video.grab()) {
+            close();
+            return false;
+        }
         return true;
     }
 protected:
     cv::VideoCapture video;
 };
 
+// Reads from another processor continuously on a dedicated thread, holding
+// one template ahead of the consumer. If keepLatest, a template overwritten by
+// the next one before being requested is dropped, so getNextTemplate returns
+// the newest frame, otherwise the thread waits for the consumer. Templates
+// excluded by step are skipped on the reading thread. sourcePosition reports
+// where the returned template was in the source.
+class BackgroundReader : public TemplateProcessor
+{
+public:
+    // Shared by readers so a consumer can wait for whichever has a template ready
+    struct Notifier
+    {
+        QMutex lock;
+        QWaitCondition ready;
+    };
+
+    BackgroundReader(TemplateProcessor *_source, QAtomicInt *_dropped, bool _keepLatest, int _step = 1, Notifier *_notifier = NULL)
+        : source(_source), dropped(_dropped), keepLatest(_keepLatest), step(_step), notifier(_notifier), capture(this)
+    {
+        fresh = false;
+        finished = true;
+        stopping = false;
+        captured = 0;
+        latestPosition = -1;
+        returnedPosition = -1;
+        // Traded with the consumer's frame buffers, so allocated the same way
+        Arena::recycle(latestBuffer);
+        Arena::recycle(captureBuffer);
+    }
+
+    ~BackgroundReader()
+    {
+        close();
+        delete source;
+    }
+
+    bool open(Template &input)
+    {
+        close();
+        if (!source->open(input))
+            return false;
+
+        QMutexLocker lock(&latestLock);
+        fresh = false;
+        finished = false;
+        stopping = false;
+        captured = 0;
+        latestPosition = -1;
+        returnedPosition = -1;
+        lock.unlock();
+
+        capture.start();
+        return true;
+    }
+
+    bool isOpen()
+    {
+        QMutexLocker lock(&latestLock);
+        return fresh || !finished;
+    }
+
+    void close()
+    {
+        QMutexLocker lock(&latestLock);
+        stopping = true;
+        consumed.wakeAll();
+        lock.unlock();
+
+        capture.wait();
+        source->close();
+
+        lock.relock();
+        fresh = false;
+        finished = true;
+        latest.clear();
+    }
+
+    bool getNextTemplate(Template &output, cv::Mat &buffer)
+    {
+        QMutexLocker lock(&latestLock);
+        while (!fresh && !finished)
+            latestAvailable.wait(&latestLock);
+        return take(output, buffer);
+    }
+
+    // Doesn't wait, ready is set if a template was returned. Returns false once
+    // the source is exhausted.
+    bool tryGetNextTemplate(Template &output, cv::Mat &buffer, bool &ready)
+    {
+        QMutexLocker lock(&latestLock);
+        ready = take(output, buffer);
+        return ready || !finished;
+    }
+
+    int sourcePosition()
+    {
+        QMutexLocker lock(&latestLock);
+        return returnedPosition;
+    }
+
+private:
+    class CaptureThread : public QThread
+    {
+    public:
+        CaptureThread(BackgroundReader *_reader) : reader(_reader) {}
+        void run() { reader->captureLoop(); }
+    private:
+        BackgroundReader *reader;
+    };
+
+    // Called with latestLock held
+    bool take(Template &output, cv::Mat &buffer)
+    {
+        if (!fresh)
+            return false;
+
+        // Trade buffers with the consumer rather than copying, the capture
+        // thread will decode into the consumer's old buffer.
+        std::swap(buffer, latestBuffer);
+        output = latest;
+        latest.clear();
+        fresh = false;
+        returnedPosition = latestPosition;
+        consumed.wakeAll();
+        return true;
+    }
+
+    void notify()
+    {
+        if (!notifier)
+            return;
+        QMutexLocker lock(&notifier->lock);
+        notifier->ready.wakeAll();
+    }
+
+    void captureLoop()
+    {
+        forever {
+            Template t;
+            bool res, skipped = false;
+            if ((step > 1) && (captured % step != 0)) {
+                res = source->skipTemplate();
+                skipped = true;
+            } else {
+                res = source->getNextTemplate(t, captureBuffer);
+            }
+
+            QMutexLocker lock(&latestLock);
+            if (res && skipped) {
+                captured++;
+                dropped->ref();
+                res = !stopping;
+                if (res)
+                    continue;
+            }
+
+            if (res && fresh && !stopping) {
+                if (keepLatest) {
+                    dropped->ref();
+                } else {
+                    while (fresh && !stopping)
+                        consumed.wait(&latestLock);
+                }
+            }
+
+            if (!res || stopping) {
+                finished = true;
+                latestAvailable.wakeAll();
+                lock.unlock();
+                notify();
+                return;
+            }
+
+            std::swap(captureBuffer, latestBuffer);
+            latest = t;
+            latestPosition = captured++;
+            fresh = true;
+            latestAvailable.wakeAll();
+            lock.unlock();
+            notify();
+        }
+    }
+
+    TemplateProcessor *source;
+    QAtomicInt *dropped;
+    bool keepLatest;
+    int step;
+    Notifier *notifier;
+    CaptureThread capture;
+
+    QMutex latestLock;
+    QWaitCondition latestAvailable;
+    QWaitCondition consumed;
+    Template latest;
+    cv::Mat latestBuffer;
+    cv::Mat captureBuffer;
+    bool fresh;
+    bool finished;
+    bool stopping;
+    int captured;         // Frames read from source, only used by the capture thread
+    int latestPosition;   // Index of latest in source
+    int returnedPosition; // Index of the last template returned in source
+};
+
 
 struct StreamGallery : public TemplateProcessor
 {
@@ -320,11 +595,14 @@ struct StreamGallery : public TemplateProcessor
         lastBlock = true;
     }
 
-    bool getNextTemplate(Template &output)
+    bool getNextTemplate(Template &output, cv::Mat &buffer)
     {
+        (void) buffer;
         // If we still have data available, we return one of those
         if ((nextIdx >= currentData.size()) && !lastBlock) {
+            Profiler::Scope scope(gallery.data());
             currentData = gallery->readBlock(&lastBlock);
+            scope.output(currentData);
             nextIdx = 0;
         }
 
@@ -373,8 +651,9 @@ public:
         basis.clear();
     }
 
-    bool getNextTemplate(Template &output)
+    bool getNextTemplate(Template &output, cv::Mat &buffer)
     {
+        (void) buffer;
         if (!data_ok)
             return false;
         output = basis;
@@ -515,7 +794,9 @@ public:
         seqFile.close();
     }
 
-    bool getNextTemplate(Template &output)
+    bool isVideo() { return true; }
+
+    bool getNextTemplate(Template &output, cv::Mat &buffer)
     {
         if (!isOpen()) {
             qDebug("Seq not open");
@@ -526,21 +807,20 @@ public:
 
         seqFile.seekg(seekPos.dequeue(), ios::beg);
 
-        Mat temp;
-        // let imdecode do all the work to decode the compressed img
+        // let imdecode do all the work to decode the compressed img,
+        // it reuses buffer's allocation when the size matches
         if (imgFormat == "compressed") {
             int imgSize = readInt() - 4;
-            vector<char> imgBuf(imgSize);
+            imgBuf.resize(imgSize);
             seqFile.read(&imgBuf[0], imgSize);
             // flags < 0 means load image as-is (keep color info if available)
-            imdecode(imgBuf, -1, &temp);
+            imdecode(imgBuf, -1, &buffer);
         }
-        // raw images can be loaded straight into a Mat
+        // raw images can be read straight into the buffer
         else {
-            char *imgBuf = new char[imgSizeBytes];
-            seqFile.read(imgBuf, imgSizeBytes);
             int type = (numChan == 1 ? CV_8UC1 : CV_8UC3);
-            temp = Mat(height, width, type, imgBuf);
+            buffer.create(height, width, type);
+            seqFile.read((char*)buffer.data, std::min(int(buffer.total() * buffer.elemSize()), imgSizeBytes));
         }
 
         output.file = basis.file;
@@ -548,7 +828,7 @@ public:
             output.file.setRects(annotations.first().file.rects());
             annotations.removeFirst();
         }
-        output.m() = temp;
+        output.m() = buffer;
 
         return true;
     }
@@ -578,11 +858,14 @@ protected:
     int width, height, numChan, imgSizeBytes, trueImgSizeBytes, numFrames;
     QString imgFormat;
     TemplateList annotations;
+    vector<char> imgBuf;
 };
 
 // Interface for sequentially getting data from some data source.
 // Given a TemplateList, return single template frames sequentially by applying a TemplateProcessor
 // to each individual template.
+class ProcessingStage;
+
 class DataSource
 {
 public:
@@ -595,8 +878,30 @@ public:
             allFrames.addItem(new FrameData());
         }
         frameSource = NULL;
+        totalFrames = maxFrames;
+        frameMode = br::Idiocy::AllFrames;
+        frameStep = 1;
+        deadline = 0;
+        stages = NULL;
+        concurrentSources = 1;
     }
 
+    // Real-time admission policy, see Idiocy::FrameModes
+    br::Idiocy::FrameModes frameMode;
+    int frameStep;
+    int deadline;
+
+    // If greater than 1, this many input templates are read concurrently, each
+    // on its own thread, and each frame carries the templates that were ready.
+    int concurrentSources;
+
+    // The stages of the stream reading from this source, used to estimate
+    // latency from per-stage timing
+    QList<ProcessingStage *> *stages;
+
+    int droppedFrames() { return dropped.load(); }
+    int lateFrames() { return late.load(); }
+
     virtual ~DataSource()
     {
         while (true)
@@ -616,6 +921,10 @@ public:
             delete frameSource;
             frameSource = NULL;
         }
+
+        foreach (const MultiplexedSource &source, sources)
+            delete source.reader;
+        sources.clear();
     }
 
     int size()
@@ -632,6 +941,9 @@ public:
 
         is_broken = false;
         allReturned = false;
+        source_index = 0;
+        dropped.store(0);
+        late.store(0);
 
         // The last frame isn't initialized yet
         final_frame = -1;
@@ -639,7 +951,18 @@ public:
         next_sequence_number = 0;
 
         // Actually open the data source
-        bool open_res = openNextTemplate();
+        bool open_res;
+        if (concurrentSources > 1) {
+            while (sources.size() < concurrentSources) {
+                MultiplexedSource source;
+                if (!openNextSource(source))
+                    break;
+                sources.append(source);
+            }
+            open_res = !sources.isEmpty();
+        } else {
+            open_res = openNextTemplate();
+        }
 
         // We couldn't open the data source
         if (!open_res) {
@@ -695,8 +1018,22 @@ public:
     {
         int frameNumber = inputFrame->sequenceNumber;
 
+        if (deadline > 0 && frameNumber >= 0 && streamClock() - inputFrame->admitted > deadline)
+            late.ref();
+
         inputFrame->data.clear();
         inputFrame->sequenceNumber = -1;
+
+        // If anything downstream kept a reference to the frame's pixels
+        // (e.g. the stream's output) the buffer can't be recycled, the
+        // next read will allocate a new one. Reading the reference count
+        // here is safe, if it is 1 we are its only owner.
+        for (int i=0; i < inputFrame->buffers.size(); i++) {
+            cv::Mat &buffer = inputFrame->buffers[i];
+            if (buffer.refcount && *buffer.refcount > 1)
+                buffer.release();
+        }
+
         allFrames.addItem(inputFrame);
 
         bool rval = false;
@@ -775,6 +1112,12 @@ protected:
                         frameSource = new VideoReader();
                 }
             }
+
+            // Read videos continuously in the background, keeping only the newest frame,
+            // templates from galleries or the input list are never dropped.
+            if (frameMode == br::Idiocy::DropToLatest && frameSource->isVideo())
+                frameSource = new BackgroundReader(frameSource, &dropped, true);
+
             open_res = frameSource->open(curr);
             if (!open_res)
             {
@@ -786,23 +1129,180 @@ protected:
         return true;
     }
 
+    // Expected time (ms) for a frame admitted now to finish the stream
+    double estimatedLatency();
+
+    // Every multiplexed source is read on its own thread so a slow or stalled
+    // source doesn't hold back the others
+    BackgroundReader *makeReader(const Template &curr)
+    {
+        TemplateProcessor *processor;
+        if ((mode == br::Idiocy::DistributeFrames) || (mode == br::Idiocy::Auto && !curr.empty()))
+            processor = new DirectReturn();
+        else if (mode == br::Idiocy::StreamGallery)
+            processor = new StreamGallery();
+        else if (curr.file.name.right(3) == "seq")
+            processor = new SeqReader();
+        else
+            processor = new VideoReader();
+
+        const bool keepLatest = (frameMode == br::Idiocy::DropToLatest) && processor->isVideo();
+        const int step = frameMode == br::Idiocy::EveryNth ? frameStep : 1;
+        return new BackgroundReader(processor, &dropped, keepLatest, step, &notifier);
+    }
+
+    // A template being read concurrently with others
+    struct MultiplexedSource
+    {
+        BackgroundReader *reader;
+        int index;     // Index of the template in templates
+        int frame;     // Next FrameNumber for this source
+    };
+
+    // Open the next unopened template as source, returns false if there are none left
+    bool openNextSource(MultiplexedSource &source)
+    {
+        while (current_template_idx < templates.size()) {
+            Template curr = templates[current_template_idx];
+            source.reader = makeReader(curr);
+            source.index = current_template_idx++;
+            source.frame = 0;
+            if (source.reader->open(curr))
+                return true;
+            delete source.reader;
+        }
+        source.reader = NULL;
+        return false;
+    }
+
+    // Doesn't wait, ready is set if a template was read. Returns false once the source is exhausted.
+    bool readSourceFrame(MultiplexedSource &source, Template &output, cv::Mat &buffer, bool &ready)
+    {
+        if (!source.reader->tryGetNextTemplate(output, buffer, ready))
+            return false;
+        if (!ready)
+            return true;
+
+        output.file.set("SourceIndex", source.index);
+        output.file.set("FrameNumber", source.frame++);
+        if (frameMode != br::Idiocy::AllFrames)
+            output.file.set("SourceFrameNumber", source.reader->sourcePosition());
+        return true;
+    }
+
+    // Take a template from every source which has one ready, waiting only if
+    // none do. Sources which are exhausted are replaced by the next unopened
+    // template.
+    bool getNextMultiplexedFrame(FrameData &output)
+    {
+        if (output.buffers.size() < concurrentSources) {
+            output.buffers.resize(concurrentSources);
+            for (int i=0; i<output.buffers.size(); i++)
+                Arena::recycle(output.buffers[i]);
+        }
+
+        forever {
+            QList<int> exhausted;
+            {
+                QMutexLocker lock(&notifier.lock);
+                forever {
+                    for (int i=0; i<sources.size(); i++) {
+                        Template aTemplate;
+                        bool ready;
+                        if (!readSourceFrame(sources[i], aTemplate, output.buffers[i], ready))
+                            exhausted.append(i);
+                        else if (ready)
+                            output.data.append(aTemplate);
+                    }
+                    if (!output.data.isEmpty() || !exhausted.isEmpty() || sources.isEmpty())
+                        break;
+                    notifier.ready.wait(&notifier.lock);
+                }
+            }
+
+            // Closing waits for the reader's thread, which may be waiting on the notifier
+            for (int j=exhausted.size()-1; j>=0; j--) {
+                const int i = exhausted[j];
+                delete sources[i].reader;
+                if (!openNextSource(sources[i]))
+                    sources.removeAt(i);
+            }
+
+            output.sequenceNumber = next_sequence_number;
+            output.admitted = streamClock();
+            if (output.data.isEmpty()) {
+                if (sources.isEmpty())
+                    return false;
+                continue;
+            }
+
+            // Deadline admission applies to the batch as a whole
+            if (frameMode == br::Idiocy::Deadline && deadline > 0
+                && (totalFrames - allFrames.size() > 1) && estimatedLatency() > deadline) {
+                dropped.fetchAndAddRelaxed(output.data.size());
+                output.data.clear();
+                continue;
+            }
+
+            next_sequence_number++;
+            return true;
+        }
+    }
+
     bool getNextFrame(FrameData &output)
     {
+        if (concurrentSources > 1)
+            return getNextMultiplexedFrame(output);
+
         bool got_frame = false;
 
         Template aTemplate;
 
+        if (output.buffers.isEmpty()) {
+            output.buffers.resize(1);
+            Arena::recycle(output.buffers[0]);
+        }
+
         while (!got_frame)
         {
-            got_frame = frameSource->getNextTemplate(aTemplate);
+            // Skip frames excluded by the admission policy without decoding them
+            if (frameMode == br::Idiocy::EveryNth && frameStep > 1 && (source_index % frameStep != 0)) {
+                got_frame = frameSource->skipTemplate();
+                if (got_frame) {
+                    source_index++;
+                    dropped.ref();
+                    got_frame = false;
+                    continue;
+                }
+            } else {
+                got_frame = frameSource->getNextTemplate(aTemplate, output.buffers[0]);
+            }
+
+            // Drop frames we don't expect to finish before the deadline,
+            // we always admit a frame if none are in flight.
+            if (got_frame && frameMode == br::Idiocy::Deadline && deadline > 0
+                && (totalFrames - allFrames.size() > 1) && estimatedLatency() > deadline) {
+                source_index++;
+                dropped.ref();
+                got_frame = false;
+                continue;
+            }
 
             // OK we got a frame
             if (got_frame) {
+                if (frameSource->sourcePosition() >= 0)
+                    source_index = frameSource->sourcePosition();
                 // set the sequence number and tempalte of this frame
                 output.sequenceNumber = next_sequence_number;
+                output.admitted = streamClock();
                 output.data.append(aTemplate);
-                // set the frame number in the template's metadata
+                // set the frame number in the template's metadata, frames
+                // dropped by the admission policy are not counted so
+                // temporal transforms see consecutive frame numbers.
                 output.data.last().file.set("FrameNumber", output.sequenceNumber);
+                if (frameMode != br::Idiocy::AllFrames)
+                    output.data.last().file.set("SourceFrameNumber", source_index);
+                source_index++;
                 next_sequence_number++;
                 return true;
             }
@@ -815,6 +1315,7 @@ protected:
             // a frame at the top of this loop.
             if (!open_res) {
                 output.sequenceNumber = next_sequence_number;
+                output.admitted = streamClock();
                 return false;
             }
         }
@@ -839,14 +1340,21 @@ protected:
     bool is_broken;
     bool allReturned;
 
+    // Index of the next frame in the source, including dropped frames
+    int source_index;
+    QAtomicInt dropped;
+    QAtomicInt late;
+
+    int totalFrames;
     DoubleBuffer allFrames;
 
+    QList<MultiplexedSource> sources;
+    BackgroundReader::Notifier notifier;
+
     QWaitCondition lastReturned;
     QMutex last_frame_update;
 };
 
-class ProcessingStage;
-
 class BasicLoop : public QRunnable, public QFutureInterface<void>
 {
 public:
@@ -870,9 +1378,25 @@ public:
     ProcessingStage(int nThreads = 1)
     {
         thread_count = nThreads;
+        averageTime = -1;
     }
     virtual ~ProcessingStage() {}
 
+    // Exponential moving average of the time spent in run (ms)
+    void updateTime(double ms)
+    {
+        QMutexLocker lock(&timeLock);
+        averageTime = (averageTime < 0) ? ms : 0.9 * averageTime + 0.1 * ms;
+    }
+
+    double meanTime()
+    {
+        QMutexLocker lock(&timeLock);
+        return std::max(averageTime, 0.);
+    }
+
+    int threadCount() const { return thread_count; }
+
     virtual FrameData* run(FrameData *input, bool &should_continue, bool &final)=0;
 
     virtual bool tryAcquireNextStage(FrameData *& input, bool &final)=0;
@@ -883,6 +1407,17 @@ public:
 
     virtual void status()=0;
 
+    // Used to push templates issued by finalize through the remaining stages
+    virtual void projectUpdate(TemplateList &data)
+    {
+        transform->projectUpdate(data);
+    }
+
+    virtual void finalize(TemplateList &output)
+    {
+        transform->finalize(output);
+    }
+
 protected:
     int thread_count;
 
@@ -892,6 +1427,8 @@ protected:
     QThreadPool *threads;
     Transform *transform;
 
+    QMutex timeLock;
+    double averageTime;
 };
 
 class MultiThreadStage : public ProcessingStage
@@ -907,7 +1444,12 @@ public:
             qFatal("null input to multi-thread stage");
         }
 
-        input->data >> *transform;
+        {
+            Profiler::Scope scope(transform);
+            scope.input(input->data);
+            input->data >> *transform;
+            scope.output(input->data);
+        }
 
         should_continue = nextStage->tryAcquireNextStage(input, final);
 
@@ -939,6 +1481,7 @@ public:
     {
         currentStatus = STOPPING;
         next_target = 0;
+        perSource = false;
         // If the previous stage is single-threaded, queued inputs
         // are stored in a double buffer
         if (input_variance) {
@@ -953,6 +1496,7 @@ public:
 
     ~SingleThreadStage()
     {
+        clearSourceTransforms();
         delete inputBuffer;
     }
 
@@ -962,6 +1506,67 @@ public:
         currentStatus = STOPPING;
         next_target = 0;
         inputBuffer->reset();
+        clearSourceTransforms();
+    }
+
+    // When multiplexing sources, each source gets its own copy of a
+    // time-varying transform so that their state doesn't interleave.
+    bool perSource;
+    QMap<int, Transform *> sourceTransforms;
+    QList<Transform *> ownedTransforms;
+
+    Transform *sourceTransform(int source)
+    {
+        QMap<int, Transform *>::Iterator it = sourceTransforms.find(source);
+        if (it != sourceTransforms.end())
+            return it.value();
+
+        bool newTransform = false;
+        Transform *copy = transform->smartCopy(newTransform);
+        if (newTransform)
+            ownedTransforms.append(copy);
+        sourceTransforms.insert(source, copy);
+        return copy;
+    }
+
+    void clearSourceTransforms()
+    {
+        qDeleteAll(ownedTransforms);
+        ownedTransforms.clear();
+        sourceTransforms.clear();
+    }
+
+    void projectUpdate(TemplateList &data)
+    {
+        if (!perSource) {
+            transform->projectUpdate(data);
+            return;
+        }
+
+        QMap<int, TemplateList> split;
+        foreach (const Template &t, data)
+            split[t.file.get<int>("SourceIndex", -1)].append(t);
+
+        data.clear();
+        for (QMap<int, TemplateList>::Iterator it = split.begin(); it != split.end(); ++it) {
+            TemplateList output;
+            sourceTransform(it.key())->projectUpdate(it.value(), output);
+            data.append(output);
+        }
+    }
+
+    void finalize(TemplateList &output)
+    {
+        if (!perSource) {
+            transform->finalize(output);
+            return;
+        }
+
+        foreach (Transform *copy, sourceTransforms) {
+            TemplateList sourceOutput;
+            copy->finalize(sourceOutput);
+            output.append(sourceOutput);
+        }
     }
 
 
@@ -985,8 +1590,18 @@ public:
         }
         next_target = input->sequenceNumber + 1;
 
+        if (input->queued >= 0) {
+            Profiler::wait(transform, Profiler::clock() - input->queued);
+            input->queued = -1;
+        }
+
         // Project the input we got
-        transform->projectUpdate(input->data);
+        {
+            Profiler::Scope scope(transform);
+            scope.input(input->data);
+            projectUpdate(input->data);
+            scope.output(input->data);
+        }
 
         should_continue = nextStage->tryAcquireNextStage(input,final);
 
@@ -1028,6 +1643,8 @@ public:
     bool tryAcquireNextStage(FrameData *& input, bool &final)
     {
         final = false;
+        if (Profiler::enabled())
+            input->queued = Profiler::clock();
         inputBuffer->addItem(input);
 
         QReadLocker lock(&statusLock);
@@ -1177,15 +1794,38 @@ public:
     }
 };
 
+double DataSource::estimatedLatency()
+{
+    if (!stages)
+        return 0;
+
+    // The frame waits behind every frame already in flight at the slowest
+    // stage, then passes through each stage. The read stage is excluded
+    // since its time is dominated by waiting on the source.
+    double total = 0, bottleneck = 0;
+    for (int i=1; i < stages->size(); i++) {
+        const double time = stages->at(i)->meanTime();
+        total += time;
+        bottleneck = std::max(bottleneck, time / std::max(1, stages->at(i)->threadCount()));
+    }
+    const int inFlight = totalFrames - allFrames.size();
+    return total + inFlight * bottleneck;
+}
+
 void BasicLoop::run()
 {
     int current_idx = start_idx;
     FrameData *target_item = startItem;
     bool should_continue = true;
     bool the_end = false;
+    QElapsedTimer timer;
     forever
     {
-        target_item = stages->at(current_idx)->run(target_item, should_continue, the_end);
+        Arena::Scope arena;
+        timer.start();
+        ProcessingStage *stage = stages->at(current_idx);
+        target_item = stage->run(target_item, should_continue, the_end);
+        stage->updateTime(timer.nsecsElapsed() / 1e6);
         if (!should_continue) {
             break;
         }
@@ -1207,8 +1847,16 @@ public:
 
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
     Q_PROPERTY(br::Idiocy::StreamModes readMode READ get_readMode WRITE set_readMode RESET reset_readMode)
+    Q_PROPERTY(br::Idiocy::FrameModes frameMode READ get_frameMode WRITE set_frameMode RESET reset_frameMode)
+    Q_PROPERTY(int frameStep READ get_frameStep WRITE set_frameStep RESET reset_frameStep)
+    Q_PROPERTY(int deadline READ get_deadline WRITE set_deadline RESET reset_deadline)
+    Q_PROPERTY(int concurrentSources READ get_concurrentSources WRITE set_concurrentSources RESET reset_concurrentSources)
     BR_PROPERTY(int, activeFrames, 100)
     BR_PROPERTY(br::Idiocy::StreamModes, readMode, br::Idiocy::Auto)
+    BR_PROPERTY(br::Idiocy::FrameModes, frameMode, br::Idiocy::AllFrames)
+    BR_PROPERTY(int, frameStep, 1)
+    BR_PROPERTY(int, deadline, 0)
+    BR_PROPERTY(int, concurrentSources, 1)
 
     friend class StreamTransfrom;
 
@@ -1330,22 +1978,27 @@ public:
         // the data source.
         readStage->dataSource.waitLast();
 
+        if (readStage->dataSource.droppedFrames() || readStage->dataSource.lateFrames())
+            qDebug("Stream dropped %d frames, %d frames exceeded the %d ms deadline", readStage->dataSource.droppedFrames(),
+                   readStage->dataSource.lateFrames(), deadline);
+
         // Now that there are no more incoming frames, call finalize
         // on each transform in turn to collect any last templates
         // they wish to issue.
         TemplateList final_output;
 
-        // Push finalize through the stages
+        // Push finalize through the stages, processingStages[i+1] runs
+        // transforms[i] since the read stage comes first.
         for (int i=0; i < this->transforms.size(); i++)
         {
             TemplateList output_set;
-            transforms[i]->finalize(output_set);
+            processingStages[i+1]->finalize(output_set);
             if (output_set.empty())
                 continue;
 
             for (int j=i+1; j < transforms.size();j++)
             {
-                transforms[j]->projectUpdate(output_set);
+                processingStages[j+1]->projectUpdate(output_set);
             }
             final_output.append(output_set);
         }
@@ -1405,6 +2058,11 @@ public:
         // Additionally, we have a separate stage responsible for reading
         // frames from the data source
         readStage = new ReadStage(activeFrames);
+        readStage->dataSource.frameMode = frameMode;
+        readStage->dataSource.frameStep = frameStep;
+        readStage->dataSource.deadline = deadline;
+        readStage->dataSource.stages = &this->processingStages;
+        readStage->dataSource.concurrentSources = concurrentSources;
 
         processingStages.push_back(readStage);
         readStage->stage_id = 0;
@@ -1417,10 +2075,13 @@ public:
         bool prev_stage_variance = true;
         for (int i =0; i < transforms.size(); i++)
         {
-            if (stage_variance[i])
+            if (stage_variance[i]) {
                 // Whether or not the previous stage is multi-threaded controls
                 // the type of input buffer we need in a single threaded stage.
-                processingStages.append(new SingleThreadStage(prev_stage_variance));
+                SingleThreadStage *stage = new SingleThreadStage(prev_stage_variance);
+                stage->perSource = concurrentSources > 1;
+                processingStages.append(stage);
+            }
             else
                 processingStages.append(new MultiThreadStage(Globals->parallelism));
 
@@ -1527,9 +2188,17 @@ public:
 
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
     Q_PROPERTY(br::Idiocy::StreamModes readMode READ get_readMode WRITE set_readMode RESET reset_readMode)
+    Q_PROPERTY(br::Idiocy::FrameModes frameMode READ get_frameMode WRITE set_frameMode RESET reset_frameMode)
+    Q_PROPERTY(int frameStep READ get_frameStep WRITE set_frameStep RESET reset_frameStep)
+    Q_PROPERTY(int deadline READ get_deadline WRITE set_deadline RESET reset_deadline)
+    Q_PROPERTY(int concurrentSources READ get_concurrentSources WRITE set_concurrentSources RESET reset_concurrentSources)
 
     BR_PROPERTY(int, activeFrames, 100)
     BR_PROPERTY(br::Idiocy::StreamModes, readMode, br::Idiocy::Auto)
+    BR_PROPERTY(br::Idiocy::FrameModes, frameMode, br::Idiocy::AllFrames)
+    BR_PROPERTY(int, frameStep, 1)
+    BR_PROPERTY(int, deadline, 0)
+    BR_PROPERTY(int, concurrentSources, 1)
 
     bool timeVarying() const { return true; }
 
@@ -1571,6 +2240,10 @@ public:
         basis.transforms.clear();
         basis.activeFrames = this->activeFrames;
         basis.readMode = this->readMode;
+        basis.frameMode = this->frameMode;
+        basis.frameStep = this->frameStep;
+        basis.deadline = this->deadline;
+        basis.concurrentSources = this->concurrentSources;
 
         // We need at least a CompositeTransform * to acess transform's children.
         CompositeTransform *downcast = dynamic_cast<CompositeTransform *> (transform);
@@ -1643,6 +2316,10 @@ public:
         // We just want the DirectStream to begin with, so just return a copy of that.
         DirectStreamTransform *res = (DirectStreamTransform *) basis.smartCopy(newTransform);
         res->activeFrames = this->activeFrames;
+        res->frameMode = this->frameMode;
+        res->frameStep = this->frameStep;
+        res->deadline = this->deadline;
+        res->concurrentSources = this->concurrentSources;
         return res;
     }
 